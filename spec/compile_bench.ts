@@ -0,0 +1,142 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+// 编译延迟基准：src/sandbox/test 下的程序和几份典型的学生代码。
+// 编译选项在加载时确定，每种配置各运行一次，例如：
+//
+//   yarn ts-node spec/compile_bench.ts                      # 无预编译头
+//   yarn build:pch && yarn ts-node spec/compile_bench.ts    # 预编译头
+//   COMPILE_WORKERS=1 yarn ts-node spec/compile_bench.ts    # 再加预启动的编译器
+//   COMPILE_LINKER=gold yarn ts-node spec/compile_bench.ts  # 换用更快的链接器
+
+import * as fs from 'fs';
+import * as path from 'path';
+import { closeCompilerPool, compileHandler } from '../src/cpp/compile';
+
+const ROUNDS = Number(process.env.ROUNDS ?? 5);
+
+const STUDENT_SOURCES: {
+  title: string;
+  source: string;
+}[] = [
+  {
+    title: 'stdc++_sort',
+    source: `#include <bits/stdc++.h>
+using namespace std;
+int main() {
+  int n;
+  cin >> n;
+  vector<int> a(n);
+  for (auto& x : a) cin >> x;
+  sort(a.begin(), a.end());
+  for (auto x : a) cout << x << ' ';
+  cout << endl;
+}`
+  },
+  {
+    title: 'stdc++_dijkstra',
+    source: `#include <bits/stdc++.h>
+using namespace std;
+int main() {
+  int n, m;
+  cin >> n >> m;
+  vector<vector<pair<int, int>>> g(n);
+  while (m--) {
+    int u, v, w;
+    cin >> u >> v >> w;
+    g[u].emplace_back(v, w);
+  }
+  vector<long long> d(n, LLONG_MAX);
+  priority_queue<pair<long long, int>, vector<pair<long long, int>>, greater<>> q;
+  q.emplace(d[0] = 0, 0);
+  while (!q.empty()) {
+    auto [du, u] = q.top();
+    q.pop();
+    if (du != d[u]) continue;
+    for (auto [v, w] : g[u]) {
+      if (du + w < d[v]) q.emplace(d[v] = du + w, v);
+    }
+  }
+  for (auto x : d) cout << x << '\\n';
+}`
+  },
+  {
+    title: 'iostream_struct',
+    source: `#include <iostream>
+#include <string>
+#include <map>
+struct Student {
+  std::string name;
+  int score;
+};
+int main() {
+  std::map<std::string, Student> students;
+  std::string name;
+  int score;
+  while (std::cin >> name >> score) students[name] = {name, score};
+  for (const auto& [_, s] : students) std::cout << s.name << ' ' << s.score << '\\n';
+}`
+  },
+  {
+    title: 'cstdio_loop',
+    source: `#include <cstdio>
+int main() {
+  int n, sum = 0;
+  scanf("%d", &n);
+  for (int i = 1; i <= n; i++) sum += i;
+  printf("%d\\n", sum);
+}`
+  },
+];
+
+function median(values: number[]) {
+  const sorted = [...values].sort((a, b) => a - b);
+  return sorted[Math.floor(sorted.length / 2)];
+}
+
+function sleep(ms: number) {
+  return new Promise((resolve) => setTimeout(resolve, ms));
+}
+
+(async () => {
+  const testDir = path.join(__dirname, '../src/sandbox/test');
+  const sources = [
+    ...fs.readdirSync(testDir)
+      .filter((name) => name.endsWith('.cpp'))
+      .map((name) => ({ title: name, source: fs.readFileSync(path.join(testDir, name), 'utf-8') })),
+    ...STUDENT_SOURCES,
+  ];
+  console.log(`COMPILE_WORKERS=${process.env.COMPILE_WORKERS ?? 0} COMPILE_LINKER=${process.env.COMPILE_LINKER ?? ''}, ${ROUNDS} rounds`);
+  for (const { title, source } of sources) {
+    const times: number[] = [];
+    for (let i = 0; i < ROUNDS; i++) {
+      // 每轮源码不同，不命中编译缓存
+      const code = `${source}\n// round ${i} ${Date.now()}\n`;
+      const begin = process.hrtime.bigint();
+      const result = await compileHandler({ code, execute: 'none' });
+      times.push(Number(process.hrtime.bigint() - begin) / 1e6);
+      if (result.status !== 'ok') {
+        console.log(`${title}: build failed`, result);
+        break;
+      }
+      // 请求之间留出空闲，预启动的编译器得以补充
+      await sleep(500);
+    }
+    console.log(`${title.padEnd(20)} median ${median(times).toFixed(1)} ms, min ${Math.min(...times).toFixed(1)} ms`);
+  }
+  closeCompilerPool();
+})();
@@ -36,7 +36,7 @@ interface GccDiagnostic {
 }
 export type GccDiagnostics = GccDiagnostic[];
 
-export type RuntimeError = 'timeout' | 'memout' | 'violate' | 'system' | 'other';
+export type RuntimeError = 'timeout' | 'memout' | 'outlimit' | 'violate' | 'system' | 'other';
 
 export type CppCompileRequest = {
   code: string;
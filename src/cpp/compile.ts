@@ -17,16 +17,11 @@
 
 import * as path from 'path';
 import * as fs from 'fs';
-import { execFile } from 'child_process';
 import { CppCompileFileResponse, CppCompileNoneResponse, CppCompileRequest, CppCompileResponse, GccDiagnostics, } from '../api';
-import * as tmp from 'tmp';
 import { fileExecution } from '../executions/file';
 import { save } from '../db/file';
-
-type ExecCompilerResult = {
-  success: boolean;
-  stderr: string;
-}
+import { CompileCache } from './compile_cache';
+import { CompilerPool } from './compile_worker';
 
 type BuildResult = {
   success: false;
@@ -42,127 +37,114 @@ type BuildResult = {
   filename: string;
 }
 
+// 编译和链接的选项，也是编译缓存键的一部分
+const COMPILE_ARGS = ['--std=c++20'];
+const DEBUG_ARGS = ['-g'];
+// COMPILE_LINKER 指定更快的链接器（gold、lld、mold），默认为 ld.bfd
+const LINK_ARGS = ['-static', ...(process.env.COMPILE_LINKER ? [`-fuse-ld=${process.env.COMPILE_LINKER}`] : [])];
+
+// 预编译头（`yarn build:pch`，见 pch/Makefile），未构建时不使用
+const PCH_DIR = path.resolve(__dirname, 'pch/gch');
+const PCH_ARGS = fs.existsSync(PCH_DIR) ? ['-I', PCH_DIR] : [];
+
+const COMPILE_TIMEOUT = 5 * 1000;
+
 /**
- * 更改后缀名为 ext
- * @param srcPath 
- * @param ext 
- * @returns 
+ * 每组编译选项预先启动的编译器进程数，0（默认）为每次编译时启动
  */
-function changeExt(srcPath: string, ext: string) {
-  return path.join(path.dirname(srcPath), path.parse(srcPath).name + ext);
+const compilerPool = new CompilerPool(Number(process.env.COMPILE_WORKERS ?? 0), '.exe');
+
+/**
+ * 杀死预先启动的编译器进程，用于退出前（例如基准测试结束时）
+ */
+export function closeCompilerPool() {
+  compilerPool.close();
 }
 
 /**
- * 获得同路径下文件名相同的 exe 文件
- * @param srcPath 
- * @returns 
+ * 同一份代码（学生反复运行时很常见）不再重复编译链接。
+ * 只缓存确定的结果：成功、编译错误和链接错误；超时等不缓存
  */
-function getExecutablePath(srcPath: string) {
-  return changeExt(srcPath, ".exe");
+const buildCache = new CompileCache<BuildResult>();
+
+function buildArgs(debugInfo: boolean) {
+  return [
+    //...store.get('build.compileArgs').map(parseDynamic),
+    ...COMPILE_ARGS,
+    ...(debugInfo ? DEBUG_ARGS : []),
+    ...PCH_ARGS,
+    '-fdiagnostics-format=json',
+    ...LINK_ARGS,
+  ];
 }
 
-function execCompiler(srcPath: string, noLink: boolean, debugInfo: boolean): Promise<ExecCompilerResult> {
-  let outputFileName: string;
-  const cwd = path.dirname(srcPath);
-  srcPath = path.basename(srcPath);
-  let args: string[];
-  if (noLink) {
-    // 如果不进行链接
-    outputFileName = changeExt(srcPath, '.o');
-    args = [
-      //...store.get('build.compileArgs').map(parseDynamic),
-      '--std=c++20',
-      ...(debugInfo ? ['-g'] : []),
-      '-c',
-      srcPath,
-      '-o',
-      outputFileName,
-      '-fdiagnostics-format=json',
-    ];
-  } else {
-    outputFileName = getExecutablePath(srcPath);
-    args = [
-      //...store.get('build.compileArgs').map(parseDynamic),
-      srcPath,
-      '-o',
-      outputFileName,
-      '-static'
-    ];
+async function doBuild(code: string, debugInfo = false): Promise<BuildResult> {
+  const key = await buildCache.key(code, [
+    ...COMPILE_ARGS,
+    ...(debugInfo ? DEBUG_ARGS : []),
+    ...LINK_ARGS
+  ]);
+  const cached = buildCache.get(key, '.exe');
+  if (cached !== null) {
+    console.log('Compile cache hit');
+    const result = cached.value;
+    return result.success ? { ...result, filename: cached.file as string } : result;
   }
-  return new Promise((resolve) => {
-    const cp = execFile('g++', args, {
-      cwd: cwd,
-    }, (error, _, stderr) => {
-      if (error) {
-        resolve({
-          success: false,
-          stderr: stderr,
-        });
-      } else {
-        resolve({
-          success: true,
-          stderr: stderr,
-        });
-      }
-    });
-    setTimeout(() => {
-      cp.kill();
-      resolve({
-        success: false,
-        stderr: 'timeout'
-      });
-    }, 5 * 1000);
-  });
+  const result = await build(code, debugInfo);
+  if (result.success) {
+    buildCache.set(key, result, result.filename);
+  } else if (result.errorType !== 'other') {
+    buildCache.set(key, result);
+  }
+  return result;
 }
 
-async function doBuild(code: string, debugInfo = false): Promise<BuildResult> {
-  console.log('Compile begin, generate .o');
-  // generate .cpp
-  const tmpSrcFile = tmp.fileSync({
-    postfix: ".cpp"
-  });
-  fs.writeSync(tmpSrcFile.fd, code);
+/**
+ * 一次调用 g++ 完成编译和链接。cc1plus 把 JSON 诊断信息输出为 stderr
+ * 的第一行，其后是链接器等的文本输出
+ */
+async function build(code: string, debugInfo: boolean): Promise<BuildResult> {
+  console.log('Build begin');
+  const begin = Date.now();
+  const buildResult = await compilerPool.compile(code, buildArgs(debugInfo), COMPILE_TIMEOUT);
+  console.log(`Build end in ${Date.now() - begin} ms, CPU time (ms) by phase:`, buildResult.phases);
 
-  // generate .o
-  const compileResult = await execCompiler(tmpSrcFile.name, true, debugInfo);
-  tmpSrcFile.removeCallback();
+  const stderr = buildResult.stderr;
+  const newline = stderr.indexOf('\n');
   let diagnostics: GccDiagnostics;
   try {
-    diagnostics = JSON.parse(compileResult.stderr);
+    diagnostics = JSON.parse(newline === -1 ? stderr : stderr.substring(0, newline));
   } catch (e) {
     console.log(e);
     console.log('fail to parse compile result stderr');
+    fs.rmSync(buildResult.output, { force: true });
     return {
       success: false,
       errorType: 'other',
-      error: compileResult.stderr,
+      error: stderr,
     };
   }
-  if (!compileResult.success) {
+  if (buildResult.success) {
     return {
-      success: false,
-      errorType: 'compile',
+      success: true,
       error: diagnostics,
+      filename: buildResult.output,
     };
   }
-
-  // generate .exe
-  const linkResult = await execCompiler(changeExt(tmpSrcFile.name, '.o'), false, debugInfo);
-  fs.unlinkSync(changeExt(tmpSrcFile.name, '.o'));
-  if (!linkResult.success) {
+  fs.rmSync(buildResult.output, { force: true });
+  // 有错误（包括 fatal error）则是编译失败，否则是链接失败
+  if (diagnostics.some((d) => d.kind !== 'warning' && d.kind !== 'note')) {
     return {
       success: false,
-      errorType: 'link',
-      error: linkResult.stderr,
-    };
-  } else {
-    return {
-      success: true,
+      errorType: 'compile',
       error: diagnostics,
-      filename: getExecutablePath(tmpSrcFile.name),
     };
   }
-
+  return {
+    success: false,
+    errorType: 'link',
+    error: stderr.substring(newline + 1),
+  };
 }
 export async function compileHandler(request: CppCompileRequest): Promise<CppCompileResponse> {
   console.log('Receive compile request');
@@ -177,6 +159,7 @@ export async function compileHandler(request: CppCompileRequest): Promise<CppCom
   }
   switch (request.execute) {
     case 'none': {
+      fs.unlinkSync(compileResult.filename);
       return <CppCompileNoneResponse>{
         status: 'ok',
         execute: request.execute,
@@ -186,6 +169,7 @@ export async function compileHandler(request: CppCompileRequest): Promise<CppCom
     case 'file': {
       const stdin = request.stdin ?? "";
       const executionResult = await fileExecution(compileResult.filename, stdin);
+      fs.unlinkSync(compileResult.filename);
       return <CppCompileFileResponse>{
         status: 'ok',
         execute: 'file',
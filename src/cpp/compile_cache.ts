@@ -0,0 +1,164 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+import * as path from 'path';
+import * as fs from 'fs';
+import { createHash } from 'crypto';
+import { execFile } from 'child_process';
+import * as tmp from 'tmp';
+
+/**
+ * 缓存总大小上限（字节），超出时按 LRU 淘汰
+ */
+const CACHE_SIZE = Number(process.env.COMPILE_CACHE_SIZE ?? 256 * 1024 * 1024);
+
+type CacheEntry<T> = {
+  value: T;
+  // 缓存目录中的文件（可执行文件的硬链接），淘汰时删除
+  file?: string;
+  size: number;
+};
+
+let compilerVersion: Promise<string> | null = null;
+
+/**
+ * 编译器版本（`g++ --version`），升级编译器后旧的缓存自然失效
+ */
+function getCompilerVersion(): Promise<string> {
+  if (compilerVersion === null) {
+    compilerVersion = new Promise((resolve) => {
+      execFile('g++', ['--version'], (error, stdout) => {
+        resolve(error ? '' : stdout);
+      });
+    });
+  }
+  return compilerVersion;
+}
+
+/**
+ * 优先硬链接，跨文件系统时复制
+ * @param src
+ * @param dest
+ */
+function linkOrCopy(src: string, dest: string) {
+  try {
+    fs.linkSync(src, dest);
+  } catch (e) {
+    fs.copyFileSync(src, dest);
+  }
+}
+
+/**
+ * 以源码内容寻址的编译缓存。键由源码、编译器版本和编译选项共同决定；
+ * 值为构建结果（诊断信息等），可附带一个文件（可执行文件）。
+ * 文件以硬链接存入缓存目录并以硬链接取出，因此缓存与调用者各自删除
+ * 自己的路径即可，淘汰不影响正在使用的文件。
+ */
+export class CompileCache<T> {
+  // Map 按插入顺序迭代：最前面的是最久未用的
+  private entries = new Map<string, CacheEntry<T>>();
+  private size = 0;
+  private dir: string | null = null;
+
+  constructor(private capacity = CACHE_SIZE) { }
+
+  async key(code: string, args: string[]): Promise<string> {
+    const version = await getCompilerVersion();
+    return createHash('sha256')
+      .update(JSON.stringify([version, args, code]))
+      .digest('hex');
+  }
+
+  /**
+   * 查找缓存
+   * @param key
+   * @param ext 取出文件的后缀名
+   * @returns 命中时返回值和取出的文件路径（调用者负责删除），否则 `null`
+   */
+  get(key: string, ext: string): { value: T; file?: string } | null {
+    const entry = this.entries.get(key);
+    if (!entry) {
+      return null;
+    }
+    let file: string | undefined;
+    if (entry.file) {
+      try {
+        file = tmp.tmpNameSync({ postfix: ext });
+        linkOrCopy(entry.file, file);
+      } catch (e) {
+        console.log('compile cache: ', e);
+        this.remove(key);
+        return null;
+      }
+    }
+    // 移到最后，即最近使用
+    this.entries.delete(key);
+    this.entries.set(key, entry);
+    return { value: entry.value, file };
+  }
+
+  /**
+   * 存入缓存。`file` 仍归调用者所有
+   * @param key
+   * @param value
+   * @param file
+   */
+  set(key: string, value: T, file?: string) {
+    this.remove(key);
+    let size = JSON.stringify(value).length;
+    let cached: string | undefined;
+    if (file) {
+      try {
+        size += fs.statSync(file).size;
+        if (size > this.capacity) {
+          return;
+        }
+        if (this.dir === null) {
+          this.dir = tmp.dirSync({ prefix: 'compile-cache-', unsafeCleanup: true }).name;
+        }
+        cached = path.join(this.dir, key + path.extname(file));
+        fs.rmSync(cached, { force: true });
+        linkOrCopy(file, cached);
+      } catch (e) {
+        console.log('compile cache: ', e);
+        return;
+      }
+    } else if (size > this.capacity) {
+      return;
+    }
+    this.entries.set(key, { value, file: cached, size });
+    this.size += size;
+    for (const oldest of this.entries.keys()) {
+      if (this.size <= this.capacity) {
+        break;
+      }
+      this.remove(oldest);
+    }
+  }
+
+  private remove(key: string) {
+    const entry = this.entries.get(key);
+    if (!entry) {
+      return;
+    }
+    this.entries.delete(key);
+    this.size -= entry.size;
+    if (entry.file) {
+      fs.rmSync(entry.file, { force: true });
+    }
+  }
+}
@@ -0,0 +1,200 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+import * as os from 'os';
+import * as fs from 'fs';
+import { ChildProcess, spawn } from 'child_process';
+import { Socket } from 'net';
+import * as tmp from 'tmp';
+
+/**
+ * 各阶段（cc1plus、as、collect2 即链接）的 CPU 时间（毫秒），由 `g++ -time=` 得到
+ */
+export type PhaseTimes = { [program: string]: number };
+
+export type WarmCompileResult = {
+  success: boolean;
+  stderr: string;
+  // 输出文件的路径，调用者负责删除
+  output: string;
+  phases: PhaseTimes;
+};
+
+type Worker = {
+  cp: ChildProcess;
+  output: string;
+  timeFile: string;
+  stderr: Buffer[];
+  exited: Promise<number | null>;
+};
+
+/**
+ * 空闲进程不应让 Node 进程保持运行：取消对子进程及其管道的引用，
+ * 取走编译时再恢复
+ * @param worker
+ * @param ref
+ */
+function setRef(worker: Worker, ref: boolean) {
+  const cp = worker.cp;
+  for (const stream of [cp.stdin, cp.stdout, cp.stderr]) {
+    const socket = stream as unknown as Socket | null;
+    if (ref) {
+      socket?.ref();
+    } else {
+      socket?.unref();
+    }
+  }
+  if (ref) {
+    cp.ref();
+  } else {
+    cp.unref();
+  }
+}
+
+/**
+ * 读取 `-time=` 的记录：每行为 `user sys program args...`
+ * @param timeFile
+ */
+function readPhaseTimes(timeFile: string): PhaseTimes {
+  const phases: PhaseTimes = {};
+  try {
+    for (const line of fs.readFileSync(timeFile, 'utf-8').split('\n')) {
+      const [user, sys, program] = line.split(' ');
+      if (program !== undefined) {
+        phases[program] = (phases[program] ?? 0) + (Number(user) + Number(sys)) * 1000;
+      }
+    }
+    fs.unlinkSync(timeFile);
+  } catch (e) {
+    // 没有运行到任何阶段
+  }
+  for (const program in phases) {
+    phases[program] = Math.round(phases[program]);
+  }
+  return phases;
+}
+
+/**
+ * 从标准输入读取源码的编译器进程池，可以预先启动。
+ * `g++ -x c++ -` 启动后立即运行 cc1plus 并阻塞在读 stdin 上，因此
+ * 请求到来时进程创建、动态链接和初始化都已完成，只需写入源码。
+ * 每组编译选项各保留 `size` 个空闲进程，取走一个就补充一个；
+ * `size` 为 0 时每次编译时启动。
+ */
+export class CompilerPool {
+  private idle = new Map<string, Worker[]>();
+  private closed = false;
+
+  /**
+   * @param size 每组编译选项的空闲进程数
+   * @param ext 输出文件的后缀名
+   */
+  constructor(private size: number, private ext: string) { }
+
+  private spawn(args: string[]): Worker {
+    const output = tmp.tmpNameSync({ postfix: this.ext });
+    const timeFile = output + '.time';
+    // 自成进程组：超时时连同 cc1plus 一起杀死，只杀 g++ 的话 cc1plus 会继续运行
+    const cp = spawn('g++', [...args, `-time=${timeFile}`, '-x', 'c++', '-', '-o', output], {
+      cwd: os.tmpdir(),
+      detached: true,
+    });
+    const stderr: Buffer[] = [];
+    cp.stderr?.on('data', (chunk: Buffer) => stderr.push(chunk));
+    // 进程可能不读完源码就退出
+    cp.stdin?.on('error', () => undefined);
+    const exited = new Promise<number | null>((resolve) => {
+      cp.on('error', () => resolve(null));
+      cp.on('close', (code) => resolve(code));
+    });
+    return { cp, output, timeFile, stderr, exited };
+  }
+
+  private refill(key: string, args: string[]) {
+    if (this.closed) {
+      return;
+    }
+    const workers = this.idle.get(key) ?? [];
+    this.idle.set(key, workers);
+    while (workers.length < this.size) {
+      const worker = this.spawn(args);
+      setRef(worker, false);
+      workers.push(worker);
+    }
+  }
+
+  /**
+   * 杀死所有空闲进程，此后不再预先启动；正在进行的编译不受影响
+   */
+  close() {
+    this.closed = true;
+    for (const workers of this.idle.values()) {
+      for (const worker of workers) {
+        try {
+          process.kill(-(worker.cp.pid as number), 'SIGKILL');
+        } catch (e) {
+          // 已经退出
+        }
+        fs.rmSync(worker.timeFile, { force: true });
+      }
+    }
+    this.idle.clear();
+  }
+
+  /**
+   * 编译源码
+   * @param code 源码
+   * @param args 编译选项，不含输入和输出文件
+   * @param timeout 超时（毫秒），从写入源码时开始计算
+   */
+  async compile(code: string, args: string[], timeout: number): Promise<WarmCompileResult> {
+    const key = JSON.stringify(args);
+    const workers = this.idle.get(key) ?? [];
+    let worker: Worker | undefined;
+    while ((worker = workers.shift()) !== undefined) {
+      // 空闲时已经退出的（例如被杀死）不能再用
+      if (worker.cp.exitCode === null && worker.cp.signalCode === null) {
+        break;
+      }
+    }
+    if (worker === undefined) {
+      worker = this.spawn(args);
+    } else {
+      setRef(worker, true);
+    }
+    this.refill(key, args);
+
+    const cp = worker.cp;
+    cp.stdin?.end(code);
+    const timer = setTimeout(() => {
+      try {
+        process.kill(-(cp.pid as number), 'SIGKILL');
+      } catch (e) {
+        // 已经退出
+      }
+    }, timeout);
+    const exitCode = await worker.exited;
+    clearTimeout(timer);
+    const timedOut = cp.signalCode !== null;
+    return {
+      success: exitCode === 0,
+      stderr: timedOut ? 'timeout' : Buffer.concat(worker.stderr).toString('utf-8'),
+      output: worker.output,
+      phases: readPhaseTimes(worker.timeFile),
+    };
+  }
+}
@@ -16,9 +16,8 @@
 // along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
 
 
-import * as fs from 'fs';
-import * as tmp from 'tmp';
-import { execFile } from 'child_process';
+import { spawn } from 'child_process';
+import { Readable } from 'stream';
 import { FileExecutionResult } from '../api';
 import path from 'path';
 import { constants } from 'os';
@@ -27,103 +26,164 @@ export type SandboxResult = {
   success: boolean;
   cpu_time: number;
   real_time: number;
+  // 微秒，版本 2 起
+  cpu_time_us?: number;
+  real_time_us?: number;
+  // perf 计数器，版本 3 起，仅在 --perf-counters 时；-1 为不可用
+  instructions?: number;
+  cycles?: number;
+  context_switches?: number;
+  page_faults?: number;
+  major_faults?: number;
   memory: number;
   signal: number;
   exit_code: number;
   result: number;
 
 };
+
+/**
+ * 程序 stdout、stderr 各自的输出上限（字节），超出时沙盒杀死程序，结果为 9
+ */
+export const MAX_OUTPUT_SIZE = Number(process.env.MAX_OUTPUT_SIZE ?? 16 * 1024 * 1024);
+
+/**
+ * 解码沙盒的二进制结果（--result_format=binary），格式见 src/sandbox/README.md
+ * 新版本只会在末尾追加字段，故忽略不认识的尾部
+ */
+function readInt64LE(frame: Buffer, offset: number): number {
+  return frame.readUInt32LE(offset) + frame.readInt32LE(offset + 4) * 2 ** 32;
+}
+
+export function decodeSandboxResult(frame: Buffer): SandboxResult {
+  if (frame.length < 8 || frame.toString('latin1', 0, 4) !== 'CSBR') {
+    throw new Error("Bad sandbox result");
+  }
+  const length = frame.readUInt16LE(6);
+  if (length < 28 || frame.length < 8 + length) {
+    throw new Error("Bad sandbox result");
+  }
+  const result: SandboxResult = {
+    success: frame.readUInt8(8) === 1,
+    result: frame.readUInt8(10),
+    signal: frame.readInt32LE(12),
+    exit_code: frame.readInt32LE(16),
+    cpu_time: frame.readInt32LE(20),
+    real_time: frame.readInt32LE(24),
+    memory: readInt64LE(frame, 28),
+  };
+  if (length >= 44) {
+    result.cpu_time_us = readInt64LE(frame, 36);
+    result.real_time_us = readInt64LE(frame, 44);
+  }
+  if (length >= 84 && (frame.readUInt8(11) & 1)) {
+    result.instructions = readInt64LE(frame, 52);
+    result.cycles = readInt64LE(frame, 60);
+    result.context_switches = readInt64LE(frame, 68);
+    result.page_faults = readInt64LE(frame, 76);
+    result.major_faults = readInt64LE(frame, 84);
+  }
+  return result;
+}
+
 export function fileExecution(exePath: string, stdin: string): Promise<FileExecutionResult> {
-  const tmpStdinFile = tmp.fileSync({
-    postfix: ".txt"
-  });
-  fs.writeFileSync(tmpStdinFile.fd, stdin);
-  const tmpStderrFile = tmp.fileSync({
-    postfix: ".txt"
-  });
-  const tmpStdoutFile = tmp.fileSync({
-    postfix: ".txt"
-  });
-  const tmpResultFile = tmp.fileSync({
-    postfix: ".json"
-  });
   return new Promise((resolve) => {
-    execFile(path.join(__dirname, '../sandbox/bin/sandbox'), [
+    const stdout: Buffer[] = [];
+    const stderr: Buffer[] = [];
+    const resultFrame: Buffer[] = [];
+    // 标准输入输出经由 memfd 传递，结果写入 fd 3 上的管道，不再使用临时文件
+    const cp = spawn(path.join(__dirname, '../sandbox/bin/sandbox'), [
       `--exe_path=${exePath}`,
       '--max_real_time=1000',
-      `--input_path=${tmpStdinFile.name}`,
-      `--output_path=${tmpStdoutFile.name}`,
-      `--error_path=${tmpStderrFile.name}`,
-      `--result_path=${tmpResultFile.name}`,
+      `--max_output_size=${MAX_OUTPUT_SIZE}`,
+      '--memfd-io',
+      '--result_fd=3',
+      '--result_format=binary',
       `--log_path=/dev/null`
-    ],
-      (error) => {
-        if (error) {
-          // 沙盒主进程崩溃
-          console.log('Fail to execute');
+    ], {
+      stdio: ['pipe', 'pipe', 'pipe', 'pipe']
+    });
+    cp.stdout?.on('data', (chunk: Buffer) => stdout.push(chunk));
+    cp.stderr?.on('data', (chunk: Buffer) => stderr.push(chunk));
+    (cp.stdio[3] as Readable).on('data', (chunk: Buffer) => resultFrame.push(chunk));
+    // 沙盒可能不读完输入就退出
+    cp.stdin?.on('error', () => undefined);
+    cp.stdin?.end(stdin);
+    let failed = false;
+    cp.on('error', () => {
+      failed = true;
+    });
+    cp.on('close', (code) => {
+      if (failed || code !== 0) {
+        // 沙盒主进程崩溃
+        console.log('Fail to execute');
+        resolve({
+          result: 'error',
+          reason: 'system',
+          stderr: '',
+          stdout: ''
+        });
+      } else {
+        // 沙盒执行完成
+        try {
+          const resultIo = {
+            stdout: Buffer.concat(stdout).toString('utf-8'),
+            stderr: Buffer.concat(stderr).toString('utf-8')
+          };
+          const result = decodeSandboxResult(Buffer.concat(resultFrame));
+          console.log(result);
+          if (!result.success) throw new Error("Sandbox failed");
+          if (result.result === 0) {
+            // SUCCESS
+            resolve({
+              result: 'ok',
+              exitCode: result.exit_code,
+              ...resultIo
+            });
+          } else if (result.result === 1 || result.result === 2 || result.result === 7) {
+            // CPU_TIME_LIMIT_EXCEEDED, REAL_TIME_LIMIT_EXCEEDED, INSTRUCTION_LIMIT_EXCEEDED
+            resolve({
+              result: 'error',
+              reason: 'timeout',
+              ...resultIo
+            });
+          } else if (result.result === 3) {
+            // MEMORY_LIMIT_EXCEEDED
+            resolve({
+              result: 'error',
+              reason: 'memout',
+              ...resultIo
+            });
+          } else if (result.result === 9) {
+            // OUTPUT_LIMIT_EXCEEDED
+            resolve({
+              result: 'error',
+              reason: 'outlimit',
+              ...resultIo
+            });
+          } else if (result.result === 4) {
+            // RUNTIME_ERROR
+            resolve({
+              result: 'error',
+              reason: result.signal === constants.signals.SIGSYS ? 'violate' : 'other',
+              ...resultIo
+            });
+          } else {
+            resolve({
+              result: 'error',
+              reason: 'system',
+              ...resultIo
+            });
+          }
+        } catch (_) {
           resolve({
             result: 'error',
             reason: 'system',
             stderr: '',
             stdout: ''
           });
-        } else {
-          // 沙盒执行完成
-          try {
-            const resultIo = {
-              stdout: fs.readFileSync(tmpStdoutFile.name, 'utf-8'),
-              stderr: fs.readFileSync(tmpStderrFile.name, 'utf-8')
-            };
-            const result: SandboxResult = JSON.parse(fs.readFileSync(tmpResultFile.name, 'utf-8'));
-            console.log(result);
-            tmpStdoutFile.removeCallback();
-            tmpStderrFile.removeCallback();
-            tmpResultFile.removeCallback();
-            if (!result.success) throw new Error("Sandbox failed");
-            if (result.result === 0) {
-              // SUCCESS
-              resolve({
-                result: 'ok',
-                exitCode: result.exit_code,
-                ...resultIo
-              });
-            } else if (result.result === 1 || result.result === 2) {
-              // CPU_TIME_LIMIT_EXCEEDED, REAL_TIME_LIMIT_EXCEEDED,
-              resolve({
-                result: 'error',
-                reason: 'timeout',
-                ...resultIo
-              });
-            } else if (result.result === 3) {
-              // MEMORY_LIMIT_EXCEEDED
-              resolve({
-                result: 'error',
-                reason: 'memout',
-                ...resultIo
-              });
-            } else if (result.result === 4) {
-              // RUNTIME_ERROR
-              resolve({
-                result: 'error',
-                reason: result.signal === constants.signals.SIGSYS ? 'violate' : 'other',
-                ...resultIo
-              });
-            } else {
-              resolve({
-                result: 'error',
-                reason: 'system',
-                ...resultIo
-              });
-            }
-          } catch (_) {
-            resolve({
-              result: 'error',
-              reason: 'system',
-              stderr: '',
-              stdout: ''
-            });
-          }
         }
-      });
+      }
+    });
   });
 }
@@ -17,11 +17,11 @@
 
 import ws from "ws";
 import { WsExecuteC2S, WsExecuteS2C } from '../api';
-import * as pty from "node-pty";
 import { query } from '../db/file';
-import * as tmp from 'tmp';
 import * as fs from 'fs';
-import { SandboxResult } from './file';
+import { StringDecoder } from 'string_decoder';
+import { MAX_OUTPUT_SIZE, SandboxResult } from './file';
+import { openSession, Session } from './session_client';
 import { constants } from 'os';
 
 export function findExecution(id: string): Promise<string | null> {
@@ -29,10 +29,9 @@ export function findExecution(id: string): Promise<string | null> {
 }
 export function interactiveExecution(ws: ws, filename: string) {
 
-  const tmpResultFile = tmp.fileSync({
-    postfix: ".json"
-  });
-  let ptyProcess: null | pty.IPty = null;
+  let session: null | Session = null;
+  // 一个字符的 UTF-8 编码可能分在两帧中
+  const decoder = new StringDecoder('utf-8');
 
   function send(data: WsExecuteS2C) {
     console.log("sent: ", data);
@@ -40,9 +39,8 @@ export function interactiveExecution(ws: ws, filename: string) {
   }
 
   function close() {
-    tmpResultFile.removeCallback();
-    if (ptyProcess !== null) {
-      ptyProcess.kill();
+    if (session !== null) {
+      session.close();
     }
     if (fs.existsSync(filename)) {
       fs.unlinkSync(filename);
@@ -51,107 +49,89 @@ export function interactiveExecution(ws: ws, filename: string) {
     console.log("closed");
   }
 
+  function onResult(result: SandboxResult | null) {
+    if (ws.readyState === ws.CLOSED) return;
+    if (result === null || !result.success) {
+      send({ type: 'error', reason: 'system' });
+      console.log('交互式运行时，沙箱未正常退出');
+      return;
+    }
+    console.log("result: ", result);
+    if (result.exit_code !== 0) {
+      send({ type: 'error', reason: 'system' });
+      return;
+    }
+    if (result.result === 0) {
+      // SUCCESS
+      send({
+        type: 'closed',
+        exitCode: 0
+      });
+    } else if (result.result === 1 || result.result === 2 || result.result === 7) {
+      // CPU_TIME_LIMIT_EXCEEDED, REAL_TIME_LIMIT_EXCEEDED, INSTRUCTION_LIMIT_EXCEEDED
+      send({
+        type: 'error',
+        reason: 'timeout',
+      });
+    } else if (result.result === 3) {
+      // MEMORY_LIMIT_EXCEEDED
+      send({
+        type: 'error',
+        reason: 'memout',
+      });
+    } else if (result.result === 9) {
+      // OUTPUT_LIMIT_EXCEEDED
+      send({
+        type: 'error',
+        reason: 'outlimit',
+      });
+    } else if (result.result === 4) {
+      // RUNTIME_ERROR
+      send({
+        type: 'error',
+        reason: result.signal === constants.signals.SIGSYS ? 'violate' : 'other',
+      });
+    } else {
+      send({
+        type: 'error',
+        reason: 'system',
+      });
+      console.log("UNKNOWN RESULT TYPE");
+    }
+  }
+
   ws.on('message', function (req: Buffer) {
     const reqObj: WsExecuteC2S = JSON.parse(req.toString());
     console.log("request: ", reqObj);
     if (reqObj.type === 'start') {
-      ptyProcess = pty.spawn('../sandbox/bin/sandbox', [
-        `--exe_path=${filename}`,
-        '--max_cpu_time=1000',
-        `--result_path=${tmpResultFile.name}`,
-        `--log_path=/dev/null`
-      ], {
-        cwd: __dirname,
-        env: process.env as { [key: string]: string },
+      session = openSession({
+        exe_path: filename,
+        max_cpu_time: 1000,
+        max_output_size: MAX_OUTPUT_SIZE,
+      }, {
+        onOutput: (data) => send({ type: 'tout', content: decoder.write(data) }),
+        onResult,
       });
-      if (ptyProcess === null) {
-        send({ type: 'error', reason: 'system' });
-        return;
-      }
       send({ type: 'started' });
-      ptyProcess.onData(function (data) {
-        send({ type: 'tout', content: data });
-      });
-      ptyProcess.onExit(function (data) {
-        if (ws.readyState === ws.CLOSED) return;
-        if (data.exitCode !== 0) {
-          send({ type: 'error', reason: 'system' });
-          console.log('交互式运行时，沙箱未正常退出');
-          return;
-        }
-        let result: SandboxResult = {
-          success: true,
-          cpu_time: -1,
-          real_time: -1,
-          result: 4,
-          memory: -1,
-          signal: 2, // SIGINT
-          exit_code: 127
-        };
-        try {
-          const str = fs.readFileSync(tmpResultFile.name, 'utf-8');
-          console.log("result: ", str);
-          result = JSON.parse(str);
-          tmpResultFile.removeCallback();
-        } catch {
-          // do nothing
-        }
-        if (result.exit_code !== 0) {
-          send({ type: 'error', reason: 'system' });
-          return;
-        }
-        if (result.result === 0) {
-          // SUCCESS
-          send({
-            type: 'closed',
-            exitCode: 0
-          });
-        } else if (result.result === 1 || result.result === 2) {
-          // CPU_TIME_LIMIT_EXCEEDED, REAL_TIME_LIMIT_EXCEEDED,
-          send({
-            type: 'error',
-            reason: 'timeout',
-          });
-        } else if (result.result === 3) {
-          // MEMORY_LIMIT_EXCEEDED
-          send({
-            type: 'error',
-            reason: 'memout',
-          });
-        } else if (result.result === 4) {
-          // RUNTIME_ERROR
-          send({
-            type: 'error',
-            reason: result.signal === constants.signals.SIGSYS ? 'violate' : 'other',
-          });
-        } else {
-          send({
-            type: 'error',
-            reason: 'system',
-          });
-          console.log("UNKNOWN RESULT TYPE");
-        }
-        return;
-      });
     } else if (reqObj.type === 'shutdown') {
       close();
     } else if (reqObj.type === 'eof') {
-      if (ptyProcess === null) {
+      if (session === null) {
         send({ type: 'error', reason: 'system' });
         console.log("NOT STARTED");
         return;
       }
-      ptyProcess.write('\x04');
+      session.end();
 
     } else if (reqObj.type === 'tin') {
-      if (ptyProcess === null) {
+      if (session === null) {
         send({ type: 'error', reason: 'system' });
         console.log("NOT STARTED");
         return;
       }
 
       const input = reqObj.content;
-      ptyProcess.write(input);
+      session.write(input);
     }
   });
 
@@ -0,0 +1,201 @@
+// Copyright (C) 2021 Clavicode Team
+// 
+// This file is part of clavicode-backend.
+// 
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+import * as net from 'net';
+import * as path from 'path';
+import { spawn } from 'child_process';
+import * as tmp from 'tmp';
+import { decodeSandboxResult, SandboxResult } from './file';
+
+// 帧格式见 src/sandbox/src/session.h：类型、会话号、长度（小端）、内容
+const HEADER_SIZE = 9;
+const FRAME = {
+  OPEN: 'O',
+  INPUT: 'I',
+  END_OF_INPUT: 'E',
+  CLOSE: 'C',
+  OUTPUT: 'o',
+  RESULT: 'r',
+};
+
+export type SessionHandlers = {
+  onOutput: (data: Buffer) => void;
+  // 沙盒出错时为 null
+  onResult: (result: SandboxResult | null) => void;
+};
+
+export interface Session {
+  write(data: string): void;
+  // 相当于在终端上按 Ctrl+D
+  end(): void;
+  // 结束程序，此后不再有任何回调
+  close(): void;
+}
+
+function frame(type: string, id: number, payload: string | Buffer = '') {
+  const body = typeof payload === 'string' ? Buffer.from(payload, 'utf-8') : payload;
+  const header = Buffer.alloc(HEADER_SIZE);
+  header.write(type, 0, 'latin1');
+  header.writeUInt32LE(id, 1);
+  header.writeUInt32LE(body.length, 5);
+  return Buffer.concat([header, body]);
+}
+
+function sleep(ms: number) {
+  return new Promise((resolve) => setTimeout(resolve, ms));
+}
+
+/**
+ * 所有交互式运行共用的一个沙盒进程（`sandbox --sessions`）及其连接。
+ * 每个会话在沙盒中有自己的伪终端，输出由沙盒合并成帧后送回。
+ * 沙盒进程在第一次使用时启动，退出后下次使用时重新启动。
+ */
+class SessionServer {
+  private socket: Promise<net.Socket> | null = null;
+  private sessions = new Map<number, SessionHandlers>();
+  private nextId = 0;
+  private buffer = Buffer.alloc(0);
+
+  private async start(): Promise<net.Socket> {
+    const socketPath = tmp.tmpNameSync({ postfix: '.sock' });
+    const cp = spawn(path.join(__dirname, '../sandbox/bin/sandbox'), [
+      '--sessions',
+      `--socket_path=${socketPath}`,
+      '--log_path=/dev/null'
+    ], {
+      stdio: 'ignore'
+    });
+    // 随后端一同退出；沙盒先退出时移除，以免每次重启都留下一个监听器
+    const kill = () => cp.kill();
+    process.on('exit', kill);
+    let exited = false;
+    cp.on('error', () => {
+      exited = true;
+      process.off('exit', kill);
+    });
+    cp.on('exit', () => {
+      exited = true;
+      process.off('exit', kill);
+    });
+    // 等待沙盒开始监听
+    for (let retry = 0; ; retry++) {
+      try {
+        return await new Promise<net.Socket>((resolve, reject) => {
+          const socket = net.connect(socketPath, () => resolve(socket));
+          socket.on('error', reject);
+        });
+      } catch (e) {
+        if (exited || retry >= 50) {
+          cp.kill();
+          throw e;
+        }
+        await sleep(20);
+      }
+    }
+  }
+
+  private connect(): Promise<net.Socket> {
+    if (this.socket === null) {
+      this.socket = this.start().then((socket) => {
+        socket.removeAllListeners('error');
+        socket.on('data', (chunk: Buffer) => this.receive(chunk));
+        socket.on('error', (e) => console.log('session server: ', e));
+        socket.on('close', () => this.reset());
+        return socket;
+      });
+      this.socket.catch(() => this.reset());
+    }
+    return this.socket;
+  }
+
+  // 连接断开：进行中的会话都失败
+  private reset() {
+    this.socket = null;
+    this.buffer = Buffer.alloc(0);
+    const sessions = [...this.sessions.values()];
+    this.sessions.clear();
+    for (const handlers of sessions) {
+      handlers.onResult(null);
+    }
+  }
+
+  private receive(chunk: Buffer) {
+    this.buffer = Buffer.concat([this.buffer, chunk]);
+    let offset = 0;
+    while (this.buffer.length - offset >= HEADER_SIZE) {
+      const type = this.buffer.toString('latin1', offset, offset + 1);
+      const id = this.buffer.readUInt32LE(offset + 1);
+      const size = this.buffer.readUInt32LE(offset + 5);
+      if (this.buffer.length - offset < HEADER_SIZE + size) {
+        break;
+      }
+      const payload = this.buffer.subarray(offset + HEADER_SIZE, offset + HEADER_SIZE + size);
+      offset += HEADER_SIZE + size;
+      const handlers = this.sessions.get(id);
+      if (handlers === undefined) {
+        continue;
+      }
+      if (type === FRAME.OUTPUT) {
+        handlers.onOutput(payload);
+      } else if (type === FRAME.RESULT) {
+        this.sessions.delete(id);
+        let result: SandboxResult | null = null;
+        try {
+          result = decodeSandboxResult(payload);
+        } catch (e) {
+          console.log('session server: ', e);
+        }
+        handlers.onResult(result);
+      }
+    }
+    this.buffer = this.buffer.subarray(offset);
+  }
+
+  /**
+   * 开始一个会话
+   * @param options 运行选项，与沙盒的命令行选项同名
+   * @param handlers
+   */
+  open(options: { [key: string]: string | number }, handlers: SessionHandlers): Session {
+    const id = this.nextId;
+    this.nextId = (this.nextId + 1) % 2 ** 32;
+    this.sessions.set(id, handlers);
+    const send = (type: string, payload?: string) => {
+      if (!this.sessions.has(id)) {
+        return;
+      }
+      this.connect()
+        .then((socket) => socket.write(frame(type, id, payload)))
+        .catch(() => undefined);
+    };
+    send(FRAME.OPEN, Object.entries(options).map(([key, value]) => `${key} = ${value}\n`).join(''));
+    return {
+      write: (data) => send(FRAME.INPUT, data),
+      end: () => send(FRAME.END_OF_INPUT),
+      close: () => {
+        send(FRAME.CLOSE);
+        this.sessions.delete(id);
+      },
+    };
+  }
+}
+
+const server = new SessionServer();
+
+export function openSession(options: { [key: string]: string | number }, handlers: SessionHandlers): Session {
+  return server.open(options, handlers);
+}
@@ -0,0 +1,94 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+// Helpers shared by the latency benchmarks.
+
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "runner.h"
+#include "zygote.h"
+
+inline long now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// A run of `exe`, which prints the monotonic time at which its main()
+// starts, into the memfd `output_fd`.
+inline SandboxConfig stamp_config(const char* exe, int output_fd) {
+  SandboxConfig config{};
+  config.max_cpu_time = 1000;
+  config.max_real_time = 1000;
+  config.max_memory = UNLIMITED;
+  config.max_stack = 8 << 20;
+  config.max_process_number = UNLIMITED;
+  config.max_output_size = UNLIMITED;
+  config.output_keep = UNLIMITED;
+  config.max_instructions = UNLIMITED;
+  config.policy = "c_cpp";
+  config.check_mode = "lines";
+  config.exe_path = exe;
+  config.args = {config.exe_path};
+  // As in batch mode: the child opens the memfd through its own fd table.
+  config.output_path = "/proc/self/fd/" + std::to_string(output_fd);
+  config.result_fd = -1;
+  return config;
+}
+
+// Microseconds from calling run() to main() of the program. Without
+// init_log() records are dropped, so this measures the sandbox and not the
+// log file.
+inline double submit_to_exec(const SandboxConfig& config, int output_fd) {
+  auto start{now_ns()};
+  auto result{run(config)};
+  if (result.error != ErrorType::SUCCESS || result.exit_code != 0) {
+    std::fprintf(stderr, "run failed: error %d, exit code %d, signal %d\n",
+                 static_cast<int>(result.error), result.exit_code,
+                 result.signal);
+    std::exit(1);
+  }
+  char buf[32]{};
+  if (pread(output_fd, buf, sizeof(buf) - 1, 0) <= 0) std::exit(1);
+  // Between runs, as a worker does.
+  refill_zygotes();
+  return (std::atol(buf) - start) / 1000.0;
+}
+
+inline void print_header(const char* first_column) {
+  std::printf("%-10s %10s %10s %10s %10s\n", first_column, "p50_us",
+              "p99_us", "max_us", "mean_us");
+}
+
+inline void report(const char* name, std::vector<double>& samples) {
+  std::sort(samples.begin(), samples.end());
+  double sum{0};
+  for (auto s : samples) sum += s;
+  std::printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", name,
+              samples[samples.size() / 2],
+              samples[samples.size() * 99 / 100], samples.back(),
+              sum / samples.size());
+}
@@ -0,0 +1,132 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+// Throughput of the sandbox's io forwarding.
+//
+//   cd bin && ./bench_forward [sandbox] [test_dir] [rounds]
+//
+// Runs the test programs `_flood` (writes 256 MiB to stdout) and `_sink`
+// (reads stdin until EOF) through the sandbox and prints the forwarded
+// throughput of each case in MB/s. Build the test programs first.
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+extern char** environ;
+
+namespace {
+
+constexpr const std::size_t FLOOD_BYTES{256ul << 20};
+
+std::vector<char> chunk(1 << 20, 'x');
+
+enum class Mode { STDOUT_PIPE, STDOUT_NULL, STDIN_PIPE };
+
+// Run one case and return the bytes forwarded per second.
+double measure(const std::string& sandbox, const std::string& test_dir,
+               Mode mode) {
+  std::string exe{test_dir + (mode == Mode::STDIN_PIPE ? "/_sink" : "/_flood")};
+  std::vector<std::string> args{sandbox, "--exe_path=" + exe,
+                                "--log_path=/dev/null",
+                                "--result_path=/dev/null"};
+  std::vector<char*> argv;
+  for (auto& a : args) argv.push_back(a.data());
+  argv.push_back(nullptr);
+
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) == -1) std::exit(1);
+  int null_fd{open("/dev/null", O_RDWR | O_CLOEXEC)};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (mode == Mode::STDIN_PIPE) {
+    posix_spawn_file_actions_adddup2(&actions, p[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, null_fd, STDOUT_FILENO);
+  } else {
+    posix_spawn_file_actions_adddup2(&actions, null_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(
+        &actions, mode == Mode::STDOUT_PIPE ? p[1] : null_fd, STDOUT_FILENO);
+  }
+
+  auto start{std::chrono::steady_clock::now()};
+  pid_t pid;
+  if (posix_spawn(&pid, sandbox.c_str(), &actions, nullptr, argv.data(),
+                  environ) != 0) {
+    std::perror("posix_spawn");
+    std::exit(1);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  close(null_fd);
+
+  std::size_t bytes{0};
+  if (mode == Mode::STDOUT_PIPE) {
+    close(p[1]);
+    ssize_t n;
+    while ((n = read(p[0], chunk.data(), chunk.size())) > 0) bytes += n;
+    close(p[0]);
+  } else if (mode == Mode::STDIN_PIPE) {
+    close(p[0]);
+    while (bytes < FLOOD_BYTES) {
+      auto n{write(p[1], chunk.data(), chunk.size())};
+      if (n <= 0) break;
+      bytes += n;
+    }
+    close(p[1]);
+  } else {
+    close(p[0]);
+    close(p[1]);
+    bytes = FLOOD_BYTES;
+  }
+  waitpid(pid, nullptr, 0);
+  std::chrono::duration<double> elapsed{std::chrono::steady_clock::now() -
+                                        start};
+  return bytes / elapsed.count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string sandbox{argc > 1 ? argv[1] : "./sandbox"};
+  std::string test_dir{argc > 2 ? argv[2] : "../test"};
+  int rounds{argc > 3 ? std::atoi(argv[3]) : 5};
+
+  struct {
+    const char* name;
+    Mode mode;
+  } cases[]{{"stdout_to_pipe", Mode::STDOUT_PIPE},
+            {"stdout_to_devnull", Mode::STDOUT_NULL},
+            {"stdin_from_pipe", Mode::STDIN_PIPE}};
+
+  std::printf("%-20s %12s %12s\n", "case", "best_MB/s", "mean_MB/s");
+  for (auto& c : cases) {
+    double best{0}, sum{0};
+    for (int i{0}; i < rounds; i++) {
+      auto rate{measure(sandbox, test_dir, c.mode) / 1e6};
+      best = std::max(best, rate);
+      sum += rate;
+    }
+    std::printf("%-20s %12.1f %12.1f\n", c.name, best, sum / rounds);
+  }
+}
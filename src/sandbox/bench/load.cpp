@@ -0,0 +1,282 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// End-to-end load on the sandbox binary, as the backend drives it: one
+// sandbox process per run, `concurrency` runs at a time.
+//
+//   cd bin && ./bench_load [concurrency] [runs] [mix] [sandbox options...]
+//
+// `mix` weighs the workloads, e.g. the default
+// `hello:10,output:2,input:2,tle:1,mle:1,seccomp:1`; runs take the
+// workloads in turn by weight. The sandbox options are added to every run,
+// e.g. `--cgroup_root=...`. Build the test programs first.
+//
+// Prints one JSON object: runs per second, and per workload the results
+// seen, latency percentiles and a log2 histogram (µs) of the time from
+// spawning the sandbox to reaping it, and the CPU time of the sandbox
+// process itself, i.e. its rusage minus the CPU time of the program.
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "result_codec.h"
+#include "runner.h"
+
+extern char** environ;
+
+namespace {
+
+constexpr const char* DEFAULT_MIX{
+    "hello:10,output:2,input:2,tle:1,mle:1,seccomp:1"};
+constexpr const int HEAVY_MIB{16};
+
+struct Workload {
+  const char* name;
+  const char* exe;
+  int max_cpu_time;
+  std::vector<std::string> options;
+  // Feed HEAVY_MIB MiB on stdin.
+  bool input;
+};
+
+const std::vector<Workload> WORKLOADS{
+    {"hello", "_helloworld", 1000, {}, false},
+    {"output", "_flood", 1000, {"--args=" + std::to_string(HEAVY_MIB)}, false},
+    {"input", "_sink", 1000, {}, true},
+    // CPU-bound despite the name.
+    {"tle", "_sleep", 100, {}, false},
+    {"mle", "_hog", 1000, {"--max_memory=67108864"}, false},
+    {"seccomp", "_system", 1000, {}, false},
+};
+
+struct Sample {
+  long latency_us;
+  long overhead_us;
+  int result;
+};
+
+struct Stats {
+  std::mutex mutex;
+  std::vector<Sample> samples;
+};
+
+long rusage_us(const rusage& usage) {
+  return usage.ru_utime.tv_sec * 1000000L + usage.ru_utime.tv_usec +
+         usage.ru_stime.tv_sec * 1000000L + usage.ru_stime.tv_usec;
+}
+
+// Run `workload` once. `input_fd` holds the heavy input; every run opens it
+// anew, since runs must not share a file offset.
+Sample run_once(const Workload& workload,
+                const std::vector<std::string>& extra, int input_fd) {
+  std::string exe{std::string{"../test/"} + workload.exe};
+  std::vector<std::string> args{"./sandbox",
+                                "--exe_path=" + exe,
+                                "--args=" + exe,
+                                "--max_cpu_time=" +
+                                    std::to_string(workload.max_cpu_time),
+                                "--max_real_time=5000",
+                                "--log_path=/dev/null",
+                                "--result_fd=3",
+                                "--result_format=binary"};
+  args.insert(args.end(), workload.options.begin(), workload.options.end());
+  args.insert(args.end(), extra.begin(), extra.end());
+  std::vector<char*> argv;
+  for (auto& a : args) argv.push_back(a.data());
+  argv.push_back(nullptr);
+
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) == -1) std::exit(1);
+  int null_fd{open("/dev/null", O_RDWR | O_CLOEXEC)};
+  int stdin_fd{workload.input
+                   ? open(("/proc/self/fd/" + std::to_string(input_fd)).c_str(),
+                          O_RDONLY | O_CLOEXEC)
+                   : null_fd};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, null_fd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, null_fd, STDERR_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, p[1], 3);
+
+  auto start{std::chrono::steady_clock::now()};
+  pid_t pid;
+  if (posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ) !=
+      0) {
+    std::perror("posix_spawn");
+    std::exit(1);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  close(p[1]);
+  if (stdin_fd != null_fd) close(stdin_fd);
+  close(null_fd);
+
+  std::string frame;
+  char buf[256];
+  ssize_t n;
+  while ((n = read(p[0], buf, sizeof(buf))) > 0) frame.append(buf, n);
+  close(p[0]);
+  rusage usage{};
+  int status;
+  wait4(pid, &status, 0, &usage);
+  std::chrono::duration<double, std::micro> elapsed{
+      std::chrono::steady_clock::now() - start};
+
+  SandboxResult result{};
+  // -1: the sandbox itself failed.
+  int result_type{-1};
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+      decode_result(reinterpret_cast<const unsigned char*>(frame.data()),
+                    frame.size(), result) > 0 &&
+      result.error == ErrorType::SUCCESS) {
+    result_type = static_cast<int>(result.result);
+  }
+  // The program is a reaped child of the sandbox, so it is in the rusage.
+  // Both count user and system time, so what is left is the sandbox's own.
+  return {static_cast<long>(elapsed.count()),
+          rusage_us(usage) - result.cpu_time_us, result_type};
+}
+
+long percentile(const std::vector<long>& sorted, int p) {
+  return sorted[std::min(sorted.size() - 1, sorted.size() * p / 100)];
+}
+
+std::string report(const char* name, std::vector<Sample>& samples) {
+  std::vector<long> latency, overhead;
+  std::map<int, int> results;
+  std::map<int, int> histogram;
+  for (auto& s : samples) {
+    latency.push_back(s.latency_us);
+    overhead.push_back(s.overhead_us);
+    results[s.result]++;
+    int bucket{0};
+    while ((1L << bucket) < s.latency_us) bucket++;
+    histogram[bucket]++;
+  }
+  std::sort(latency.begin(), latency.end());
+  std::sort(overhead.begin(), overhead.end());
+  long overhead_sum{0};
+  for (auto o : overhead) overhead_sum += o;
+
+  std::ostringstream oss;
+  oss << "\"" << name << "\":{\"runs\":" << samples.size() << ",\"results\":{";
+  const char* sep{""};
+  for (auto [result, count] : results) {
+    oss << sep << "\"" << result << "\":" << count;
+    sep = ",";
+  }
+  oss << "},\"latency_us\":{\"p50\":" << percentile(latency, 50)
+      << ",\"p95\":" << percentile(latency, 95)
+      << ",\"p99\":" << percentile(latency, 99)
+      << ",\"max\":" << latency.back() << "},\"histogram_us\":{";
+  sep = "";
+  for (auto [bucket, count] : histogram) {
+    oss << sep << "\"" << (1L << bucket) << "\":" << count;
+    sep = ",";
+  }
+  oss << "},\"sandbox_cpu_us\":{\"p50\":" << percentile(overhead, 50)
+      << ",\"p99\":" << percentile(overhead, 99)
+      << ",\"mean\":" << overhead_sum / static_cast<long>(samples.size())
+      << "}}";
+  return oss.str();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int concurrency{argc > 1 ? std::atoi(argv[1])
+                           : static_cast<int>(
+                                 std::thread::hardware_concurrency())};
+  int runs{argc > 2 ? std::atoi(argv[2]) : 200};
+  std::string mix{argc > 3 ? argv[3] : DEFAULT_MIX};
+  std::vector<std::string> extra(argv + std::min(argc, 4), argv + argc);
+  if (concurrency < 1 || runs < 1) return 1;
+
+  // Workload indices, each repeated by its weight.
+  std::vector<std::size_t> schedule;
+  std::istringstream iss(mix);
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    auto colon{item.find(':')};
+    auto name{item.substr(0, colon)};
+    int weight{colon == std::string::npos ? 1
+                                          : std::atoi(&item[colon + 1])};
+    auto it{std::find_if(WORKLOADS.begin(), WORKLOADS.end(),
+                         [&](auto& w) { return name == w.name; })};
+    if (it == WORKLOADS.end() || weight < 0) {
+      std::fprintf(stderr, "Unknown workload %s\n", item.c_str());
+      return 1;
+    }
+    schedule.insert(schedule.end(), weight, it - WORKLOADS.begin());
+  }
+  if (schedule.empty()) return 1;
+
+  int input_fd{memfd_create("input", MFD_CLOEXEC)};
+  std::string line(1023, 'x');
+  line += '\n';
+  for (int i{0}; i < HEAVY_MIB * 1024; i++) {
+    if (write(input_fd, line.data(), line.size()) == -1) return 1;
+  }
+
+  std::vector<Stats> stats(WORKLOADS.size());
+  std::atomic<int> next{0};
+  auto start{std::chrono::steady_clock::now()};
+  std::vector<std::thread> threads;
+  for (int i{0}; i < concurrency; i++) {
+    threads.emplace_back([&]() {
+      int n;
+      while ((n = next++) < runs) {
+        auto index{schedule[n % schedule.size()]};
+        auto sample{run_once(WORKLOADS[index], extra, input_fd)};
+        std::lock_guard lock{stats[index].mutex};
+        stats[index].samples.push_back(sample);
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  std::chrono::duration<double> elapsed{std::chrono::steady_clock::now() -
+                                        start};
+
+  std::printf("{\"concurrency\":%d,\"runs\":%d,\"seconds\":%.3f,"
+              "\"runs_per_sec\":%.1f,\"workloads\":{",
+              concurrency, runs, elapsed.count(), runs / elapsed.count());
+  const char* sep{""};
+  for (std::size_t i{0}; i < WORKLOADS.size(); i++) {
+    if (stats[i].samples.empty()) continue;
+    std::printf("%s%s", sep,
+                report(WORKLOADS[i].name, stats[i].samples).c_str());
+    sep = ",";
+  }
+  std::printf("}}\n");
+}
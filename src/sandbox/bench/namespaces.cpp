@@ -0,0 +1,69 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+// Launch cost of namespaces: submission-to-exec latency of run() without
+// them, joining the template from a forked and from a parked child, and
+// the first run, which builds the template.
+//
+//   cd bin && sudo ./bench_namespaces [exe] [rounds]
+//
+// `exe` (default ../test/_stamp) must be executable by uid 65534. Each
+// namespace run also copies the mount namespace and mounts a tmpfs, which is
+// part of its latency.
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "common.h"
+#include "zygote.h"
+
+int main(int argc, char** argv) {
+  int rounds{argc > 2 ? std::atoi(argv[2]) : 1000};
+  if (rounds < 1) return 1;
+
+  int output_fd{memfd_create("output", MFD_CLOEXEC)};
+  if (output_fd == -1) return 1;
+  auto config{stamp_config(argc > 1 ? argv[1] : "../test/_stamp", output_fd)};
+  config.tmpfs_size = 16 << 20;
+  config.uid = 65534;
+  config.gid = 65534;
+
+  std::vector<double> plain, forked, parked, first;
+  // The first round compiles the policy.
+  submit_to_exec(config, output_fd);
+  for (int i{0}; i < rounds; i++) {
+    plain.push_back(submit_to_exec(config, output_fd));
+  }
+  config.namespaces = true;
+  first.push_back(submit_to_exec(config, output_fd));
+  for (int i{0}; i < rounds; i++) {
+    forked.push_back(submit_to_exec(config, output_fd));
+  }
+  set_zygotes(1);
+  submit_to_exec(config, output_fd);
+  for (int i{0}; i < rounds; i++) {
+    parked.push_back(submit_to_exec(config, output_fd));
+  }
+
+  print_header("run");
+  report("plain", plain);
+  report("template", first);
+  report("forked", forked);
+  report("parked", parked);
+}
@@ -0,0 +1,98 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+// Cost of encoding and decoding a SandboxResult, JSON against binary.
+//
+//   cd bin && ./bench_result_codec [iterations]
+//
+// JSON is written with operator<< as in result.json and read back with
+// Boost.PropertyTree; binary uses result_codec.h.
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+#include "result_codec.h"
+#include "runner.h"
+
+namespace {
+
+// Keeps the optimizer from dropping the measured work.
+volatile long sink;
+
+template <typename F>
+double ns_per_op(long iterations, F f) {
+  auto start{std::chrono::steady_clock::now()};
+  for (long i{0}; i < iterations; i++) f(i);
+  std::chrono::duration<double, std::nano> elapsed{
+      std::chrono::steady_clock::now() - start};
+  return elapsed.count() / iterations;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  long iterations{argc > 1 ? std::atol(argv[1]) : 1000000};
+
+  SandboxResult result{};
+  result.cpu_time = 123;
+  result.real_time = 456;
+  result.memory = 4206592;
+  result.exit_code = 0;
+  result.signal = 0;
+  result.result = ResultType::SUCCESS;
+
+  std::ostringstream oss;
+  oss << result;
+  auto json{oss.str()};
+  auto frame{encode_result(result)};
+
+  auto json_encode{ns_per_op(iterations, [&](long i) {
+    result.cpu_time = i;
+    std::ostringstream os;
+    os << result;
+    sink = os.str().size();
+  })};
+  auto json_decode{ns_per_op(iterations / 10, [&](long) {
+    boost::property_tree::ptree tree;
+    std::istringstream is(json);
+    boost::property_tree::read_json(is, tree);
+    sink = tree.get<long>("memory");
+  })};
+  unsigned char buf[RESULT_FRAME_SIZE];
+  auto binary_encode{ns_per_op(iterations, [&](long i) {
+    result.cpu_time = i;
+    encode_result(result, buf);
+    sink = buf[20];
+  })};
+  auto binary_decode{ns_per_op(iterations, [&](long) {
+    SandboxResult decoded;
+    sink = decode_result(reinterpret_cast<const unsigned char*>(frame.data()),
+                         frame.size(), decoded) +
+           decoded.memory;
+  })};
+
+  std::printf("%-8s %6s %12s %12s\n", "format", "bytes", "encode_ns",
+              "decode_ns");
+  std::printf("%-8s %6zu %12.1f %12.1f\n", "json", json.size(), json_encode,
+              json_decode);
+  std::printf("%-8s %6zu %12.1f %12.1f\n", "binary", frame.size(),
+              binary_encode, binary_decode);
+}
@@ -0,0 +1,93 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+// Fork-to-exec latency with and without the cached seccomp program.
+//
+//   cd bin && ./bench_seccomp [exe] [rounds]
+//
+// Each round forks a child that installs the seccomp policy and execs `exe`
+// (default ../test/_helloworld, with stdout sent to /dev/null). The time is
+// taken from fork() until a close-on-exec pipe reports the exec. The
+// uncached rounds run first, since they compile the policy in every child;
+// the cached rounds follow prepare_seccomp() as in run().
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "runner.h"
+#include "seccomp_filter.h"
+
+namespace {
+
+// Microseconds from fork() to execve() in the child.
+double fork_to_exec(const SandboxConfig& config) {
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) == -1) std::exit(1);
+  auto start{std::chrono::steady_clock::now()};
+  pid_t pid{fork()};
+  if (pid == -1) std::exit(1);
+  if (pid == 0) {
+    close(p[0]);
+    int null_fd{open("/dev/null", O_WRONLY)};
+    dup2(null_fd, STDOUT_FILENO);
+    if (load_seccomp(config) != ErrorType::SUCCESS) std::_Exit(2);
+    char* argv[]{nullptr};
+    execve(config.exe_path.c_str(), argv, argv);
+    std::_Exit(3);
+  }
+  close(p[1]);
+  char c;
+  while (read(p[0], &c, 1) > 0) {
+  }
+  std::chrono::duration<double, std::micro> elapsed{
+      std::chrono::steady_clock::now() - start};
+  close(p[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFEXITED(status) && WEXITSTATUS(status) >= 2) {
+    std::fprintf(stderr, "child failed before exec\n");
+    std::exit(1);
+  }
+  return elapsed.count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  SandboxConfig config{};
+  config.policy = "c_cpp";
+  config.exe_path = argc > 1 ? argv[1] : "../test/_helloworld";
+  int rounds{argc > 2 ? std::atoi(argv[2]) : 1000};
+  if (rounds < 1) return 1;
+
+  std::vector<double> uncached, cached;
+  for (int i{0}; i < rounds; i++) uncached.push_back(fork_to_exec(config));
+  if (prepare_seccomp(config) != ErrorType::SUCCESS) return 1;
+  for (int i{0}; i < rounds; i++) cached.push_back(fork_to_exec(config));
+
+  print_header("filter");
+  report("uncached", uncached);
+  report("cached", cached);
+}
@@ -0,0 +1,68 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Submission-to-exec latency of run(), forking each child or taking it from
+// the pool of parked children.
+//
+//   cd bin && ./bench_zygote [exe] [rounds] [ballast_mib]
+//
+// Each round calls run() on `exe` (default ../test/_stamp), which prints
+// the monotonic time at which its main() starts; the latency is that time
+// minus the time of the call. `ballast_mib` MiB of memory are touched
+// first, standing in for a big sandbox process, since the page tables that
+// fork() copies grow with it.
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "common.h"
+#include "zygote.h"
+
+int main(int argc, char** argv) {
+  int rounds{argc > 2 ? std::atoi(argv[2]) : 1000};
+  long ballast{argc > 3 ? std::atol(argv[3]) << 20 : 0};
+  if (rounds < 1 || ballast < 0) return 1;
+  if (ballast > 0) {
+    auto p{static_cast<char*>(mmap(nullptr, ballast, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))};
+    if (p == MAP_FAILED) return 1;
+    for (long i{0}; i < ballast; i += 4096) p[i] = 1;
+  }
+
+  int output_fd{memfd_create("output", MFD_CLOEXEC)};
+  if (output_fd == -1) return 1;
+  auto config{stamp_config(argc > 1 ? argv[1] : "../test/_stamp", output_fd)};
+
+  std::vector<double> forked, parked;
+  // The first round of each kind compiles the policy or parks a child.
+  submit_to_exec(config, output_fd);
+  for (int i{0}; i < rounds; i++) {
+    forked.push_back(submit_to_exec(config, output_fd));
+  }
+  set_zygotes(1);
+  submit_to_exec(config, output_fd);
+  for (int i{0}; i < rounds; i++) {
+    parked.push_back(submit_to_exec(config, output_fd));
+  }
+
+  print_header("child");
+  report("forked", forked);
+  report("parked", parked);
+}
@@ -0,0 +1,182 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "batch.h"
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include "checker.h"
+#include "log.h"
+#include "result_codec.h"
+#include "scheduler.h"
+#include "seccomp_filter.h"
+
+namespace {
+
+bool accepted(const SandboxResult& result) {
+  return result.error == ErrorType::SUCCESS &&
+         result.result == ResultType::SUCCESS;
+}
+
+// Runs cases inside a worker. The program writes into a memfd owned by the
+// worker, which is checked against the answer once the run is over.
+class CaseHandler {
+ public:
+  CaseHandler(const SandboxConfig& config, const std::vector<BatchCase>& cases)
+      : config_{config}, cases_{cases} {}
+  CaseHandler(const CaseHandler&) = delete;
+  CaseHandler& operator=(const CaseHandler&) = delete;
+  ~CaseHandler() {
+    if (output_fd_ != -1) close(output_fd_);
+  }
+
+  std::string operator()(const std::string& job) {
+    SandboxResult result{};
+    result.error = ErrorType::INVALID_CONFIG;
+    result.result = ResultType::SYSTEM_ERROR;
+    auto index{std::stoul(job)};
+    if (index >= cases_.size()) return encode_result(result);
+    auto& c{cases_[index]};
+
+    if (!config_.checker_path.empty()) {
+      // The checker has its own memfd, or talks to the program directly.
+      auto config{config_};
+      config.input_path = c.input_path;
+      config.answer_path = c.answer_path;
+      return encode_result(run(config));
+    }
+
+    if (output_fd_ == -1) {
+      output_fd_ = memfd_create("output", MFD_CLOEXEC);
+      if (output_fd_ == -1) {
+        LOG(error, "memfd_create failed", "error", strerror(errno));
+        result.error = ErrorType::FORWARD_IO_FAILED;
+        return encode_result(result);
+      }
+    }
+    // The child opens the memfd again through its own fd table, which
+    // truncates what the previous case left. Children parked for later
+    // cases (see zygote.h) are forked after this, so they have it too.
+    auto config{config_};
+    config.input_path = c.input_path;
+    config.output_path = "/proc/self/fd/" + std::to_string(output_fd_);
+    config.answer_path.clear();
+    config.memfd_io = false;
+    result = run(config);
+    if (!accepted(result)) return encode_result(result);
+
+    Checker checker;
+    if (!checker.open(c.answer_path, config.check_mode,
+                      config.check_epsilon)) {
+      LOG(error, "Cannot read answer", "path", c.answer_path);
+      result.error = ErrorType::SPJ_ERROR;
+      result.result = ResultType::SYSTEM_ERROR;
+    } else if (!checker.feed_file(output_fd_) || !checker.finish()) {
+      result.result = ResultType::WRONG_ANSWER;
+    }
+    return encode_result(result);
+  }
+
+ private:
+  SandboxConfig config_;
+  std::vector<BatchCase> cases_;
+  int output_fd_{-1};
+};
+
+}  // namespace
+
+bool read_cases(const std::string& path, std::vector<BatchCase>& cases) {
+  std::ifstream ifs(path);
+  if (!ifs) return false;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    BatchCase c;
+    if (!(iss >> c.input_path) || c.input_path.front() == '#') continue;
+    std::string rest;
+    if (!(iss >> c.answer_path) || iss >> rest) return false;
+    cases.push_back(std::move(c));
+  }
+  return true;
+}
+
+void run_batch(const SandboxConfig& config, const BatchConfig& batch,
+               const std::function<void(const SandboxResult&)>& report) {
+  if (batch.cases.empty()) return;
+  prepare_seccomp(config);
+  auto handler{std::make_shared<CaseHandler>(config, batch.cases)};
+  Scheduler scheduler(
+      [handler](const std::string& job) { return (*handler)(job); },
+      batch.workers, batch.cases.size(), batch.pin);
+  // All cases belong to one client, so they are started in order.
+  for (std::size_t i{0}; i < batch.cases.size(); i++) {
+    scheduler.submit(0, i, std::to_string(i));
+  }
+
+  std::map<std::uint64_t, SandboxResult> done;
+  std::uint64_t next{0};
+  bool stopped{false};
+  auto finish{[&](const Scheduler::Completion& completion) {
+    SandboxResult result{};
+    if (completion.crashed ||
+        decode_result(
+            reinterpret_cast<const unsigned char*>(completion.reply.data()),
+            completion.reply.size(), result) <= 0) {
+      result = SandboxResult{};
+      result.error = ErrorType::WORKER_FAILED;
+      result.result = ResultType::SYSTEM_ERROR;
+    }
+    if (batch.stop_on_failure && !accepted(result)) {
+      // Cases already running still finish, as earlier ones among them
+      // must be reported.
+      scheduler.cancel(0);
+    }
+    done[completion.seq] = result;
+  }};
+  std::vector<pollfd> fds;
+  while (true) {
+    for (auto& completion : scheduler.dispatch()) finish(completion);
+    for (auto it{done.find(next)}; !stopped && it != done.end();
+         it = done.find(next)) {
+      report(it->second);
+      stopped = batch.stop_on_failure && !accepted(it->second);
+      done.erase(it);
+      next++;
+    }
+    if (scheduler.idle()) return;
+
+    fds.clear();
+    scheduler.poll_fds(fds);
+    if (poll(fds.data(), fds.size(), -1) == -1) {
+      if (errno == EINTR) continue;
+      LOG(fatal, "poll failed", "error", strerror(errno));
+      return;
+    }
+    for (auto& fd : fds) {
+      auto completion{scheduler.collect(fd)};
+      if (completion) finish(*completion);
+    }
+  }
+}
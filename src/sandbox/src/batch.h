@@ -0,0 +1,53 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "runner.h"
+
+struct BatchCase {
+  std::string input_path;
+  std::string answer_path;
+};
+
+struct BatchConfig {
+  std::vector<BatchCase> cases;
+  // Number of worker processes; 0 means one per CPU.
+  unsigned workers;
+  // Pin every worker (and the programs it runs) to its own CPU.
+  bool pin;
+  // Start no more cases once one fails, and report nothing after it.
+  bool stop_on_failure;
+};
+
+// Read a case list: one `input_path answer_path` pair per line. Empty lines
+// and lines starting with `#` are skipped. Returns false if the file cannot
+// be read or a line is malformed.
+bool read_cases(const std::string& path, std::vector<BatchCase>& cases);
+
+// Run `config` once per case, with the input and output paths of the case,
+// on a pool of worker processes. A run that succeeds but whose output differs
+// from the answer, as compared in `config.check_mode` (see checker.h), gets
+// ResultType::WRONG_ANSWER. With `config.checker_path` the checker judges
+// every case instead (see judge.h). Results are reported as soon as every
+// earlier case has been reported, so they always come in case order.
+void run_batch(const SandboxConfig& config, const BatchConfig& batch,
+               const std::function<void(const SandboxResult&)>& report);
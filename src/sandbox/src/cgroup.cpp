@@ -0,0 +1,214 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "cgroup.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include "log.h"
+
+namespace {
+
+constexpr const char* GROUP_PREFIX{"sandbox-"};
+
+bool write_at(int dir, const char* name, const std::string& value) {
+  int fd{openat(dir, name, O_WRONLY | O_CLOEXEC)};
+  if (fd == -1) return false;
+  bool ok{write(fd, value.data(), value.size()) ==
+          static_cast<ssize_t>(value.size())};
+  close(fd);
+  return ok;
+}
+
+bool read_at(int dir, const char* name, std::string& content) {
+  int fd{openat(dir, name, O_RDONLY | O_CLOEXEC)};
+  if (fd == -1) return false;
+  char buf[4096];
+  ssize_t n;
+  content.clear();
+  while ((n = read(fd, buf, sizeof(buf))) > 0) content.append(buf, n);
+  close(fd);
+  return n == 0;
+}
+
+// A single-value file such as memory.current; -1 if unreadable.
+long read_value(int dir, const char* name) {
+  std::string content;
+  if (!read_at(dir, name, content)) return -1;
+  try {
+    return std::stol(content);
+  } catch (const std::exception&) {
+    return -1;
+  }
+}
+
+// A value of a flat keyed file such as cpu.stat; -1 if missing.
+long read_keyed(int dir, const char* name, const std::string& key) {
+  std::string content;
+  if (!read_at(dir, name, content)) return -1;
+  std::istringstream iss(content);
+  std::string k;
+  long v;
+  while (iss >> k >> v) {
+    if (k == key) return v;
+  }
+  return -1;
+}
+
+std::string limit(long value) {
+  return value == UNLIMITED ? "max" : std::to_string(value);
+}
+
+// Remove the groups of sandbox processes that are gone. Workers killed by
+// their daemon never remove their own.
+void remove_stale_groups(const std::string& root) {
+  DIR* dir{opendir(root.c_str())};
+  if (!dir) return;
+  auto prefix_len{std::strlen(GROUP_PREFIX)};
+  while (dirent* entry{readdir(dir)}) {
+    if (std::strncmp(entry->d_name, GROUP_PREFIX, prefix_len) != 0) continue;
+    pid_t pid{std::atoi(entry->d_name + prefix_len)};
+    if (pid > 0 && kill(pid, 0) == -1 && errno == ESRCH) {
+      unlinkat(dirfd(dir), entry->d_name, AT_REMOVEDIR);
+    }
+  }
+  closedir(dir);
+}
+
+std::map<std::string, std::unique_ptr<Cgroup>> groups;
+
+}  // namespace
+
+Cgroup::Cgroup(int dir_fd) : dir_fd_{dir_fd} {}
+
+Cgroup::~Cgroup() {
+  for (auto fd : {dir_fd_, procs_fd_, peak_fd_}) {
+    if (fd != -1) close(fd);
+  }
+  rmdir(path_.c_str());
+}
+
+bool Cgroup::prepare(const SandboxConfig& config) {
+  if (memory_) {
+    if (!write_at(dir_fd_, "memory.max", limit(config.max_memory))) {
+      return false;
+    }
+    // Absent without swap accounting.
+    write_at(dir_fd_, "memory.swap.max", "0");
+    oom_kills_ = read_keyed(dir_fd_, "memory.events", "oom_kill");
+    // Page cache of earlier runs stays charged to the group; it is not the
+    // program's.
+    memory_start_ = read_value(dir_fd_, "memory.current");
+    peak_resets_ = peak_fd_ != -1 && memory_start_ != -1 &&
+                   pwrite(peak_fd_, "reset\n", 6, 0) == 6;
+  }
+  if (pids_ &&
+      !write_at(dir_fd_, "pids.max", limit(config.max_process_number))) {
+    return false;
+  }
+  cpu_start_ = read_keyed(dir_fd_, "cpu.stat", "usage_usec");
+  return true;
+}
+
+CgroupUsage Cgroup::finish() {
+  // Since Linux 5.14. Descendants of the program may still be running.
+  write_at(dir_fd_, "cgroup.kill", "1");
+
+  CgroupUsage usage{-1, -1, false};
+  auto cpu{read_keyed(dir_fd_, "cpu.stat", "usage_usec")};
+  if (cpu != -1 && cpu_start_ != -1) {
+    usage.cpu_time_us = cpu - cpu_start_;
+  }
+  if (memory_) {
+    char buf[32]{};
+    if (peak_resets_ && pread(peak_fd_, buf, sizeof(buf) - 1, 0) > 0) {
+      usage.memory = std::max(0L, std::atol(buf) - memory_start_);
+    }
+    auto oom_kills{read_keyed(dir_fd_, "memory.events", "oom_kill")};
+    usage.oom_killed = oom_kills > oom_kills_;
+  }
+  return usage;
+}
+
+Cgroup* process_cgroup(const std::string& root) {
+  auto it{groups.find(root)};
+  if (it != groups.end()) return it->second.get();
+  // A failure is remembered too, so that it is only logged once.
+  auto& group{groups[root]};
+
+  remove_stale_groups(root);
+  // Let our group use the controllers. Each may fail on its own, e.g. when
+  // the parent of `root` does not delegate it.
+  int root_fd{open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (root_fd != -1) {
+    for (auto controller : {"+memory", "+pids", "+cpu"}) {
+      write_at(root_fd, "cgroup.subtree_control", controller);
+    }
+    close(root_fd);
+  }
+
+  auto path{root + "/" + GROUP_PREFIX + std::to_string(getpid())};
+  if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+    LOG(warning, "Cannot create cgroup, using rlimits", "path", path, "error",
+        strerror(errno));
+    return nullptr;
+  }
+  int dir_fd{open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (dir_fd == -1) {
+    rmdir(path.c_str());
+    return nullptr;
+  }
+  std::unique_ptr<Cgroup> cgroup{new Cgroup(dir_fd)};
+  cgroup->path_ = path;
+  cgroup->procs_fd_ = openat(dir_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+  if (cgroup->procs_fd_ == -1) {
+    LOG(warning, "Cannot use cgroup, using rlimits", "path", path, "error",
+        strerror(errno));
+    return nullptr;
+  }
+
+  std::string controllers;
+  read_at(dir_fd, "cgroup.controllers", controllers);
+  std::istringstream iss(controllers);
+  for (std::string c; iss >> c;) {
+    cgroup->memory_ |= c == "memory";
+    cgroup->pids_ |= c == "pids";
+    cgroup->cpu_ |= c == "cpu";
+  }
+  if (cgroup->memory_) {
+    cgroup->peak_fd_ = openat(dir_fd, "memory.peak", O_RDWR | O_CLOEXEC);
+  }
+  // At most one CPU's worth of time per period, so that a multi-threaded
+  // program cannot take the cores of other workers.
+  if (cgroup->cpu_) {
+    write_at(dir_fd, "cpu.max", "100000 100000");
+  }
+  LOG(info, "Using cgroup", "path", path, "controllers",
+      controllers.substr(0, controllers.find('\n')));
+  group = std::move(cgroup);
+  return group.get();
+}
@@ -0,0 +1,73 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <string>
+
+#include "runner.h"
+
+// What a run used, according to its cgroup. -1 if the kernel does not tell.
+struct CgroupUsage {
+  long cpu_time_us;
+  long memory;
+  bool oom_killed;
+};
+
+// A cgroup v2 group that the programs of this process run in, one at a time.
+// It is created on first use under a delegated directory and reused by every
+// later run, so a run only writes a few limit files. Limits are enforced by
+// whichever of the memory, pids and cpu controllers the group has; the child
+// uses rlimits for the rest.
+class Cgroup {
+ public:
+  ~Cgroup();
+  Cgroup(const Cgroup&) = delete;
+  Cgroup& operator=(const Cgroup&) = delete;
+
+  bool limits_memory() const { return memory_; }
+  bool limits_pids() const { return pids_; }
+  // The child writes "0" here to move itself into the group.
+  int procs_fd() const { return procs_fd_; }
+
+  // Set the limits of `config` and take the counters a run is measured from.
+  bool prepare(const SandboxConfig& config);
+  // Kill whatever is left of the run and return what it used.
+  CgroupUsage finish();
+
+ private:
+  friend Cgroup* process_cgroup(const std::string& root);
+  explicit Cgroup(int dir_fd);
+
+  int dir_fd_;
+  int procs_fd_{-1};
+  // Kept open: since Linux 6.12 a write resets the peak seen through this fd.
+  int peak_fd_{-1};
+  bool peak_resets_{false};
+  bool memory_{false};
+  bool pids_{false};
+  bool cpu_{false};
+  long cpu_start_{0};
+  long memory_start_{0};
+  long oom_kills_{0};
+  std::string path_;
+};
+
+// The group of this process under the cgroup v2 directory `root`, created on
+// first use. nullptr if no group can be made there; runs then fall back to
+// rlimits.
+Cgroup* process_cgroup(const std::string& root);
@@ -0,0 +1,313 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "checker.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Longer tokens are no numbers in float mode.
+constexpr const std::size_t MAX_NUMBER{128};
+
+bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool is_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Length of the common prefix of `a` and `b`, `size` bytes at most, 16 bytes
+// per comparison where SSE2 is available.
+std::size_t common_prefix(const char* a, const char* b, std::size_t size) {
+  std::size_t i{0};
+#ifdef __SSE2__
+  for (; i + 16 <= size; i += 16) {
+    auto x{_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i))};
+    auto y{_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))};
+    unsigned differ{~static_cast<unsigned>(
+                        _mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) &
+                    0xffff};
+    if (differ) return i + __builtin_ctz(differ);
+  }
+#endif
+  while (i < size && a[i] == b[i]) i++;
+  return i;
+}
+
+// Drop trailing whitespace of every line and trailing empty lines.
+std::string normalize(const std::string& text) {
+  std::string result;
+  result.reserve(text.size());
+  std::size_t begin{0};
+  while (begin < text.size()) {
+    auto end{text.find('\n', begin)};
+    if (end == std::string::npos) end = text.size();
+    auto last{end};
+    while (last > begin && is_blank(text[last - 1])) last--;
+    result.append(text, begin, last - begin);
+    result.push_back('\n');
+    begin = end + 1;
+  }
+  auto last{result.find_last_not_of('\n')};
+  result.resize(last == std::string::npos ? 0 : last + 1);
+  return result;
+}
+
+bool read_file(const std::string& path, std::string& content) {
+  int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd == -1) return false;
+  struct stat st;
+  bool ok{fstat(fd, &st) == 0};
+  if (ok) content.resize(st.st_size);
+  std::size_t size{0};
+  while (ok && size < content.size()) {
+    auto n{read(fd, content.data() + size, content.size() - size)};
+    if (n == -1 && errno == EINTR) continue;
+    ok = n > 0;
+    if (ok) size += n;
+  }
+  close(fd);
+  return ok;
+}
+
+bool parse_number(const char* begin, const char* end, double& value) {
+  auto [ptr, ec]{std::from_chars(begin, end, value)};
+  return ec == std::errc{} && ptr == end;
+}
+
+}  // namespace
+
+bool Checker::valid_mode(const std::string& mode) {
+  return mode == "exact" || mode == "lines" || mode == "tokens" ||
+         mode == "float";
+}
+
+bool Checker::open(const std::string& answer_path, const std::string& mode,
+                   double epsilon) {
+  if (!valid_mode(mode) || !read_file(answer_path, answer_)) return false;
+  if (mode == "exact") {
+    mode_ = Mode::EXACT;
+  } else if (mode == "lines") {
+    mode_ = Mode::LINES;
+    answer_ = normalize(answer_);
+  } else {
+    mode_ = mode == "tokens" ? Mode::TOKENS : Mode::FLOAT;
+    auto last{std::find_if_not(answer_.rbegin(), answer_.rend(), is_space)};
+    answer_end_ = answer_.rend() - last;
+  }
+  epsilon_ = epsilon;
+  return true;
+}
+
+bool Checker::feed(const char* data, std::size_t size) {
+  if (failed_) return false;
+  switch (mode_) {
+    case Mode::EXACT:
+      if (size > answer_.size() - position_ ||
+          std::memcmp(data, answer_.data() + position_, size) != 0) {
+        return fail();
+      }
+      position_ += size;
+      return true;
+    case Mode::LINES:
+      return feed_lines(data, size);
+    case Mode::TOKENS:
+    case Mode::FLOAT:
+      return feed_tokens(data, size);
+    default:
+      return true;
+  }
+}
+
+bool Checker::feed_file(int fd) {
+  char buf[1 << 16];
+  off_t offset{0};
+  while (true) {
+    auto n{pread(fd, buf, sizeof(buf), offset)};
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return fail();
+    if (n == 0) return !failed_;
+    if (!feed(buf, n)) return false;
+    offset += n;
+  }
+}
+
+bool Checker::finish() {
+  if (failed_) return false;
+  bool match{true};
+  switch (mode_) {
+    case Mode::EXACT:
+    case Mode::LINES:
+      // Whatever whitespace is pending in lines mode is trailing.
+      match = position_ == answer_.size();
+      break;
+    case Mode::TOKENS:
+    case Mode::FLOAT:
+      match = (!in_token_ || end_token()) && position_ >= answer_end_;
+      break;
+    default:
+      break;
+  }
+  return match || fail();
+}
+
+bool Checker::feed_lines(const char* data, std::size_t size) {
+  const char* answer{answer_.data()};
+  auto answer_size{answer_.size()};
+  std::size_t i{0};
+  while (i < size) {
+    if (newlines_ == 0 && blanks_ == 0) {
+      // Skip what is the same on both sides, except for blanks, which may
+      // turn out to end a line.
+      auto n{common_prefix(data + i, answer + position_,
+                           std::min(size - i, answer_size - position_))};
+      while (n > 0 && is_blank(data[i + n - 1])) n--;
+      i += n;
+      position_ += n;
+      if (i == size) break;
+    }
+    char c{data[i++]};
+    if (c == '\n') {
+      auto at{position_ + newlines_};
+      newlines_match_ = newlines_match_ && at < answer_size &&
+                        answer[at] == '\n';
+      newlines_++;
+      blanks_ = 0;
+      blanks_match_ = true;
+    } else if (is_blank(c)) {
+      auto at{position_ + newlines_ + blanks_};
+      blanks_match_ = blanks_match_ && at < answer_size && answer[at] == c;
+      blanks_++;
+    } else {
+      // The pending whitespace is not trailing after all.
+      if (!newlines_match_ || !blanks_match_) return fail();
+      position_ += newlines_ + blanks_;
+      newlines_ = blanks_ = 0;
+      newlines_match_ = blanks_match_ = true;
+      if (position_ == answer_size || answer[position_] != c) return fail();
+      position_++;
+    }
+    if (newlines_ + blanks_ > answer_size - position_ + CHECK_SLACK) {
+      return fail();
+    }
+  }
+  return true;
+}
+
+bool Checker::feed_tokens(const char* data, std::size_t size) {
+  const char* answer{answer_.data()};
+  std::size_t i{0};
+  while (i < size) {
+    if (!in_token_ || token_exact_) {
+      auto n{common_prefix(data + i, answer + position_,
+                           std::min(size - i, answer_.size() - position_))};
+      skip_same(data + i, n);
+      i += n;
+      if (i == size) break;
+    }
+    char c{data[i++]};
+    if (is_space(c)) {
+      if (in_token_ && !end_token()) return fail();
+      if (position_ >= answer_end_ && ++trailing_ > CHECK_SLACK) {
+        return fail();
+      }
+      continue;
+    }
+    if (!in_token_) {
+      while (position_ < answer_end_ && is_space(answer[position_])) {
+        position_++;
+      }
+      // One token more than the answer has.
+      if (position_ >= answer_end_) return fail();
+      in_token_ = true;
+      token_begin_ = position_;
+      token_.clear();
+      token_exact_ = true;
+    }
+    bool same{position_ < answer_.size() && answer[position_] == c};
+    if (mode_ == Mode::TOKENS) {
+      if (!same) return fail();
+      position_++;
+      continue;
+    }
+    if (token_exact_ && same) {
+      position_++;
+    } else {
+      token_exact_ = false;
+    }
+    if (token_.size() <= MAX_NUMBER) token_.push_back(c);
+    if (!token_exact_ && token_.size() > MAX_NUMBER) return fail();
+  }
+  return true;
+}
+
+// `size` bytes of output are the same as the answer at `position_`.
+void Checker::skip_same(const char* same, std::size_t size) {
+  auto last{size};
+  while (last > 0 && !is_space(same[last - 1])) last--;
+  // The tokens up to the last whitespace match; what follows is a token
+  // that goes on.
+  if (last > 0) in_token_ = false;
+  if (last < size) {
+    if (!in_token_) {
+      in_token_ = true;
+      token_begin_ = position_ + last;
+      token_.clear();
+      token_exact_ = true;
+    }
+    if (mode_ == Mode::FLOAT) {
+      token_.append(same + last,
+                    std::min(size - last, MAX_NUMBER + 1 - token_.size()));
+    }
+  }
+  position_ += size;
+}
+
+// The output token is complete; moves `position_` past the answer token.
+bool Checker::end_token() {
+  in_token_ = false;
+  auto answer_token_ends{[&]() {
+    return position_ == answer_.size() || is_space(answer_[position_]);
+  }};
+  if (mode_ == Mode::TOKENS || (token_exact_ && answer_token_ends())) {
+    return answer_token_ends();
+  }
+  position_ = token_begin_;
+  while (!answer_token_ends()) position_++;
+  double expected, actual;
+  if (token_.size() > MAX_NUMBER ||
+      !parse_number(answer_.data() + token_begin_, answer_.data() + position_,
+                    expected) ||
+      !parse_number(token_.data(), token_.data() + token_.size(), actual)) {
+    return false;
+  }
+  return std::abs(actual - expected) <=
+         epsilon_ * std::max(1.0, std::abs(expected));
+}
@@ -0,0 +1,102 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Whitespace the tolerant modes accept after the end of the answer.
+constexpr const std::size_t CHECK_SLACK{4096};
+
+// Compares the output of a program with the expected output while it is
+// being written, so that a wrong answer is known at its first wrong byte and
+// the output is never buffered. Modes:
+//
+//   exact   byte for byte
+//   lines   ignoring trailing whitespace of lines and trailing empty lines
+//   tokens  as sequences of whitespace-separated tokens
+//   float   as tokens, where two numbers also match if they differ by at
+//           most `epsilon`, absolute or relative to the expected one
+//
+// In every mode, output known to go past the end of the answer is a
+// mismatch at once; in the tolerant modes this includes more than
+// CHECK_SLACK bytes of whitespace after it.
+class Checker {
+ public:
+  Checker() = default;
+  Checker(const Checker&) = delete;
+  Checker& operator=(const Checker&) = delete;
+
+  static bool valid_mode(const std::string& mode);
+
+  // Load the expected output. Returns false if it cannot be read.
+  bool open(const std::string& answer_path, const std::string& mode,
+            double epsilon);
+  // Whether open() succeeded.
+  bool active() const {
+    return mode_ != Mode::NONE;
+  }
+  // Compare the next `size` bytes of output. Returns false as soon as the
+  // output cannot match any more, and from then on.
+  bool feed(const char* data, std::size_t size);
+  // Feed the content of the file `fd` from its start, e.g. a memfd the
+  // program wrote to. Also returns false if it cannot be read.
+  bool feed_file(int fd);
+  // The output is complete: whether it matches.
+  bool finish();
+
+ private:
+  enum class Mode { NONE, EXACT, LINES, TOKENS, FLOAT };
+
+  bool fail() {
+    failed_ = true;
+    return false;
+  }
+  bool feed_lines(const char* data, std::size_t size);
+  bool feed_tokens(const char* data, std::size_t size);
+  void skip_same(const char* same, std::size_t size);
+  bool end_token();
+
+  Mode mode_{Mode::NONE};
+  double epsilon_{0};
+  // The answer; normalized as in lines mode for that mode.
+  std::string answer_;
+  // Position in the answer up to which the output matched.
+  std::size_t position_{0};
+  bool failed_{false};
+
+  // lines: newlines and whitespace of the output not known yet to be
+  // trailing, and whether they match the answer after `position_`.
+  std::size_t newlines_{0};
+  std::size_t blanks_{0};
+  bool newlines_match_{true};
+  bool blanks_match_{true};
+
+  // tokens, float: whether the output is in a token, and where the answer
+  // token it is compared with begins. The answer has no token after
+  // `answer_end_`. `trailing_` counts whitespace after it.
+  bool in_token_{false};
+  std::size_t token_begin_{0};
+  std::size_t answer_end_{0};
+  std::size_t trailing_{0};
+  // float: the output token, unless longer than any number, and whether it
+  // matched the answer token byte for byte so far.
+  std::string token_;
+  bool token_exact_{true};
+};
@@ -18,9 +18,10 @@
 #include "child.h"
 
 #include <asm/prctl.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <linux/close_range.h>
 #include <grp.h>
-#include <seccomp.h>
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
@@ -29,9 +30,13 @@
 #include <sys/utsname.h>
 #include <unistd.h>
 
-#include <boost/log/core.hpp>
-#include <boost/log/trivial.hpp>
 #include <cstdlib>
+#include <cstring>
+
+#include "log.h"
+#include "metrics.h"
+#include "namespaces.h"
+#include "seccomp_filter.h"
 
 namespace {
 
@@ -40,9 +45,8 @@ FILE* output_file{nullptr};
 FILE* error_file{nullptr};
 
 [[noreturn]] void child_error_exit(ErrorType e) {
-  BOOST_LOG_TRIVIAL(fatal) << "Fatal error in child: "
-                           << error_msg[static_cast<int>(e)];
-  BOOST_LOG_TRIVIAL(error) << "Errno: " << strerror(errno);
+  LOG(fatal, "Fatal error in child", "error", error_msg[static_cast<int>(e)],
+      "errno", strerror(errno));
   if (input_file) {
     fclose(input_file);
     input_file = nullptr;
@@ -59,74 +63,37 @@ FILE* error_file{nullptr};
   std::exit(EXIT_FAILURE);
 }
 
-ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
-  int syscalls_whitelist[]{
-      SCMP_SYS(read),       SCMP_SYS(fstat),         SCMP_SYS(mmap),
-      SCMP_SYS(mprotect),   SCMP_SYS(munmap),        SCMP_SYS(uname),
-      SCMP_SYS(arch_prctl), SCMP_SYS(brk),           SCMP_SYS(access),
-      SCMP_SYS(exit_group), SCMP_SYS(close),         SCMP_SYS(readlink),
-      SCMP_SYS(sysinfo),    SCMP_SYS(write),         SCMP_SYS(writev),
-      SCMP_SYS(lseek),      SCMP_SYS(clock_gettime), SCMP_SYS(getpid),
-      SCMP_SYS(gettid)};
-
-  int debug_whitelist[]{SCMP_SYS(set_tid_address), SCMP_SYS(set_robust_list),
-                        SCMP_SYS(prlimit64), SCMP_SYS(getrandom),
-                        SCMP_SYS(newfstatat)};
-
-  scmp_filter_ctx ctx{seccomp_init(SCMP_ACT_KILL)};
-  if (!ctx) {
-    return ErrorType::LOAD_SECCOMP_FAILED;
-  }
-  for (auto sysc : syscalls_whitelist) {
-    if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, sysc, 0) != 0) {
-      return ErrorType::LOAD_SECCOMP_FAILED;
-    }
-  }
-  if (config.debug_mode) {
-    for (auto sysc : debug_whitelist) {
-      if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, sysc, 0) != 0) {
-        return ErrorType::LOAD_SECCOMP_FAILED;
+// Mark every fd above stderr close-on-exec.
+void close_other_fds() {
+  if (syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) == 0) {
+    return;
+  }
+  // Before Linux 5.11
+  if (DIR* dir{opendir("/proc/self/fd")}) {
+    while (dirent* entry{readdir(dir)}) {
+      int fd{std::atoi(entry->d_name)};
+      if (fd > STDERR_FILENO && fd != dirfd(dir)) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
       }
     }
+    closedir(dir);
   }
-  // add extra rule for execve
-  if (seccomp_rule_add(
-          ctx, SCMP_ACT_ALLOW, SCMP_SYS(execve), 1,
-          SCMP_A0(SCMP_CMP_EQ, (scmp_datum_t)(config.exe_path.c_str()))) != 0) {
-    return ErrorType::LOAD_SECCOMP_FAILED;
-  }
-
-  // allow std::abort
-  if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(rt_sigprocmask), 0) != 0) {
-    return ErrorType::LOAD_SECCOMP_FAILED;
-  }
-  if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(tgkill), 2,
-                       SCMP_A0(SCMP_CMP_EQ, (scmp_datum_t)(getpid())),
-                       SCMP_A1(SCMP_CMP_EQ, (scmp_datum_t)(gettid()))) != 0) {
-    return ErrorType::LOAD_SECCOMP_FAILED;
-  }
-
-  // no write file
-  if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(open), 1,
-                       SCMP_A1(SCMP_CMP_MASKED_EQ, O_WRONLY | O_RDWR, 0)) !=
-      0) {
-    return ErrorType::LOAD_SECCOMP_FAILED;
-  }
-  if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(openat), 1,
-                       SCMP_A2(SCMP_CMP_MASKED_EQ, O_WRONLY | O_RDWR, 0)) !=
-      0) {
-    return ErrorType::LOAD_SECCOMP_FAILED;
-  }
-  if (seccomp_load(ctx) != 0) {
-    return ErrorType::LOAD_SECCOMP_FAILED;
-  }
-  seccomp_release(ctx);
-  return ErrorType::SUCCESS;
 }
 
 }  // namespace
 
-[[noreturn]] void child(const SandboxConfig& config) {
+[[noreturn]] void child(const SandboxConfig& config, const Cgroup* cgroup,
+                        int start_fd) {
+  auto stamps{launch_times()};
+  if (stamps) stamps->child_us = monotonic_us();
+
+  if (cgroup) {
+    if (write(cgroup->procs_fd(), "0", 1) != 1) {
+      child_error_exit(ErrorType::CGROUP_FAILED);
+    }
+    LOG(debug, "Joined cgroup");
+  }
+
   // max_stack
   if (config.max_stack != UNLIMITED) {
     rlimit r;
@@ -136,10 +103,11 @@ ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
       child_error_exit(ErrorType::SETRLIMIT_FAILED);
     }
   }
-  BOOST_LOG_TRIVIAL(info) << "max_stack: " << config.max_stack;
+  LOG(debug, "Limit set", "max_stack", config.max_stack);
 
   // max_memory
-  if (config.max_memory != UNLIMITED) {
+  if (config.max_memory != UNLIMITED &&
+      !(cgroup && cgroup->limits_memory())) {
     rlimit r;
     r.rlim_cur = config.max_memory;
     r.rlim_max = config.max_memory;
@@ -147,7 +115,7 @@ ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
       child_error_exit(ErrorType::SETRLIMIT_FAILED);
     }
   }
-  BOOST_LOG_TRIVIAL(info) << "max_memory: " << config.max_memory;
+  LOG(debug, "Limit set", "max_memory", config.max_memory);
 
   // max_cpu_time
   if (config.max_cpu_time != UNLIMITED) {
@@ -159,10 +127,11 @@ ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
       child_error_exit(ErrorType::SETRLIMIT_FAILED);
     }
   }
-  BOOST_LOG_TRIVIAL(info) << "max_cpu_time: " << config.max_cpu_time;
+  LOG(debug, "Limit set", "max_cpu_time", config.max_cpu_time);
 
   // max_process_number
-  if (config.max_process_number != UNLIMITED) {
+  if (config.max_process_number != UNLIMITED &&
+      !(cgroup && cgroup->limits_pids())) {
     rlimit r;
     r.rlim_cur = config.max_process_number;
     r.rlim_max = config.max_process_number;
@@ -170,8 +139,7 @@ ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
       child_error_exit(ErrorType::SETRLIMIT_FAILED);
     }
   }
-  BOOST_LOG_TRIVIAL(info) << "max_process_number: "
-                          << config.max_process_number;
+  LOG(debug, "Limit set", "max_process_number", config.max_process_number);
 
   // max_output_size
   if (config.max_output_size != UNLIMITED) {
@@ -182,7 +150,8 @@ ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
       child_error_exit(ErrorType::SETRLIMIT_FAILED);
     }
   }
-  BOOST_LOG_TRIVIAL(info) << "max_output_size: " << config.max_output_size;
+  LOG(debug, "Limit set", "max_output_size", config.max_output_size);
+  if (stamps) stamps->limits_us = monotonic_us();
 
   if (!config.input_path.empty()) {
     input_file = fopen(config.input_path.c_str(), "r");
@@ -216,27 +185,48 @@ ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
       child_error_exit(ErrorType::DUP2_FAILED);
     }
   }
-  BOOST_LOG_TRIVIAL(info) << "io redirect finish";
+  LOG(debug, "I/O redirected");
+
+  // Nothing but stdio may reach the program: the caller may have passed us
+  // a result pipe, and a daemon holds sockets and log files.
+  close_other_fds();
+
+  if (config.namespaces) {
+    auto error{enter_namespaces(config)};
+    if (error != ErrorType::SUCCESS) child_error_exit(error);
+    LOG(debug, "Namespaces entered", "uid", config.uid, "gid", config.gid);
+  }
 
   // // set gid
   // gid_t group_list[]{config.gid};
   // if (setgid(config.gid) != 0 || setgroups(1, group_list) != 0) {
   //   child_error_exit(ErrorType::SETUID_FAILED);
   // }
-  // BOOST_LOG_TRIVIAL(info) << "gid: " << config.gid;
+  // LOG(debug, "gid set", "gid", config.gid);
   // // set uid
   // if (setuid(config.uid) != 0) {
   //   child_error_exit(ErrorType::SETUID_FAILED);
   // }
-  // BOOST_LOG_TRIVIAL(info) << "uid: " << config.uid;
+  // LOG(debug, "uid set", "uid", config.uid);
+
+  if (start_fd != -1) {
+    char c;
+    while (read(start_fd, &c, 1) == -1 && errno == EINTR) {
+    }
+    close(start_fd);
+  }
+
+  if (stamps) stamps->exec_us = monotonic_us();
 
+  LOG(debug, "Loading seccomp policy", "policy", config.policy);
+  // Nothing may log once the policy is loaded: the vDSO falls back to a
+  // clock_gettime() syscall on some clock sources, and the policy need not
+  // allow it. A failed execve() may therefore end in a seccomp kill rather
+  // than in the record of child_error_exit().
   // load C/C++ seccomp rules
-  if (c_cpp_seccomp_rules(config) != ErrorType::SUCCESS) {
+  if (load_seccomp(config) != ErrorType::SUCCESS) {
     child_error_exit(ErrorType::LOAD_SECCOMP_FAILED);
   }
-  // We have set seccomp now, but Boost.Log calls gettimeofday(). 
-  // So DO NOT log anything from this point.
-  // BOOST_LOG_TRIVIAL(info) << "load seccomp rules finish";
 
   char* argv[256]{};
   char* envp[256]{};
@@ -246,7 +236,6 @@ ErrorType c_cpp_seccomp_rules(const SandboxConfig& config) {
   for (auto i{0u}; i < config.env.size(); i++) {
     envp[i] = const_cast<char*>(config.env[i].c_str());
   }
-  // BOOST_LOG_TRIVIAL(info) << "copy argv & envp finish";
   execve(config.exe_path.c_str(), argv, envp);
   child_error_exit(ErrorType::EXECVE_FAILED);
 }
@@ -17,6 +17,12 @@
 
 #pragma once
 
+#include "cgroup.h"
 #include "runner.h"
 
-[[noreturn]] void child(const SandboxConfig& config);
+// Set up the forked child and exec the program. With a `cgroup` the child
+// moves itself into it, and leaves the limits the group enforces to it. With
+// a `start_fd` the child waits until it reads EOF there right before the
+// exec, so that the parent can attach to it first.
+[[noreturn]] void child(const SandboxConfig& config, const Cgroup* cgroup,
+                        int start_fd);
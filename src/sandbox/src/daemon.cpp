@@ -0,0 +1,404 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "daemon.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "log.h"
+#include "metrics.h"
+#include "options.h"
+#include "result_codec.h"
+#include "runner.h"
+#include "scheduler.h"
+#include "seccomp_filter.h"
+
+namespace {
+
+// Unsent replies of a client beyond which its jobs are not read until it
+// catches up.
+constexpr const std::size_t CLIENT_LIMIT{1 << 20};
+
+// How long a connection to the metrics socket may take to send its request.
+constexpr const std::chrono::seconds SCRAPE_TIMEOUT{5};
+
+// A connection to the metrics socket, waiting for its request.
+struct Scraper {
+  int fd;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+// Parses and runs jobs inside a worker. The option description is built once
+// before the workers are forked, so a job costs no more than the parse itself.
+class JobHandler {
+ public:
+  JobHandler() : desc_{job_options(job_)} {}
+  // `desc_` points into `job_`.
+  JobHandler(const JobHandler&) = delete;
+  JobHandler& operator=(const JobHandler&) = delete;
+
+  std::string operator()(const std::string& block) {
+    namespace po = boost::program_options;
+    SandboxResult result{};
+    job_ = SandboxConfig{};
+    try {
+      po::variables_map vm;
+      std::istringstream iss(block);
+      po::store(po::parse_config_file(iss, desc_), vm);
+      po::notify(vm);
+      if (job_.exe_path.empty()) {
+        throw po::error("exe_path is not specified");
+      }
+      result = run(job_);
+    } catch (const po::error& e) {
+      LOG(error, "Bad job", "error", e.what());
+      result.error = ErrorType::INVALID_CONFIG;
+      result.result = ResultType::SYSTEM_ERROR;
+    }
+    // Workers always answer in binary; the daemon renders the reply in the
+    // format of the client.
+    return encode_result(result);
+  }
+
+ private:
+  SandboxConfig job_;
+  boost::program_options::options_description desc_;
+};
+
+struct Client {
+  int fd;
+  std::string buffer;
+  // Replies in order, not yet taken by the socket.
+  std::string out;
+  // Sequence number of the next job received and of the next reply to send.
+  std::uint64_t next_seq;
+  std::uint64_t next_reply;
+  // Replies that finished before an earlier job of the same client.
+  std::map<std::uint64_t, std::string> done;
+  // Reply format for jobs sent from now on, and for each job still running.
+  bool binary;
+  std::map<std::uint64_t, bool> binary_of;
+};
+
+// A reply framed for the client: a binary frame, or JSON and an empty line.
+std::string render(const SandboxResult& result, bool binary) {
+  if (binary) return encode_result(result);
+  std::ostringstream oss;
+  oss << result << "\n\n";
+  return oss.str();
+}
+
+void complete(Client& client, Scheduler::Completion& completion) {
+  SandboxResult result{};
+  if (completion.too_large) {
+    result.error = ErrorType::INVALID_CONFIG;
+    result.result = ResultType::SYSTEM_ERROR;
+    record_result(result);
+  } else if (completion.crashed ||
+      decode_result(
+          reinterpret_cast<const unsigned char*>(completion.reply.data()),
+          completion.reply.size(), result) <= 0) {
+    result = SandboxResult{};
+    result.error = ErrorType::WORKER_FAILED;
+    result.result = ResultType::SYSTEM_ERROR;
+    // The worker did not live to count it.
+    record_result(result);
+  }
+  auto binary{client.binary_of.extract(completion.seq)};
+  client.done[completion.seq] =
+      render(result, !binary.empty() && binary.mapped());
+}
+
+bool send_all(int fd, const std::string& data) {
+  std::size_t sent{0};
+  while (sent < data.size()) {
+    auto n{send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL)};
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// Send what the socket takes of every reply that is next in order; the rest
+// waits for POLLOUT. Returns false if the connection should be dropped.
+bool flush(Client& client) {
+  for (auto it{client.done.begin()};
+       it != client.done.end() && it->first == client.next_reply;
+       it = client.done.erase(it)) {
+    client.out += it->second;
+    client.next_reply++;
+  }
+  while (!client.out.empty()) {
+    auto n{send(client.fd, client.out.data(), client.out.size(),
+                MSG_NOSIGNAL)};
+    if (n > 0) {
+      client.out.erase(0, n);
+    } else if (n == -1 && errno == EINTR) {
+      continue;
+    } else {
+      return n == -1 && errno == EAGAIN;
+    }
+  }
+  return true;
+}
+
+// Hand a finished job to its client, if still connected, and send what is
+// now in order.
+void deliver(std::map<std::uint64_t, Client>& clients,
+             Scheduler::Completion& completion) {
+  auto it{clients.find(completion.client)};
+  if (it == clients.end() || it->second.fd == -1) return;
+  complete(it->second, completion);
+  if (!flush(it->second)) {
+    close(it->second.fd);
+    it->second.fd = -1;
+  }
+}
+
+// The metrics of the runs and of the scheduler as an HTTP response, which is
+// what a Prometheus scraper (or `curl --unix-socket`) expects.
+std::string metrics_response(const Scheduler& scheduler) {
+  auto stats{scheduler.stats()};
+  std::ostringstream body;
+  body << metrics_text()
+       << "# TYPE sandbox_workers gauge\nsandbox_workers " << stats.workers
+       << "\n# TYPE sandbox_jobs_running gauge\nsandbox_jobs_running "
+       << stats.running
+       << "\n# TYPE sandbox_jobs_queued gauge\nsandbox_jobs_queued "
+       << stats.queued
+       << "\n# TYPE sandbox_jobs_completed_total counter\n"
+          "sandbox_jobs_completed_total "
+       << stats.completed
+       << "\n# TYPE sandbox_worker_crashes_total counter\n"
+          "sandbox_worker_crashes_total "
+       << stats.crashed
+       << "\n# TYPE sandbox_uptime_seconds gauge\nsandbox_uptime_seconds "
+       << stats.uptime_ms / 1000.0
+       << "\n# TYPE sandbox_utilisation gauge\nsandbox_utilisation "
+       << stats.utilisation << "\n";
+  auto text{body.str()};
+  return "HTTP/1.0 200 OK\r\n"
+         "Content-Type: text/plain; version=0.0.4\r\n"
+         "Content-Length: " +
+         std::to_string(text.size()) + "\r\n\r\n" + text;
+}
+
+int listen_unix(const std::string& path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << path << std::endl;
+    return -1;
+  }
+  std::strcpy(addr.sun_path, path.c_str());
+
+  int fd{socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+  unlink(path.c_str());
+  if (fd == -1 ||
+      bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+      listen(fd, SOMAXCONN) == -1) {
+    std::cerr << "Failed to listen on " << path << ": " << strerror(errno)
+              << std::endl;
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Queue every complete job in the client's buffer.
+void drain(Scheduler& scheduler, std::uint64_t id, Client& client) {
+  std::size_t pos;
+  while ((pos = client.buffer.find("\n\n")) != std::string::npos) {
+    auto block{client.buffer.substr(0, pos + 1)};
+    client.buffer.erase(0, pos + 2);
+    if (block == "binary\n" || block == "json\n") {
+      client.binary = block == "binary\n";
+      continue;
+    }
+    auto seq{client.next_seq++};
+    if (block == "stats\n") {
+      std::ostringstream oss;
+      oss << scheduler.stats() << "\n\n";
+      client.done[seq] = oss.str();
+    } else {
+      client.binary_of[seq] = client.binary;
+      scheduler.submit(id, seq, std::move(block));
+    }
+  }
+}
+
+}  // namespace
+
+int serve(const DaemonConfig& config) {
+  int listen_fd{listen_unix(config.socket_path)};
+  if (listen_fd == -1) return 1;
+  int metrics_fd{-1};
+  if (!config.metrics_socket_path.empty()) {
+    metrics_fd = listen_unix(config.metrics_socket_path);
+    // Before the workers are forked, so that their runs are counted.
+    if (metrics_fd == -1 || !init_metrics()) return 1;
+  }
+
+  // Jobs talk to their programs through files; nothing should be forwarded
+  // from the daemon's own stdin.
+  int null_fd{open("/dev/null", O_RDONLY)};
+  if (null_fd != -1) {
+    dup2(null_fd, STDIN_FILENO);
+    close(null_fd);
+  }
+
+  // Compile every seccomp policy before the workers are forked, so that
+  // choosing one costs a job nothing.
+  for (auto& name : policy_names()) {
+    for (bool debug_mode : {false, true}) {
+      SandboxConfig policy{};
+      policy.policy = name;
+      policy.debug_mode = debug_mode;
+      prepare_seccomp(policy);
+    }
+  }
+
+  auto handler{std::make_shared<JobHandler>()};
+  Scheduler scheduler([handler](const std::string& job) { return (*handler)(job); },
+                      config.workers, config.queue_size, config.pin);
+  LOG(info, "Daemon listening", "socket", config.socket_path, "metrics",
+      config.metrics_socket_path);
+
+  std::map<std::uint64_t, Client> clients;
+  std::uint64_t next_id{0};
+  std::vector<pollfd> fds;
+  std::vector<std::uint64_t> ids;
+  // In the order they were accepted, and so of their deadlines.
+  std::vector<Scraper> scrapers;
+  char buf[4096];
+  while (true) {
+    fds.clear();
+    ids.clear();
+    fds.push_back({listen_fd, POLLIN, 0});
+    fds.push_back({metrics_fd, POLLIN, 0});
+    // Stop reading jobs while the queue is full, or from a client that does
+    // not read its replies; the kernel socket buffers then push back on the
+    // clients.
+    for (auto& [id, c] : clients) {
+      short events(scheduler.full() || c.out.size() >= CLIENT_LIMIT ? 0
+                                                                    : POLLIN);
+      if (!c.out.empty()) events |= POLLOUT;
+      fds.push_back({c.fd, events, 0});
+      ids.push_back(id);
+    }
+    auto workers_begin{fds.size()};
+    scheduler.poll_fds(fds);
+    auto scrapers_begin{fds.size()};
+    for (auto& scraper : scrapers) fds.push_back({scraper.fd, POLLIN, 0});
+
+    int timeout{-1};
+    if (!scrapers.empty()) {
+      auto left{scrapers.front().deadline - std::chrono::steady_clock::now()};
+      timeout = std::max(
+          0, static_cast<int>(
+                 std::chrono::ceil<std::chrono::milliseconds>(left).count()));
+    }
+    if (poll(fds.data(), fds.size(), timeout) == -1) {
+      if (errno == EINTR) continue;
+      LOG(fatal, "poll failed", "error", strerror(errno));
+      return 1;
+    }
+
+    for (auto i{workers_begin}; i < scrapers_begin; i++) {
+      auto completion{scheduler.collect(fds[i])};
+      if (completion) deliver(clients, *completion);
+    }
+
+    for (std::size_t i{2}; i < workers_begin; i++) {
+      auto& client{clients[ids[i - 2]]};
+      if (!fds[i].revents || client.fd == -1) continue;
+      if ((fds[i].revents & POLLOUT) && !flush(client)) {
+        close(client.fd);
+        client.fd = -1;
+        continue;
+      }
+      if (!(fds[i].revents & ~POLLOUT)) continue;
+      auto n{read(client.fd, buf, sizeof(buf))};
+      if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+      if (n > 0) {
+        client.buffer.append(buf, n);
+        drain(scheduler, ids[i - 2], client);
+        if (flush(client)) continue;
+      }
+      close(client.fd);
+      client.fd = -1;
+    }
+    std::erase_if(clients, [&](const auto& item) {
+      if (item.second.fd != -1) return false;
+      scheduler.cancel(item.first);
+      return true;
+    });
+
+    if (fds[0].revents & POLLIN) {
+      int fd{accept4(listen_fd, nullptr, nullptr,
+                     SOCK_CLOEXEC | SOCK_NONBLOCK)};
+      if (fd != -1) {
+        clients[next_id++] = Client{fd, {}, {}, 0, 0, {}, false, {}};
+      }
+    }
+
+    // Whatever the request, it gets the metrics once it has arrived. The
+    // sockets do not block: a response that does not fit in the socket
+    // buffer is cut short rather than stalling the daemon, and a scraper
+    // that sends nothing is dropped at its deadline.
+    auto now{std::chrono::steady_clock::now()};
+    for (auto i{scrapers_begin}; i < fds.size(); i++) {
+      auto& scraper{scrapers[i - scrapers_begin]};
+      if (fds[i].revents) {
+        auto n{read(scraper.fd, buf, sizeof(buf))};
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n > 0) send_all(scraper.fd, metrics_response(scheduler));
+      } else if (now < scraper.deadline) {
+        continue;
+      }
+      close(scraper.fd);
+      scraper.fd = -1;
+    }
+    std::erase_if(scrapers,
+                  [](const Scraper& scraper) { return scraper.fd == -1; });
+    if (fds[1].revents & POLLIN) {
+      int fd{accept4(metrics_fd, nullptr, nullptr,
+                     SOCK_CLOEXEC | SOCK_NONBLOCK)};
+      if (fd != -1) scrapers.push_back({fd, now + SCRAPE_TIMEOUT});
+    }
+
+    for (auto& completion : scheduler.dispatch()) {
+      deliver(clients, completion);
+    }
+  }
+}
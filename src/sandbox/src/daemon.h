@@ -0,0 +1,43 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+struct DaemonConfig {
+  std::string socket_path;
+  // Number of worker processes; 0 means one per CPU.
+  unsigned workers;
+  // Jobs waiting for a worker. Clients are not read while it is full.
+  std::size_t queue_size;
+  // Pin every worker (and the programs it runs) to its own CPU.
+  bool pin;
+  // Unix socket answering every connection with the metrics in Prometheus
+  // text format (see metrics.h) over HTTP; empty for none.
+  std::string metrics_socket_path;
+};
+
+// Listen on a Unix stream socket and serve jobs until killed. Each job is a
+// block of `option=value` lines (the same options as the command line)
+// terminated by an empty line; the reply is the result JSON followed by an
+// empty line, in the order the jobs were sent. A block consisting of the
+// line `stats` is answered with the scheduler counters instead, and the
+// lines `binary` and `json` switch the format of later replies. Returns the
+// process exit code.
+int serve(const DaemonConfig& config);
@@ -0,0 +1,220 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "judge.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "log.h"
+#include "zygote.h"
+
+namespace {
+
+SandboxResult error_result(ErrorType e) {
+  SandboxResult result{};
+  result.error = e;
+  result.result = ResultType::SYSTEM_ERROR;
+  return result;
+}
+
+// Tell how the checker failed; its own run logged the rest.
+SandboxResult spj_error(const SandboxResult& checked) {
+  LOG(error, "Checker failed", "error", static_cast<int>(checked.error),
+      "result", static_cast<int>(checked.result), "signal", checked.signal,
+      "exit_code", checked.exit_code);
+  return error_result(ErrorType::SPJ_ERROR);
+}
+
+std::string or_null(const std::string& path) {
+  return path.empty() ? "/dev/null" : path;
+}
+
+SandboxConfig program_config(const SandboxConfig& config) {
+  SandboxConfig program{config};
+  program.answer_path.clear();
+  program.checker_path.clear();
+  // Its stdin is the interactor.
+  if (config.interactive) program.input_path.clear();
+  return program;
+}
+
+SandboxConfig checker_config(const SandboxConfig& config,
+                             const std::string& output) {
+  SandboxConfig checker{config};
+  checker.exe_path = config.checker_path;
+  checker.args = {config.checker_path, or_null(config.input_path), output,
+                  or_null(config.answer_path)};
+  checker.env.clear();
+  checker.input_path.clear();
+  checker.output_path.clear();
+  checker.error_path.clear();
+  checker.max_cpu_time = config.checker_max_cpu_time;
+  checker.max_real_time = config.checker_max_real_time;
+  checker.max_memory = config.checker_max_memory;
+  checker.max_output_size = UNLIMITED;
+  checker.max_instructions = UNLIMITED;
+  checker.policy = config.checker_policy;
+  checker.memfd_io = false;
+  checker.perf_counters = false;
+  // It reads the input and the answer by path, which may be below /tmp.
+  checker.namespaces = false;
+  checker.answer_path.clear();
+  checker.checker_path.clear();
+  return checker;
+}
+
+bool limit_exceeded(ResultType result) {
+  return result == ResultType::CPU_TIME_LIMIT_EXCEEDED ||
+         result == ResultType::REAL_TIME_LIMIT_EXCEEDED ||
+         result == ResultType::MEMORY_LIMIT_EXCEEDED ||
+         result == ResultType::INSTRUCTION_LIMIT_EXCEEDED ||
+         result == ResultType::OUTPUT_LIMIT_EXCEEDED;
+}
+
+// What the checker says of the output, or SYSTEM_ERROR if it says nothing.
+ResultType verdict(const SandboxResult& checked) {
+  if (checked.error != ErrorType::SUCCESS) return ResultType::SYSTEM_ERROR;
+  if (checked.result == ResultType::RUNTIME_ERROR &&
+      checked.signal == SIGPIPE) {
+    return ResultType::WRONG_ANSWER;
+  }
+  if (checked.result != ResultType::SUCCESS) return ResultType::SYSTEM_ERROR;
+  switch (checked.exit_code) {
+    case 0:
+      return ResultType::SUCCESS;
+    case 1:
+      return ResultType::WRONG_ANSWER;
+    case 2:
+      return ResultType::PRESENTATION_ERROR;
+    default:
+      return ResultType::SYSTEM_ERROR;
+  }
+}
+
+SandboxResult judge_output(const SandboxConfig& config) {
+  int output{memfd_create("output", MFD_CLOEXEC)};
+  if (output == -1) return error_result(ErrorType::FORWARD_IO_FAILED);
+  // run() closes what it is given.
+  const int stdio[3]{-1, fcntl(output, F_DUPFD_CLOEXEC, 3), -1};
+  if (stdio[1] == -1) {
+    close(output);
+    return error_result(ErrorType::FORWARD_IO_FAILED);
+  }
+  auto result{run(program_config(config), stdio)};
+  if (result.error != ErrorType::SUCCESS ||
+      result.result != ResultType::SUCCESS) {
+    close(output);
+    return result;
+  }
+
+  // The program shared the file offset with us.
+  lseek(output, 0, SEEK_SET);
+  const int checker_stdio[3]{output, -1, -1};
+  auto checked{run(checker_config(config, "/dev/stdin"), checker_stdio)};
+  auto checker_verdict{verdict(checked)};
+  if (checker_verdict == ResultType::SYSTEM_ERROR) return spj_error(checked);
+  result.result = checker_verdict;
+  return result;
+}
+
+SandboxResult judge_interactive(const SandboxConfig& config) {
+  // Program to interactor, interactor to program, and the interactor's
+  // result back to us.
+  int to_checker[2]{-1, -1};
+  int to_program[2]{-1, -1};
+  int result_pipe[2]{-1, -1};
+  auto close_all{[&]() {
+    for (auto p : {to_checker, to_program, result_pipe}) {
+      for (int i{0}; i < 2; i++) {
+        if (p[i] != -1) close(p[i]);
+      }
+    }
+  }};
+  if (pipe2(to_checker, O_CLOEXEC) < 0 || pipe2(to_program, O_CLOEXEC) < 0 ||
+      pipe2(result_pipe, O_CLOEXEC) < 0) {
+    close_all();
+    return error_result(ErrorType::DUP2_FAILED);
+  }
+
+  pid_t pid{fork()};
+  if (pid == 0) {
+    // Watched by a process of its own, so that both run at once.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    close(to_checker[1]);
+    close(to_program[0]);
+    close(result_pipe[0]);
+    set_zygotes(0);
+    auto checker{checker_config(config, "/dev/null")};
+    // The group of our process is the program's.
+    checker.cgroup_root.clear();
+    const int stdio[3]{to_checker[0], to_program[1], -1};
+    auto checked{run(checker, stdio)};
+    _exit(write(result_pipe[1], &checked, sizeof(checked)) == sizeof(checked)
+              ? EXIT_SUCCESS
+              : EXIT_FAILURE);
+  }
+  close(to_checker[0]);
+  close(to_program[1]);
+  close(result_pipe[1]);
+  if (pid == -1) {
+    close(to_checker[1]);
+    close(to_program[0]);
+    close(result_pipe[0]);
+    return error_result(ErrorType::FORK_FAILED);
+  }
+
+  const int stdio[3]{to_program[0], to_checker[1], -1};
+  auto result{run(program_config(config), stdio)};
+
+  SandboxResult checked{};
+  ssize_t n;
+  do {
+    n = read(result_pipe[0], &checked, sizeof(checked));
+  } while (n == -1 && errno == EINTR);
+  close(result_pipe[0]);
+  waitpid(pid, nullptr, 0);
+  if (n != sizeof(checked)) checked = error_result(ErrorType::WORKER_FAILED);
+
+  if (result.error != ErrorType::SUCCESS || limit_exceeded(result.result)) {
+    return result;
+  }
+  auto checker_verdict{verdict(checked)};
+  if (checker_verdict == ResultType::SYSTEM_ERROR) return spj_error(checked);
+  // E.g. a program killed by SIGPIPE after the interactor gave up on it.
+  if (checker_verdict != ResultType::SUCCESS) result.result = checker_verdict;
+  return result;
+}
+
+}  // namespace
+
+SandboxResult judge(const SandboxConfig& config) {
+  // The checker reads what the program writes to its stdout.
+  if (config.debug_mode || !config.output_path.empty()) {
+    LOG(error, "Run failed", "error",
+        error_msg[static_cast<int>(ErrorType::INVALID_CONFIG)]);
+    return error_result(ErrorType::INVALID_CONFIG);
+  }
+  return config.interactive ? judge_interactive(config) : judge_output(config);
+}
@@ -0,0 +1,40 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "runner.h"
+
+// Run a job whose output is judged by a checker program
+// (SandboxConfig::checker_path). The checker is called as testlib expects:
+//
+//   checker <input> <output> <answer>
+//
+// with /dev/null for a missing input or answer. Without `interactive` the
+// program runs first and writes into a memfd, which the checker then gets as
+// its stdin and as <output>, /dev/stdin. With `interactive` the two run at
+// once, the stdout of each being the stdin of the other, and <output> is
+// /dev/null; the checker runs in a process of its own, without a cgroup.
+//
+// The exit code of the checker is the verdict: 0 accepted, 1 wrong answer
+// and 2 presentation error. Anything else, or a checker past its limits or
+// killed, is ErrorType::SPJ_ERROR. A program past its own limits keeps that
+// result, and so does a program that fails without a checker verdict against
+// it. An interactor killed by SIGPIPE has seen the program stop reading,
+// which is a wrong answer.
+SandboxResult judge(const SandboxConfig& config);
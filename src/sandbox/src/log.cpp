@@ -0,0 +1,317 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "log.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <thread>
+
+namespace log_detail {
+
+constexpr const std::size_t SLOTS{4096};
+constexpr const std::size_t TEXT_SIZE{240};
+
+// Free for the record at position p of the ring while `sequence` is p, and
+// published once it is p + 1; the flusher then frees it for p + SLOTS.
+struct Slot {
+  std::atomic<std::uint64_t> sequence;
+  std::int64_t time_ns;
+  std::int32_t pid;
+  LogLevel level;
+  std::uint16_t size;
+  char text[TEXT_SIZE];
+};
+
+}  // namespace log_detail
+
+namespace {
+
+using log_detail::Slot;
+using log_detail::SLOTS;
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "the ring is shared between processes");
+
+struct Ring {
+  // Position of the next record.
+  alignas(64) std::atomic<std::uint64_t> head;
+  alignas(64) std::atomic<std::uint64_t> dropped;
+  Slot slots[SLOTS];
+};
+
+constexpr const char* LEVEL_NAMES[]{"debug", "info", "warning", "error",
+                                    "fatal"};
+
+// A record that is claimed but not published for this long was abandoned,
+// e.g. by a child killed while logging.
+constexpr const std::int64_t ABANDONED_NS{1000000000};
+// How long the flusher sleeps at most when there is nothing to write.
+constexpr const long MAX_IDLE_NS{64000000};
+
+Ring* ring{nullptr};
+int log_fd{-1};
+// The process that writes the log.
+pid_t owner{-1};
+// Cached, since getpid() is a syscall; updated in forked children.
+pid_t pid{-1};
+// Offset of local time, taken once: localtime_r() takes a lock that a
+// forked child could inherit held.
+long utc_offset{0};
+std::thread* flusher{nullptr};
+std::atomic<bool> stopping{false};
+
+std::int64_t now_ns(clockid_t clock) {
+  timespec ts{};
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+bool needs_quotes(std::string_view s) {
+  if (s.empty()) return true;
+  return std::any_of(s.begin(), s.end(), [](char c) {
+    return c <= ' ' || c == '"' || c == '=' || c == '\\';
+  });
+}
+
+// `ts=...` in local time, to the microsecond.
+void append_time(std::string& out, std::int64_t time_ns) {
+  auto seconds{time_ns / 1000000000 + utc_offset};
+  auto days{seconds / 86400};
+  auto second_of_day{seconds % 86400};
+  // Civil date from days since the epoch (H. Hinnant).
+  auto z{days + 719468};
+  auto era{z / 146097};
+  auto doe{z - era * 146097};
+  auto yoe{(doe - doe / 1460 + doe / 36524 - doe / 146096) / 365};
+  auto doy{doe - (365 * yoe + yoe / 4 - yoe / 100)};
+  auto mp{(5 * doy + 2) / 153};
+  auto day{doy - (153 * mp + 2) / 5 + 1};
+  auto month{mp < 10 ? mp + 3 : mp - 9};
+  auto year{yoe + era * 400 + (month <= 2)};
+  char buf[40];
+  auto n{std::snprintf(buf, sizeof(buf),
+                       "ts=%04ld-%02ld-%02ldT%02ld:%02ld:%02ld.%06ld", year,
+                       month, day, second_of_day / 3600,
+                       second_of_day / 60 % 60, second_of_day % 60,
+                       time_ns % 1000000000 / 1000)};
+  out.append(buf, n);
+}
+
+void append_line(std::string& out, const Slot& slot) {
+  append_time(out, slot.time_ns);
+  out += " level=";
+  out += LEVEL_NAMES[static_cast<int>(slot.level)];
+  out += " pid=";
+  out += std::to_string(slot.pid);
+  out.append(slot.text, slot.size);
+  out += '\n';
+}
+
+// Only the flusher thread of the owner takes records out of the ring.
+std::uint64_t tail{0};
+std::int64_t stuck_since{0};
+std::uint64_t dropped_reported{0};
+
+// Move the published records to `out`, in order.
+void drain(std::string& out) {
+  while (true) {
+    auto& slot{ring->slots[tail % SLOTS]};
+    auto sequence{slot.sequence.load(std::memory_order_acquire)};
+    if (sequence == tail + 1) {
+      append_line(out, slot);
+      slot.sequence.store(tail + SLOTS, std::memory_order_release);
+      tail++;
+      stuck_since = 0;
+      continue;
+    }
+    if (ring->head.load(std::memory_order_acquire) == tail) break;
+    // Claimed, but still being written.
+    auto now{now_ns(CLOCK_MONOTONIC)};
+    if (stuck_since == 0) stuck_since = now;
+    if (now - stuck_since < ABANDONED_NS) break;
+    // If the writer is still alive after all, it fails to publish.
+    auto expected{tail};
+    if (slot.sequence.compare_exchange_strong(expected, tail + SLOTS,
+                                              std::memory_order_acq_rel)) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      tail++;
+    }
+    stuck_since = 0;
+  }
+  auto dropped{ring->dropped.load(std::memory_order_relaxed)};
+  if (dropped != dropped_reported) {
+    append_time(out, now_ns(CLOCK_REALTIME));
+    out += " level=warning pid=" + std::to_string(owner) +
+           " msg=\"log records dropped\" count=" +
+           std::to_string(dropped - dropped_reported) + "\n";
+    dropped_reported = dropped;
+  }
+}
+
+void write_out(std::string& out) {
+  std::size_t offset{0};
+  while (offset < out.size()) {
+    auto n{write(log_fd, out.data() + offset, out.size() - offset)};
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) continue;
+      break;
+    }
+    offset += n;
+  }
+  out.clear();
+}
+
+void flush_loop() {
+  std::string out;
+  long idle_ns{1000000};
+  while (!stopping.load(std::memory_order_acquire)) {
+    drain(out);
+    if (out.empty()) {
+      idle_ns = std::min(idle_ns * 2, MAX_IDLE_NS);
+    } else {
+      write_out(out);
+      idle_ns = 1000000;
+    }
+    timespec ts{0, idle_ns};
+    nanosleep(&ts, nullptr);
+  }
+  drain(out);
+  write_out(out);
+}
+
+}  // namespace
+
+namespace log_detail {
+
+Record::Record(LogLevel level, std::string_view message) {
+  if (!ring) return;
+  auto position{ring->head.load(std::memory_order_relaxed)};
+  while (true) {
+    auto& slot{ring->slots[position % SLOTS]};
+    auto sequence{slot.sequence.load(std::memory_order_acquire)};
+    auto diff{static_cast<std::int64_t>(sequence - position)};
+    if (diff == 0) {
+      if (ring->head.compare_exchange_weak(position, position + 1,
+                                           std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Full: the flusher has not got to the record a lap before.
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      position = ring->head.load(std::memory_order_relaxed);
+    }
+  }
+  slot_ = &ring->slots[position % SLOTS];
+  position_ = position;
+  slot_->time_ns = now_ns(CLOCK_REALTIME);
+  slot_->pid = pid;
+  slot_->level = level;
+  key("msg");
+  value(message);
+}
+
+Record::~Record() {
+  if (!slot_) return;
+  slot_->size = static_cast<std::uint16_t>(size_);
+  auto expected{position_};
+  slot_->sequence.compare_exchange_strong(expected, position_ + 1,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed);
+}
+
+void Record::key(std::string_view key) {
+  append(" ");
+  append(key);
+  append("=");
+}
+
+void Record::value(std::string_view value) {
+  if (!needs_quotes(value)) {
+    append(value);
+    return;
+  }
+  append("\"");
+  for (auto c : value) {
+    if (c == '"' || c == '\\') {
+      append("\\");
+      append({&c, 1});
+    } else if (c == '\n') {
+      append("\\n");
+    } else {
+      append({&c, 1});
+    }
+  }
+  append("\"");
+}
+
+void Record::append(std::string_view text) {
+  auto n{std::min(text.size(), TEXT_SIZE - size_)};
+  std::copy_n(text.data(), n, slot_->text + size_);
+  size_ += n;
+}
+
+}  // namespace log_detail
+
+void init_log(const std::string& log_path, bool append) {
+  if (ring) return;
+  log_fd = open(log_path.c_str(),
+                O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+                0644);
+  if (log_fd == -1) return;
+  // Shared, so that records of forked processes reach the flusher.
+  auto memory{mmap(nullptr, sizeof(Ring), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0)};
+  if (memory == MAP_FAILED) return;
+  ring = new (memory) Ring{};
+  for (std::size_t i{0}; i < SLOTS; i++) ring->slots[i].sequence = i;
+
+  owner = pid = getpid();
+  pthread_atfork(nullptr, nullptr, []() { pid = getpid(); });
+  auto now{std::time(nullptr)};
+  tm local{};
+  localtime_r(&now, &local);
+  utc_offset = local.tm_gmtoff;
+
+  // Signals are for the thread that expects them, e.g. SIGIO for the one
+  // that watches an instruction budget; the flusher takes none.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  flusher = new std::thread(flush_loop);
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  std::atexit(flush_log);
+}
+
+void flush_log() {
+  if (!flusher || getpid() != owner) return;
+  stopping.store(true, std::memory_order_release);
+  flusher->join();
+  delete flusher;
+  flusher = nullptr;
+}
@@ -0,0 +1,136 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Structured logging into a preallocated ring buffer, shared by the process
+// that called init_log() and everything it forks, and written to the log
+// file by a background thread of that process. A record costs a few atomic
+// operations and a clock_gettime() from the vDSO: no lock, no allocation and
+// no syscall. A child can therefore log right up to loading its seccomp
+// filter, and its records survive the exec.
+//
+//   LOG(warning, "cannot pin worker", "cpu", cpu, "error", strerror(errno));
+//
+// writes a logfmt line:
+//
+//   ts=2021-10-17T18:12:17.170102 level=warning pid=42 msg="cannot pin
+//   worker" cpu=3 error="Invalid argument"
+//
+// Fields are key/value pairs of integers, bools and strings; strings are
+// quoted when needed. A record is cut at the size of a ring slot. When the
+// ring is full, new records are dropped and counted; nobody waits.
+
+enum class LogLevel { debug, info, warning, error, fatal };
+
+// Debug records are compiled in with -DSANDBOX_DEBUG_LOG only (the cmake
+// option of the same name); otherwise LOG(debug, ...) does not even evaluate
+// its arguments.
+#ifdef SANDBOX_DEBUG_LOG
+constexpr const LogLevel MIN_LOG_LEVEL{LogLevel::debug};
+#else
+constexpr const LogLevel MIN_LOG_LEVEL{LogLevel::info};
+#endif
+
+#define LOG(level, ...)                                \
+  do {                                                 \
+    if constexpr (LogLevel::level >= MIN_LOG_LEVEL) {  \
+      log_record(LogLevel::level, __VA_ARGS__);        \
+    }                                                  \
+  } while (0)
+
+// Open the log file and start the flusher thread. Call once per process
+// tree, before forking workers or runs. Records logged before are dropped.
+// Pass `append` when several sandbox processes share the file.
+void init_log(const std::string& log_path, bool append = false);
+
+// Write out whatever is in the ring and stop the flusher, e.g. before
+// aborting. Happens at exit too. Only the process that called init_log()
+// writes; elsewhere this does nothing.
+void flush_log();
+
+namespace log_detail {
+
+struct Slot;
+
+// A record being written into its slot. It is published, i.e. handed to the
+// flusher, when destroyed.
+class Record {
+ public:
+  Record(LogLevel level, std::string_view message);
+  ~Record();
+  Record(const Record&) = delete;
+  Record& operator=(const Record&) = delete;
+
+  explicit operator bool() const {
+    return slot_;
+  }
+
+  void key(std::string_view key);
+  void value(std::string_view value);
+  void value(const char* value) {
+    this->value(std::string_view{value});
+  }
+  void value(const std::string& value) {
+    this->value(std::string_view{value});
+  }
+  void value(bool value) {
+    append(value ? "true" : "false");
+  }
+  template <std::integral T>
+  void value(T value) {
+    char buf[24];
+    auto [end, ec]{std::to_chars(buf, buf + sizeof(buf), value)};
+    append({buf, static_cast<std::size_t>(end - buf)});
+  }
+
+ private:
+  void append(std::string_view text);
+
+  Slot* slot_{nullptr};
+  std::uint64_t position_{0};
+  std::size_t size_{0};
+};
+
+inline void fields(Record&) {}
+
+template <typename Value, typename... Rest>
+void fields(Record& record, std::string_view key, const Value& value,
+            const Rest&... rest) {
+  record.key(key);
+  record.value(value);
+  fields(record, rest...);
+}
+
+}  // namespace log_detail
+
+// Use LOG() instead, which compiles out disabled levels.
+template <typename... Fields>
+void log_record(LogLevel level, std::string_view message,
+                const Fields&... fields) {
+  static_assert(sizeof...(fields) % 2 == 0, "fields are key/value pairs");
+  log_detail::Record record{level, message};
+  if (record) log_detail::fields(record, fields...);
+}
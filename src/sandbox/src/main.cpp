@@ -15,12 +15,23 @@
 // You should have received a copy of the GNU General Public License
 // along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <unistd.h>
+
 #include <boost/program_options.hpp>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 
+#include "batch.h"
 #include "config.h"
+#include "daemon.h"
+#include "log.h"
+#include "options.h"
+#include "result_codec.h"
 #include "runner.h"
+#include "seccomp_filter.h"
+#include "session.h"
+#include "zygote.h"
 
 using namespace std::literals;
 
@@ -33,40 +44,47 @@ int main(int argc, char** argv) {
   namespace po = boost::program_options;
   po::options_description desc("Allowed options");
   SandboxConfig config;
-
-#define OPTION(name, default_val, desc)                                        \
-  (#name,                                                                      \
-   po::value<decltype(config.name)>(&config.name)->default_value(default_val), \
-   desc)
-#define OPTION_VEC(name, desc) \
-  (#name, po::value<decltype(config.name)>(&config.name)->composing(), desc)
+  bool daemon_mode{false};
+  bool session_mode{false};
+  DaemonConfig daemon_config;
+  std::string result_format;
+  std::string batch_path;
+  std::string policy_file;
+  BatchConfig batch_config{};
+  unsigned zygotes{0};
 
   // clang-format off
   desc.add_options()
     ("help,h", "Display help message and exit.")
     ("version,v", "Display version info and exit.")
-    OPTION(max_cpu_time, UNLIMITED, "Max CPU time (ms)")
-    OPTION(max_real_time, UNLIMITED, "Max real time (ms)")
-    OPTION(max_memory, UNLIMITED, "Max memory (B)")
-    OPTION(max_stack, 16L * 1024 * 1024, "Max stack (B)")
-    OPTION(max_process_number, UNLIMITED, "Max process number")
-    OPTION(max_output_size, UNLIMITED, "Max output size (B)")
-    OPTION(exe_path, ""s, "Executable path")
-    OPTION(input_path, ""s, "Input path")
-    OPTION(output_path, ""s, "Output path")
-    OPTION(error_path, ""s, "Error path")
-    OPTION_VEC(args, "Arguments")
-    OPTION_VEC(env, "Environment variables")
-    OPTION(log_path, "sandbox.log"s, "Log path")
-    OPTION(result_path, "result.json"s, "Result path")
-    OPTION(uid, 65534, "User ID")
-    OPTION(gid, 65534, "Group ID")
-    ("debug-mode", po::bool_switch(&config.debug_mode), "Debug mode")
+    ("result_format", po::value(&result_format)->default_value("json"s),
+     "Result format: json or binary")
+    ("daemon", po::bool_switch(&daemon_mode),
+     "Serve jobs on a Unix socket instead of running once")
+    ("sessions", po::bool_switch(&session_mode),
+     "Serve interactive sessions, each on a pty, on a Unix socket")
+    ("socket_path",
+     po::value(&daemon_config.socket_path)->default_value("sandbox.sock"s),
+     "Socket path (daemon and session mode)")
+    ("metrics_socket", po::value(&daemon_config.metrics_socket_path),
+     "Serve Prometheus metrics over HTTP on this Unix socket (daemon mode)")
+    ("workers", po::value(&daemon_config.workers)->default_value(0),
+     "Worker processes, 0 for one per CPU (daemon and batch mode)")
+    ("queue_size", po::value(&daemon_config.queue_size)->default_value(256),
+     "Max queued jobs (daemon mode)")
+    ("pin", po::bool_switch(&daemon_config.pin),
+     "Pin each worker to its own CPU (daemon and batch mode)")
+    ("zygotes", po::value(&zygotes)->default_value(0),
+     "Pre-forked children kept parked per worker (daemon and batch mode)")
+    ("policy_file", po::value(&policy_file),
+     "Load seccomp policy profiles from this file")
+    ("batch", po::value(&batch_path),
+     "Run every case listed in this file (batch mode)")
+    ("stop_on_failure", po::bool_switch(&batch_config.stop_on_failure),
+     "Stop at the first failed case (batch mode)")
   ;
   // clang-format on
-
-#undef OPTION
-#undef OPTION_VEC
+  desc.add(job_options(config));
 
   po::variables_map vm;
   try {
@@ -88,14 +106,73 @@ int main(int argc, char** argv) {
     std::exit(0);
   }
 
+  init_log(config.log_path, daemon_mode || session_mode);
+
+  if (!policy_file.empty()) {
+    std::string error;
+    if (!load_policies(policy_file, error)) {
+      std::cerr << "Policy error: " << error << std::endl;
+      std::exit(1);
+    }
+  }
+
+  // A single run has no next run to park a child for.
+  if (daemon_mode || !batch_path.empty()) set_zygotes(zygotes);
+
+  if (daemon_mode) {
+    return serve(daemon_config);
+  }
+  if (session_mode) {
+    return serve_sessions(daemon_config.socket_path);
+  }
+
   if (config.exe_path.empty()) {
     std::cerr << "Command line error: Executable path is not specified."
               << std::endl;
     std::exit(1);
   }
+  if (result_format != "json" && result_format != "binary") {
+    std::cerr << "Command line error: Unknown result format " << result_format
+              << std::endl;
+    std::exit(1);
+  }
+
+  std::ofstream ofs;
+  if (config.result_fd == -1) {
+    ofs.open(config.result_path, std::ios::binary);
+  }
+  // Batch results are streamed, so JSON results are separated by an empty
+  // line as in daemon mode.
+  auto separator{batch_path.empty() ? "\n" : "\n\n"};
+  auto write_result{[&](const SandboxResult& result) {
+    std::string output;
+    if (result_format == "binary") {
+      output = encode_result(result);
+    } else {
+      std::ostringstream oss;
+      oss << result << separator;
+      output = oss.str();
+    }
+    if (config.result_fd != -1) {
+      return write(config.result_fd, output.data(), output.size()) ==
+             static_cast<ssize_t>(output.size());
+    }
+    return static_cast<bool>(ofs.write(output.data(), output.size()).flush());
+  }};
 
-  auto result{run(config)};
+  if (!batch_path.empty()) {
+    if (!read_cases(batch_path, batch_config.cases)) {
+      std::cerr << "Command line error: Cannot read batch file " << batch_path
+                << std::endl;
+      std::exit(1);
+    }
+    batch_config.workers = daemon_config.workers;
+    batch_config.pin = daemon_config.pin;
+    bool ok{true};
+    run_batch(config, batch_config,
+              [&](const SandboxResult& result) { ok &= write_result(result); });
+    return ok ? 0 : 1;
+  }
 
-  std::ofstream ofs(config.result_path);
-  ofs << result << std::endl;
+  return write_result(run(config)) ? 0 : 1;
 }
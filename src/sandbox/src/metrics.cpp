@@ -0,0 +1,228 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "metrics.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+// Upper bounds of the latency buckets, in microseconds.
+constexpr const long BUCKETS[]{100,    250,    500,     1000,    2500,
+                               5000,   10000,  25000,   50000,   100000,
+                               250000, 500000, 1000000, 2500000, 5000000,
+                               10000000};
+constexpr const std::size_t BUCKET_COUNT{std::size(BUCKETS)};
+
+constexpr const char* PHASES[]{"fork", "limits", "setup", "wait"};
+constexpr const std::size_t PHASE_COUNT{std::size(PHASES)};
+
+constexpr const char* RESULT_NAMES[]{
+    "success",          "cpu_time_limit_exceeded",
+    "real_time_limit_exceeded", "memory_limit_exceeded",
+    "runtime_error",    "system_error",
+    "wrong_answer",     "instruction_limit_exceeded",
+    "presentation_error", "output_limit_exceeded"};
+constexpr const std::size_t MAX_RESULTS{16};
+constexpr const std::size_t MAX_ERRORS{std::size(error_msg)};
+
+constexpr const char* STREAMS[]{"stdin", "stdout", "stderr"};
+
+using Counter = std::atomic<std::uint64_t>;
+static_assert(Counter::is_always_lock_free);
+
+struct Histogram {
+  // The last one counts what is above every bound.
+  Counter buckets[BUCKET_COUNT + 1];
+  Counter sum_us;
+
+  void observe(long us) {
+    if (us < 0) return;
+    std::size_t i{0};
+    while (i < BUCKET_COUNT && us > BUCKETS[i]) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us.fetch_add(us, std::memory_order_relaxed);
+  }
+};
+
+struct Metrics {
+  Histogram launch;
+  Histogram phases[PHASE_COUNT];
+  Counter runs[MAX_RESULTS][MAX_ERRORS];
+  Counter forwarded[std::size(STREAMS)];
+  std::atomic<std::int64_t> in_flight;
+};
+
+Metrics* metrics{nullptr};
+
+// The stamps of the process that mapped them. A process forked from it,
+// e.g. the helper of an interactive checker, maps its own before its first
+// launch; its parked children, forked later, inherit the pointer.
+LaunchTimes* stamps{nullptr};
+pid_t stamps_owner{-1};
+
+template <typename T>
+T* map_shared() {
+  void* p{mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0)};
+  // Zero-filled, which is a valid state of the atomics.
+  return p == MAP_FAILED ? nullptr : static_cast<T*>(p);
+}
+
+void print_histogram(std::ostream& os, const char* name,
+                     const std::string& labels, const Histogram& h) {
+  auto prefix{labels.empty() ? "{" : "{" + labels + ","};
+  std::uint64_t total{0};
+  for (std::size_t i{0}; i <= BUCKET_COUNT; i++) {
+    total += h.buckets[i].load(std::memory_order_relaxed);
+    os << name << "_bucket" << prefix << "le=\"";
+    if (i < BUCKET_COUNT) {
+      os << BUCKETS[i] / 1e6;
+    } else {
+      os << "+Inf";
+    }
+    os << "\"} " << total << "\n";
+  }
+  auto suffix{labels.empty() ? "" : "{" + labels + "}"};
+  os << name << "_sum" << suffix << " "
+     << h.sum_us.load(std::memory_order_relaxed) / 1e6 << "\n";
+  os << name << "_count" << suffix << " " << total << "\n";
+}
+
+}  // namespace
+
+bool init_metrics() {
+  if (!metrics) metrics = map_shared<Metrics>();
+  return metrics != nullptr;
+}
+
+long monotonic_us() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+LaunchTimes* launch_times() {
+  return stamps;
+}
+
+void begin_launch() {
+  if (!metrics) return;
+  auto pid{getpid()};
+  if (stamps_owner != pid) {
+    stamps = map_shared<LaunchTimes>();
+    stamps_owner = pid;
+  }
+  if (stamps) *stamps = LaunchTimes{monotonic_us(), 0, 0, 0};
+}
+
+void record_launch(long end_us) {
+  if (!metrics || !stamps || stamps_owner != getpid()) return;
+  auto t{*stamps};
+  // A child that failed early leaves the later stamps at 0.
+  if (t.exec_us) metrics->launch.observe(t.exec_us - t.launch_us);
+  const long points[]{t.launch_us, t.child_us, t.limits_us, t.exec_us,
+                      end_us};
+  for (std::size_t i{0}; i < PHASE_COUNT; i++) {
+    if (points[i] && points[i + 1]) {
+      metrics->phases[i].observe(points[i + 1] - points[i]);
+    }
+  }
+}
+
+void record_result(const SandboxResult& result) {
+  if (!metrics) return;
+  auto r{static_cast<std::size_t>(result.result)};
+  auto e{static_cast<std::size_t>(result.error)};
+  if (r < MAX_RESULTS && e < MAX_ERRORS) {
+    metrics->runs[r][e].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void record_forwarded(int stream, long bytes) {
+  if (!metrics || stream < 0 || stream > 2 || bytes <= 0) return;
+  metrics->forwarded[stream].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void add_children_in_flight(int delta) {
+  if (!metrics) return;
+  metrics->in_flight.fetch_add(delta, std::memory_order_relaxed);
+}
+
+std::string metrics_text() {
+  if (!metrics) return "";
+  std::ostringstream os;
+  os << std::setprecision(9);
+
+  os << "# HELP sandbox_runs_total Finished runs by result and error.\n"
+        "# TYPE sandbox_runs_total counter\n";
+  for (std::size_t r{0}; r < MAX_RESULTS; r++) {
+    for (std::size_t e{0}; e < MAX_ERRORS; e++) {
+      auto count{metrics->runs[r][e].load(std::memory_order_relaxed)};
+      if (!count) continue;
+      std::string error{error_msg[e]};
+      for (auto& c : error) {
+        if (c == ' ') c = '_';
+      }
+      os << "sandbox_runs_total{result=\"";
+      if (r < std::size(RESULT_NAMES)) {
+        os << RESULT_NAMES[r];
+      } else {
+        os << r;
+      }
+      os << "\",error=\"" << error << "\"} " << count << "\n";
+    }
+  }
+
+  os << "# HELP sandbox_launch_seconds Time from launching a child to its "
+        "exec.\n"
+        "# TYPE sandbox_launch_seconds histogram\n";
+  print_histogram(os, "sandbox_launch_seconds", "", metrics->launch);
+
+  os << "# HELP sandbox_phase_seconds Time of each phase of a run: fork (or "
+        "hand-over to a parked child), limits, setup of fds, and wait (exec "
+        "to exit).\n"
+        "# TYPE sandbox_phase_seconds histogram\n";
+  for (std::size_t i{0}; i < PHASE_COUNT; i++) {
+    print_histogram(os, "sandbox_phase_seconds",
+                    "phase=\"" + std::string{PHASES[i]} + "\"",
+                    metrics->phases[i]);
+  }
+
+  os << "# HELP sandbox_forwarded_bytes_total Bytes moved to or from the "
+        "programs' stdio.\n"
+        "# TYPE sandbox_forwarded_bytes_total counter\n";
+  for (std::size_t i{0}; i < std::size(STREAMS); i++) {
+    os << "sandbox_forwarded_bytes_total{stream=\"" << STREAMS[i] << "\"} "
+       << metrics->forwarded[i].load(std::memory_order_relaxed) << "\n";
+  }
+
+  os << "# HELP sandbox_children_in_flight Programs launched and not yet "
+        "reaped.\n"
+        "# TYPE sandbox_children_in_flight gauge\n"
+        "sandbox_children_in_flight "
+     << metrics->in_flight.load(std::memory_order_relaxed) << "\n";
+  return os.str();
+}
@@ -0,0 +1,69 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <string>
+
+#include "runner.h"
+
+// Counters and histograms of the runs of a long-running sandbox, in
+// Prometheus text format. They live in a shared anonymous mapping made by
+// init_metrics(), so that the runs of every worker forked afterwards count
+// towards the same totals; recording one is a few relaxed atomic adds, with
+// no syscall and no lock. Before init_metrics() nothing is recorded.
+
+// Map the counters. Call before forking the processes that run jobs.
+bool init_metrics();
+
+// Microseconds on the monotonic clock.
+long monotonic_us();
+
+// When the child of the current run reached each step of its launch, on the
+// monotonic clock in microseconds; 0 where it did not. The child's part is
+// stamped by child() into a mapping it shares with the process that
+// launched it, parked children included.
+struct LaunchTimes {
+  // Before the fork or the hand-over to a parked child.
+  long launch_us;
+  // First thing in child().
+  long child_us;
+  // Limits applied.
+  long limits_us;
+  // Fds redirected, right before the seccomp policy is loaded and the
+  // program exec'd. Nothing after that is stamped, since the policy need
+  // not allow reading the clock.
+  long exec_us;
+};
+
+// Where the child of the current run stamps its launch, or nullptr. Reset by
+// begin_launch().
+LaunchTimes* launch_times();
+// Reset the stamps of this process, before its child is launched.
+void begin_launch();
+// Record the launch latency (launch to exec) and the time of every phase --
+// fork, limits, setup and wait -- of a child reaped at `end_us`.
+void record_launch(long end_us);
+
+void record_result(const SandboxResult& result);
+// Bytes moved to or from the program's stdio, `stream` being the fd number.
+void record_forwarded(int stream, long bytes);
+void add_children_in_flight(int delta);
+
+// All of the above in Prometheus text format.
+std::string metrics_text();
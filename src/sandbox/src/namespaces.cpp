@@ -0,0 +1,276 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "namespaces.h"
+
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include "log.h"
+
+namespace {
+
+// In the order children join them: the user namespace owns the others.
+constexpr const int KINDS[]{CLONE_NEWUSER, CLONE_NEWNS, CLONE_NEWNET,
+                            CLONE_NEWIPC};
+constexpr const char* KIND_NAMES[]{"user", "mnt", "net", "ipc"};
+constexpr const std::size_t KIND_COUNT{std::size(KINDS)};
+
+struct Template {
+  // The process holding the namespaces, a child of `owner`.
+  pid_t holder{-1};
+  pid_t owner{-1};
+  uid_t uid{0};
+  gid_t gid{0};
+  // The namespaces, in the order of KINDS.
+  int fds[KIND_COUNT]{-1, -1, -1, -1};
+  // The pid namespace of the holder's children.
+  int pid_fd{-1};
+} tmpl;
+
+// Our own pid namespace, to return to after forking into the template's.
+int own_pid_fd{-1};
+
+bool read_byte(int fd) {
+  char c;
+  ssize_t n;
+  do {
+    n = read(fd, &c, 1);
+  } while (n == -1 && errno == EINTR);
+  return n == 1;
+}
+
+bool write_file(const std::string& path, const std::string& content) {
+  int fd{open(path.c_str(), O_WRONLY | O_CLOEXEC)};
+  if (fd == -1) return false;
+  bool ok{write(fd, content.data(), content.size()) ==
+          static_cast<ssize_t>(content.size())};
+  close(fd);
+  return ok;
+}
+
+[[noreturn]] void setup_failed(const char* step) {
+  LOG(error, "Cannot set up namespaces", "step", step, "error",
+      strerror(errno));
+  flush_log();
+  _exit(EXIT_FAILURE);
+}
+
+// The init of the template's pid namespace. It ignores SIGCHLD, so the
+// kernel reaps whatever a run leaves to it.
+[[noreturn]] void init(int ready_fd) {
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  // A container that hides parts of its /proc does not let us mount one;
+  // the program then sees the pids of the host there, which it may anyway.
+  if (mount("proc", "/proc", "proc", MS_RDONLY | MS_NOSUID | MS_NODEV |
+            MS_NOEXEC, nullptr) != 0) {
+    LOG(warning, "Cannot mount /proc of the pid namespace", "error",
+        strerror(errno));
+  }
+  signal(SIGCHLD, SIG_IGN);
+  if (write(ready_fd, "i", 1) != 1) _exit(EXIT_FAILURE);
+  close(ready_fd);
+  while (true) pause();
+}
+
+// Create the namespaces and hold them until `parent` is gone. Writes to
+// `ready_fd` once the user namespace exists, waiting on `go_fd` for its
+// maps, and once everything is set up.
+[[noreturn]] void hold(int ready_fd, int go_fd, pid_t parent) {
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() != parent) _exit(EXIT_FAILURE);
+  // Ctrl+C is for the program.
+  signal(SIGINT, SIG_IGN);
+  if (unshare(CLONE_NEWUSER) != 0) setup_failed("user");
+  if (write(ready_fd, "u", 1) != 1 || !read_byte(go_fd)) _exit(EXIT_FAILURE);
+  close(go_fd);
+  if (unshare(CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWPID) != 0) {
+    setup_failed("unshare");
+  }
+  // Nothing mounted in here shows up on the host, nor the other way round.
+  if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0) {
+    setup_failed("private");
+  }
+  mount_attr attr{};
+  attr.attr_set = MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID;
+  if (mount_setattr(AT_FDCWD, "/", AT_RECURSIVE, &attr, sizeof(attr)) != 0) {
+    setup_failed("read-only");
+  }
+  pid_t pid{fork()};
+  if (pid == 0) init(ready_fd);
+  if (pid == -1) setup_failed("init");
+  close(ready_fd);
+  while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+  }
+  _exit(EXIT_FAILURE);
+}
+
+void release() {
+  for (auto& fd : tmpl.fds) {
+    if (fd != -1) close(fd);
+    fd = -1;
+  }
+  if (tmpl.pid_fd != -1) close(tmpl.pid_fd);
+  tmpl.pid_fd = -1;
+  // A fork only forgets the template of its parent.
+  if (tmpl.holder != -1 && tmpl.owner == getpid()) {
+    kill(tmpl.holder, SIGKILL);
+    waitpid(tmpl.holder, nullptr, 0);
+  }
+  tmpl.holder = -1;
+}
+
+bool build(const SandboxConfig& config) {
+  int ready[2], go[2];
+  if (pipe2(ready, O_CLOEXEC) != 0) return false;
+  if (pipe2(go, O_CLOEXEC) != 0) {
+    close(ready[0]);
+    close(ready[1]);
+    return false;
+  }
+  auto parent{getpid()};
+  pid_t pid{fork()};
+  if (pid == 0) {
+    close(ready[0]);
+    close(go[1]);
+    hold(ready[1], go[0], parent);
+  }
+  close(ready[1]);
+  close(go[0]);
+  tmpl.holder = pid;
+  tmpl.owner = parent;
+  tmpl.uid = config.uid;
+  tmpl.gid = config.gid;
+
+  // Only the ids the program runs as exist in the user namespace.
+  auto proc{"/proc/" + std::to_string(pid)};
+  auto uid{std::to_string(config.uid)};
+  auto gid{std::to_string(config.gid)};
+  bool ok{pid != -1 && read_byte(ready[0]) &&
+          write_file(proc + "/uid_map", uid + " " + uid + " 1\n") &&
+          write_file(proc + "/gid_map", gid + " " + gid + " 1\n") &&
+          write(go[1], "g", 1) == 1};
+  close(go[1]);
+  ok = ok && read_byte(ready[0]);
+  close(ready[0]);
+  for (std::size_t i{0}; ok && i < KIND_COUNT; i++) {
+    auto path{proc + "/ns/" + KIND_NAMES[i]};
+    tmpl.fds[i] = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    ok = tmpl.fds[i] != -1;
+  }
+  if (ok) {
+    tmpl.pid_fd = open((proc + "/ns/pid_for_children").c_str(),
+                       O_RDONLY | O_CLOEXEC);
+    ok = tmpl.pid_fd != -1;
+  }
+  if (!ok) {
+    LOG(error, "Cannot build namespace template", "error", strerror(errno));
+    if (pid == -1) tmpl.holder = -1;
+    release();
+    return false;
+  }
+  LOG(info, "Namespace template built", "holder", pid);
+  return true;
+}
+
+// Bind the executable over an empty file at its path if the tmpfs hides it.
+bool keep_reachable(const std::string& path, int fd) {
+  if (access(path.c_str(), F_OK) == 0) return true;
+  for (auto slash{path.find('/', 1)}; slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    if (mkdir(path.substr(0, slash).c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+  }
+  int file{open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0755)};
+  if (file == -1) return false;
+  close(file);
+  auto source{"/proc/self/fd/" + std::to_string(fd)};
+  return mount(source.c_str(), path.c_str(), nullptr, MS_BIND, nullptr) == 0;
+}
+
+}  // namespace
+
+bool prepare_namespaces(const SandboxConfig& config) {
+  if (tmpl.holder != -1 && tmpl.uid == config.uid && tmpl.gid == config.gid) {
+    return true;
+  }
+  release();
+  return build(config);
+}
+
+bool namespaces_ready() {
+  return tmpl.holder != -1;
+}
+
+bool select_pid_namespace(bool isolated) {
+  if (own_pid_fd == -1) {
+    own_pid_fd = open("/proc/self/ns/pid", O_RDONLY | O_CLOEXEC);
+  }
+  int fd{isolated ? tmpl.pid_fd : own_pid_fd};
+  return fd != -1 && setns(fd, CLONE_NEWPID) == 0;
+}
+
+ErrorType enter_namespaces(const SandboxConfig& config) {
+  if (tmpl.holder == -1) return ErrorType::NAMESPACE_FAILED;
+  // Joining a mount namespace moves us to its root directory.
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) std::strcpy(cwd, "/");
+  for (std::size_t i{0}; i < KIND_COUNT; i++) {
+    if (setns(tmpl.fds[i], KINDS[i]) != 0) {
+      return ErrorType::NAMESPACE_FAILED;
+    }
+    if (KINDS[i] != CLONE_NEWUSER) continue;
+    // Right away, as files cannot be made by a uid that is not mapped. Uid 0
+    // is not mapped either, so we keep our capabilities in the namespace
+    // until the exec, where the program does not get them.
+    if (setgroups(1, &config.gid) != 0 ||
+        setresgid(config.gid, config.gid, config.gid) != 0 ||
+        setresuid(config.uid, config.uid, config.uid) != 0) {
+      return ErrorType::SETUID_FAILED;
+    }
+  }
+  // A copy of the template's mount namespace, for a tmpfs of our own.
+  if (unshare(CLONE_NEWNS) != 0 || (chdir(cwd) != 0 && chdir("/") != 0)) {
+    return ErrorType::NAMESPACE_FAILED;
+  }
+  int exe{open(config.exe_path.c_str(), O_PATH | O_CLOEXEC)};
+  std::string options{"mode=1777"};
+  if (config.tmpfs_size != UNLIMITED) {
+    options += ",size=" + std::to_string(config.tmpfs_size);
+  }
+  bool ok{mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV,
+                options.c_str()) == 0 &&
+          (exe == -1 || keep_reachable(config.exe_path, exe))};
+  if (exe != -1) close(exe);
+  if (!ok) return ErrorType::NAMESPACE_FAILED;
+  return ErrorType::SUCCESS;
+}
@@ -0,0 +1,51 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "runner.h"
+
+// Namespaces that keep a program from the host and from other runs: a user
+// namespace in which only `config.uid` and `config.gid` exist, a mount
+// namespace with the root file system read-only and a fresh tmpfs on /tmp,
+// and pid, network and ipc namespaces of its own.
+//
+// Creating them and remounting the root file system costs milliseconds, so
+// each process that runs jobs builds a template once: a process holding
+// namespaces set up as above. A child joins them with setns(), and copies
+// only the mount namespace, for its tmpfs. A process cannot move itself
+// into a pid namespace, so the one running jobs switches the pid namespace
+// of its children to the template's around each fork of a namespaced child,
+// parked children included, and back to its own right after. Forks of that
+// process share the template and must not outlive it.
+
+// Build the template of this process for `config.uid` and `config.gid`
+// unless it has one. Call in the parent before forking. false if the kernel
+// or our privileges do not allow it.
+bool prepare_namespaces(const SandboxConfig& config);
+
+// Whether children forked now can enter the template.
+bool namespaces_ready();
+
+// Make children forked from now on start in the pid namespace of the
+// template, or with false in ours. false if that fails.
+bool select_pid_namespace(bool isolated);
+
+// Join the template in the child, mount its tmpfs and become `config.uid`
+// and `config.gid`. The executable stays reachable at `config.exe_path` and
+// the working directory stays where it was, even below /tmp.
+ErrorType enter_namespaces(const SandboxConfig& config);
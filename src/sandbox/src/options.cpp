@@ -0,0 +1,87 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "options.h"
+
+using namespace std::literals;
+
+boost::program_options::options_description job_options(
+    SandboxConfig& config) {
+  namespace po = boost::program_options;
+  po::options_description desc("Job options");
+
+#define OPTION(name, default_val, desc)                                        \
+  (#name,                                                                      \
+   po::value<decltype(config.name)>(&config.name)->default_value(default_val), \
+   desc)
+#define OPTION_VEC(name, desc) \
+  (#name, po::value<decltype(config.name)>(&config.name)->composing(), desc)
+
+  // clang-format off
+  desc.add_options()
+    OPTION(max_cpu_time, UNLIMITED, "Max CPU time (ms)")
+    OPTION(max_real_time, UNLIMITED, "Max real time (ms)")
+    OPTION(max_memory, UNLIMITED, "Max memory (B)")
+    OPTION(max_stack, 16L * 1024 * 1024, "Max stack (B)")
+    OPTION(max_process_number, UNLIMITED, "Max process number")
+    OPTION(max_output_size, UNLIMITED, "Max output size (B)")
+    OPTION(output_keep, UNLIMITED,
+           "Output passed on from the start and the end of each stream (B)")
+    OPTION(max_instructions, UNLIMITED,
+           "Max retired instructions in user mode")
+    OPTION(exe_path, ""s, "Executable path")
+    OPTION(input_path, ""s, "Input path")
+    OPTION(output_path, ""s, "Output path")
+    OPTION(error_path, ""s, "Error path")
+    OPTION_VEC(args, "Arguments")
+    OPTION_VEC(env, "Environment variables")
+    OPTION(log_path, "sandbox.log"s, "Log path")
+    OPTION(result_path, "result.json"s, "Result path")
+    OPTION(result_fd, -1, "Result fd (overrides result path)")
+    OPTION(cgroup_root, ""s, "cgroup v2 directory to run programs in")
+    OPTION(policy, "c_cpp"s, "Seccomp policy profile")
+    OPTION(seccomp_cache, ""s, "Seccomp program cache directory")
+    OPTION(tmpfs_size, 64L * 1024 * 1024,
+           "Size of the tmpfs on /tmp with --namespaces (B)")
+    OPTION(answer_path, ""s, "Compare stdout with this file")
+    OPTION(check_mode, "lines"s,
+           "Comparison: exact, lines, tokens or float")
+    OPTION(check_epsilon, 1e-6, "Tolerance of numbers in float mode")
+    OPTION(checker_path, ""s, "Checker (or interactor) judging the output")
+    OPTION(checker_max_cpu_time, 10000, "Max CPU time of the checker (ms)")
+    OPTION(checker_max_real_time, 20000, "Max real time of the checker (ms)")
+    OPTION(checker_max_memory, UNLIMITED, "Max memory of the checker (B)")
+    OPTION(checker_policy, "checker"s, "Seccomp policy profile of the checker")
+    OPTION(uid, 65534, "User ID")
+    OPTION(gid, 65534, "Group ID")
+    ("debug-mode", po::bool_switch(&config.debug_mode), "Debug mode")
+    ("interactive", po::bool_switch(&config.interactive),
+     "Run the checker alongside the program as an interactor")
+    ("memfd-io", po::bool_switch(&config.memfd_io),
+     "Pass stdio through memfds instead of forwarding it")
+    ("perf-counters", po::bool_switch(&config.perf_counters),
+     "Report perf_event counters of the program")
+    ("namespaces", po::bool_switch(&config.namespaces),
+     "Isolate the program in user, mount, pid, network and ipc namespaces")
+  ;
+  // clang-format on
+
+#undef OPTION
+#undef OPTION_VEC
+
+  return desc;
+}
@@ -0,0 +1,180 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "perf_counters.h"
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+#include "log.h"
+
+namespace {
+
+struct Event {
+  std::uint32_t type;
+  std::uint64_t config;
+  long PerfCounts::*count;
+};
+
+constexpr const Event EVENTS[]{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, &PerfCounts::instructions},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &PerfCounts::cycles},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+     &PerfCounts::context_switches},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, &PerfCounts::page_faults},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ,
+     &PerfCounts::major_faults},
+};
+
+// The overflow of an instruction budget is signalled with this.
+constexpr const int BUDGET_SIGNAL{SIGIO};
+
+// Counts `event` of `pid` and its later threads and children from its next
+// execve() on.
+perf_event_attr event_attr(const Event& event, bool exclude_kernel) {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  return attr;
+}
+
+int open_event(perf_event_attr& attr, pid_t pid) {
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+int open_event(const Event& event, pid_t pid, bool exclude_kernel) {
+  auto attr{event_attr(event, exclude_kernel)};
+  // To scale a count that shared the PMU with other events.
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return open_event(attr, pid);
+}
+
+}  // namespace
+
+PerfCounters::~PerfCounters() {
+  for (auto fd : fds_) {
+    if (fd != -1) close(fd);
+  }
+}
+
+bool PerfCounters::attach(pid_t pid) {
+  static_assert(std::size(EVENTS) == sizeof(fds_) / sizeof(fds_[0]));
+  bool attached{false};
+  for (std::size_t i{0}; i < std::size(EVENTS); i++) {
+    fds_[i] = open_event(EVENTS[i], pid, false);
+    // Without CAP_PERFMON, perf_event_paranoid may only allow user mode.
+    if (fds_[i] == -1 && errno == EACCES) {
+      fds_[i] = open_event(EVENTS[i], pid, true);
+    }
+    if (fds_[i] == -1) {
+      LOG(info, "Counter unavailable", "counter", i, "error",
+          strerror(errno));
+    }
+    attached |= fds_[i] != -1;
+  }
+  return attached;
+}
+
+PerfCounts PerfCounters::read() const {
+  PerfCounts counts{true, -1, -1, -1, -1, -1};
+  for (std::size_t i{0}; i < std::size(EVENTS); i++) {
+    // value, time enabled, time running
+    std::uint64_t values[3];
+    if (fds_[i] == -1 ||
+        ::read(fds_[i], values, sizeof(values)) != sizeof(values)) {
+      continue;
+    }
+    auto count{values[0]};
+    if (values[2] != 0 && values[2] < values[1]) {
+      count = static_cast<std::uint64_t>(static_cast<double>(count) *
+                                         values[1] / values[2]);
+    }
+    counts.*EVENTS[i].count = static_cast<long>(count);
+  }
+  return counts;
+}
+
+InstructionLimit::~InstructionLimit() {
+  // No more signals once the event is gone; take the one that may be
+  // pending before it is unblocked.
+  if (perf_fd_ != -1) close(perf_fd_);
+  if (signal_fd_ != -1) {
+    signalfd_siginfo info;
+    while (::read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+    }
+    close(signal_fd_);
+  }
+  if (blocked_) pthread_sigmask(SIG_SETMASK, &old_mask_, nullptr);
+}
+
+bool InstructionLimit::attach(pid_t pid, long budget) {
+  // User mode only: what the kernel does for the program varies.
+  auto attr{event_attr(EVENTS[0], true)};
+  // Never multiplexed, so that the count is exact.
+  attr.pinned = 1;
+  attr.sample_period = budget;
+  attr.wakeup_events = 1;
+  perf_fd_ = open_event(attr, pid);
+  if (perf_fd_ == -1) {
+    LOG(error, "No instruction counter", "error", strerror(errno));
+    return false;
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, BUDGET_SIGNAL);
+  if (pthread_sigmask(SIG_BLOCK, &mask, &old_mask_) != 0) return false;
+  blocked_ = true;
+  signal_fd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  // Overflows in threads and children of the program are signalled through
+  // this event too. The signal goes to this thread, which reads the signalfd;
+  // other threads block it (see init_log()).
+  f_owner_ex owner{F_OWNER_TID, gettid()};
+  if (signal_fd_ == -1 || fcntl(perf_fd_, F_SETOWN_EX, &owner) == -1 ||
+      fcntl(perf_fd_, F_SETSIG, BUDGET_SIGNAL) == -1 ||
+      fcntl(perf_fd_, F_SETFL, fcntl(perf_fd_, F_GETFL) | O_ASYNC) == -1) {
+    LOG(error, "Cannot watch instruction counter", "error", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+long InstructionLimit::count() const {
+  std::uint64_t value;
+  if (perf_fd_ == -1 || ::read(perf_fd_, &value, sizeof(value)) != sizeof(value)) {
+    return -1;
+  }
+  return static_cast<long>(value);
+}
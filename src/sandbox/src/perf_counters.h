@@ -0,0 +1,76 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <signal.h>
+#include <sys/types.h>
+
+#include "runner.h"
+
+// perf_event counters of one program. Each counts from the program's execve()
+// on, in user and kernel mode where permitted (see perf_event_paranoid), and
+// includes the threads and processes it starts.
+class PerfCounters {
+ public:
+  PerfCounters() = default;
+  ~PerfCounters();
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // Attach to `pid`, which must not have exec'd the program yet. Counters
+  // the kernel refuses, e.g. hardware ones in a VM without a PMU, are left
+  // out. Returns false if none could be attached.
+  bool attach(pid_t pid);
+  // Read once the program and its descendants are gone, as counts of the
+  // children are added when they exit.
+  PerfCounts read() const;
+
+ private:
+  int fds_[5]{-1, -1, -1, -1, -1};
+};
+
+// A budget of instructions the program may retire in user mode. Unlike its
+// CPU time, this is the same on every run of a deterministic program however
+// busy the host is. The PMU interrupts once the program spends it; we learn
+// of that through a signal read from fd(). Each thread or process of the
+// program counts against the budget on its own, so the total count is to be
+// checked after the run as well.
+class InstructionLimit {
+ public:
+  InstructionLimit() = default;
+  ~InstructionLimit();
+  InstructionLimit(const InstructionLimit&) = delete;
+  InstructionLimit& operator=(const InstructionLimit&) = delete;
+
+  // Like PerfCounters::attach(). Returns false without an instruction counter.
+  bool attach(pid_t pid, long budget);
+  // Readable once the budget is spent.
+  int fd() const {
+    return signal_fd_;
+  }
+  // Instructions retired by the program and the descendants that are gone,
+  // or -1.
+  long count() const;
+
+ private:
+  int perf_fd_{-1};
+  int signal_fd_{-1};
+  bool blocked_{false};
+  sigset_t old_mask_;
+};
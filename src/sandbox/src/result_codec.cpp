@@ -0,0 +1,113 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "result_codec.h"
+
+#include <cstring>
+#include <type_traits>
+
+namespace {
+
+// Little-endian regardless of the host; compiles to plain stores on x86.
+template <typename T>
+void put(unsigned char*& p, T value) {
+  auto u{static_cast<std::make_unsigned_t<T>>(value)};
+  for (std::size_t i{0}; i < sizeof(T); i++) {
+    *p++ = static_cast<unsigned char>(u >> (8 * i));
+  }
+}
+
+template <typename T>
+T get(const unsigned char*& p) {
+  std::make_unsigned_t<T> u{0};
+  for (std::size_t i{0}; i < sizeof(T); i++) {
+    u |= static_cast<std::make_unsigned_t<T>>(*p++) << (8 * i);
+  }
+  return static_cast<T>(u);
+}
+
+}  // namespace
+
+void encode_result(const SandboxResult& result, unsigned char* frame) {
+  auto p{frame};
+  std::memcpy(p, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+  p += sizeof(RESULT_MAGIC);
+  put<std::uint16_t>(p, RESULT_VERSION);
+  put<std::uint16_t>(p, RESULT_PAYLOAD_SIZE);
+  put<std::uint8_t>(p, result.error == ErrorType::SUCCESS);
+  put<std::uint8_t>(p, static_cast<std::uint8_t>(result.error));
+  put<std::uint8_t>(p, static_cast<std::uint8_t>(result.result));
+  put<std::uint8_t>(p, result.perf.enabled ? RESULT_FLAG_PERF : 0);
+  put<std::int32_t>(p, result.signal);
+  put<std::int32_t>(p, result.exit_code);
+  put<std::int32_t>(p, result.cpu_time);
+  put<std::int32_t>(p, result.real_time);
+  put<std::int64_t>(p, result.memory);
+  put<std::int64_t>(p, result.cpu_time_us);
+  put<std::int64_t>(p, result.real_time_us);
+  // -1 as well when the run did not ask for them.
+  auto& perf{result.perf};
+  for (auto count : {perf.instructions, perf.cycles, perf.context_switches,
+                     perf.page_faults, perf.major_faults}) {
+    put<std::int64_t>(p, perf.enabled ? count : -1);
+  }
+}
+
+std::string encode_result(const SandboxResult& result) {
+  std::string frame(RESULT_FRAME_SIZE, '\0');
+  encode_result(result, reinterpret_cast<unsigned char*>(frame.data()));
+  return frame;
+}
+
+long decode_result(const unsigned char* data, std::size_t size,
+                   SandboxResult& result) {
+  if (size < RESULT_HEADER_SIZE) return 0;
+  if (std::memcmp(data, RESULT_MAGIC, sizeof(RESULT_MAGIC)) != 0) return -1;
+  auto p{data + sizeof(RESULT_MAGIC)};
+  auto version{get<std::uint16_t>(p)};
+  std::size_t length{get<std::uint16_t>(p)};
+  if (version < 1 || length < RESULT_PAYLOAD_V1_SIZE) return -1;
+  if (size < RESULT_HEADER_SIZE + length) return 0;
+
+  get<std::uint8_t>(p);  // success, implied by error
+  result.error = static_cast<ErrorType>(get<std::uint8_t>(p));
+  result.result = static_cast<ResultType>(get<std::uint8_t>(p));
+  auto flags{get<std::uint8_t>(p)};
+  result.signal = get<std::int32_t>(p);
+  result.exit_code = get<std::int32_t>(p);
+  result.cpu_time = get<std::int32_t>(p);
+  result.real_time = get<std::int32_t>(p);
+  result.memory = get<std::int64_t>(p);
+  if (length >= RESULT_PAYLOAD_V2_SIZE) {
+    result.cpu_time_us = get<std::int64_t>(p);
+    result.real_time_us = get<std::int64_t>(p);
+  } else {
+    result.cpu_time_us = result.cpu_time * 1000L;
+    result.real_time_us = result.real_time * 1000L;
+  }
+  auto& perf{result.perf};
+  perf = PerfCounts{false, -1, -1, -1, -1, -1};
+  if (length >= RESULT_PAYLOAD_SIZE) {
+    perf.enabled = flags & RESULT_FLAG_PERF;
+    for (auto count : {&perf.instructions, &perf.cycles,
+                       &perf.context_switches, &perf.page_faults,
+                       &perf.major_faults}) {
+      *count = get<std::int64_t>(p);
+    }
+  }
+  return RESULT_HEADER_SIZE + length;
+}
@@ -0,0 +1,52 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "runner.h"
+
+// Fixed-layout binary encoding of SandboxResult. A frame is self-delimiting,
+// so frames can be sent back to back over a pipe or socket. The layout is
+// described in README.md; fields are only ever appended, and decoders skip
+// whatever follows the fields they know.
+
+constexpr const unsigned char RESULT_MAGIC[4]{'C', 'S', 'B', 'R'};
+constexpr const std::uint16_t RESULT_VERSION{3};
+constexpr const std::size_t RESULT_HEADER_SIZE{8};
+constexpr const std::size_t RESULT_PAYLOAD_SIZE{84};
+// Payload of version 1, without the microsecond times.
+constexpr const std::size_t RESULT_PAYLOAD_V1_SIZE{28};
+// Payload of version 2, without the perf counters.
+constexpr const std::size_t RESULT_PAYLOAD_V2_SIZE{44};
+// Bits of the flags byte.
+constexpr const std::uint8_t RESULT_FLAG_PERF{1};
+constexpr const std::size_t RESULT_FRAME_SIZE{RESULT_HEADER_SIZE +
+                                              RESULT_PAYLOAD_SIZE};
+
+// Write the frame of `result` into `frame`, which holds RESULT_FRAME_SIZE
+// bytes.
+void encode_result(const SandboxResult& result, unsigned char* frame);
+std::string encode_result(const SandboxResult& result);
+
+// Decode the frame at the start of `data`. Returns the size of the frame, 0 if
+// `size` does not cover it yet, or -1 if `data` is not a result frame.
+long decode_result(const unsigned char* data, std::size_t size,
+                   SandboxResult& result);
@@ -18,29 +18,60 @@
 #include "runner.h"
 
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
-#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include <boost/log/core.hpp>
-#include <boost/log/trivial.hpp>
-#include <boost/log/utility/setup.hpp>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
-#include <thread>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <string>
 
+#include "cgroup.h"
+#include "checker.h"
 #include "child.h"
+#include "judge.h"
+#include "log.h"
+#include "metrics.h"
+#include "namespaces.h"
+#include "perf_counters.h"
+#include "seccomp_filter.h"
+#include "zygote.h"
 
 std::ostream& operator<<(std::ostream& os, const SandboxResult& result) {
   if (result.error == ErrorType::SUCCESS) {
     os << "{\n  \"success\": true"
        << ",\n  \"cpu_time\": " << result.cpu_time
        << ",\n  \"real_time\": " << result.real_time
+       << ",\n  \"cpu_time_us\": " << result.cpu_time_us
+       << ",\n  \"real_time_us\": " << result.real_time_us
        << ",\n  \"memory\": " << result.memory
        << ",\n  \"signal\": " << result.signal
        << ",\n  \"exit_code\": " << result.exit_code
-       << ",\n  \"result\": " << static_cast<int>(result.result) << "\n}";
+       << ",\n  \"result\": " << static_cast<int>(result.result);
+    if (result.perf.enabled) {
+      os << ",\n  \"instructions\": " << result.perf.instructions
+         << ",\n  \"cycles\": " << result.perf.cycles
+         << ",\n  \"context_switches\": " << result.perf.context_switches
+         << ",\n  \"page_faults\": " << result.perf.page_faults
+         << ",\n  \"major_faults\": " << result.perf.major_faults;
+    }
+    os << "\n}";
   } else {
     os << "{\n  \"success\": false"
        << ",\n  \"error\": " << static_cast<int>(result.error) << "\n}";
@@ -50,24 +81,423 @@ std::ostream& operator<<(std::ostream& os, const SandboxResult& result) {
 
 namespace {
 
+constexpr const std::size_t FORWARD_BUFFER{1 << 16};
+// Capacity requested for the stdio pipes. A bigger pipe lets the child write
+// a burst without waiting for us, and lets one splice() move it all.
+constexpr const int PIPE_SIZE{1 << 20};
+
 [[noreturn]] void error_exit(ErrorType e) {
-  BOOST_LOG_TRIVIAL(fatal) << "Fatal error: " << error_msg[static_cast<int>(e)];
+  LOG(fatal, "Fatal error", "error", error_msg[static_cast<int>(e)]);
+  flush_log();
   std::abort();
 }
 
+SandboxResult error_result(ErrorType e) {
+  LOG(error, "Run failed", "error", error_msg[static_cast<int>(e)]);
+  SandboxResult result{};
+  result.error = e;
+  result.result = ResultType::SYSTEM_ERROR;
+  return result;
+}
+
+void close_fd(int& fd) {
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+int pidfd_open(pid_t pid) {
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Unlike kill(), never hits another process that reused the pid.
+void pidfd_kill(int pidfd) {
+  syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, nullptr, 0);
+}
+
+// Write all of `buf`, waiting whenever a non-blocking `fd` is full.
+bool write_all(int fd, const char* buf, std::size_t size) {
+  while (size > 0) {
+    auto n{write(fd, buf, size)};
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {
+        pollfd p{fd, POLLOUT, 0};
+        poll(&p, 1, -1);
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    size -= n;
+  }
+  return true;
+}
+
+enum class Forward { OPEN, END, FAILED, MISMATCH, LIMIT };
+
+// A stream of the program's output on its way to our stdout or stderr. At
+// most `limit` bytes of it are taken; past that the stream is over. Of
+// those, the first `keep` are passed on as they come and the last `keep`
+// once the run is over, with a note of how much was left out between them.
+class OutputStream {
+ public:
+  OutputStream(int to, long limit, long keep)
+      : to_{to}, limit_{limit}, keep_{keep} {}
+
+  // Move everything currently readable from the non-blocking pipe `from`.
+  // Data is spliced, i.e. moved between the pipe buffers in the kernel, as
+  // long as `to` supports it and nothing needs to be looked at; otherwise
+  // it is copied through a buffer.
+  Forward forward(int from) {
+    while (use_splice_) {
+      auto size{std::min(static_cast<long>(PIPE_SIZE), passing())};
+      // Only the limit is left to find: read what comes next.
+      if (size == 0) break;
+      auto n{splice(from, nullptr, to_, nullptr, size,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK)};
+      if (n > 0) {
+        total_ += n;
+        record_forwarded(to_, n);
+        continue;
+      }
+      if (n == 0) return Forward::END;
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {
+        // Either `from` is drained, or `to` is a full non-blocking file.
+        int pending{0};
+        if (ioctl(from, FIONREAD, &pending) == -1 || pending == 0) {
+          return Forward::OPEN;
+        }
+        pollfd p{to_, POLLOUT, 0};
+        poll(&p, 1, -1);
+        continue;
+      }
+      if (errno != EINVAL) {
+        // Like a terminal, we do not care whether anyone reads our output.
+        // Drain the pipe through the buffer below.
+        LOG(warning, "splice failed", "error", strerror(errno));
+      }
+      use_splice_ = false;
+    }
+    char buf[FORWARD_BUFFER];
+    while (true) {
+      auto n{read(from, buf, sizeof(buf))};
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN ? Forward::OPEN : Forward::FAILED;
+      }
+      if (n == 0) return Forward::END;
+      auto taken{limit_ == UNLIMITED ? n : std::min(n, limit_ - total_)};
+      take(buf, taken);
+      if (taken < n) return Forward::LIMIT;
+    }
+  }
+
+  // Pass on the end of the stream, if it was held back.
+  void finish() {
+    if (tail_.empty()) return;
+    auto omitted{total_ - keep_ - static_cast<long>(tail_.size())};
+    if (omitted > 0) {
+      auto note{"\n... " + std::to_string(omitted) + " bytes omitted ...\n"};
+      write_all(to_, note.data(), note.size());
+    }
+    write_all(to_, tail_.data() + tail_begin_, tail_.size() - tail_begin_);
+    write_all(to_, tail_.data(), tail_begin_);
+    record_forwarded(to_, tail_.size());
+    tail_.clear();
+  }
+
+ private:
+  // Bytes that may still go out as they come, within the limit.
+  long passing() const {
+    long left{std::numeric_limits<long>::max()};
+    if (limit_ != UNLIMITED) left = limit_ - total_;
+    if (keep_ != UNLIMITED) left = std::min(left, keep_ - total_);
+    return std::max(left, 0L);
+  }
+
+  void take(const char* data, long size) {
+    auto head{keep_ == UNLIMITED ? size
+                                 : std::clamp(keep_ - total_, 0L, size)};
+    if (head > 0) {
+      write_all(to_, data, head);
+      record_forwarded(to_, head);
+    }
+    total_ += size;
+    data += head;
+    size -= head;
+    if (size == 0) return;
+    if (size >= keep_) {
+      tail_.assign(data + size - keep_, keep_);
+      tail_begin_ = 0;
+      return;
+    }
+    // The tail is a ring of `keep_` bytes once full, oldest at tail_begin_.
+    while (size > 0) {
+      long n;
+      if (static_cast<long>(tail_.size()) < keep_) {
+        n = std::min(size, keep_ - static_cast<long>(tail_.size()));
+        tail_.append(data, n);
+      } else {
+        n = std::min(size, static_cast<long>(tail_.size() - tail_begin_));
+        std::memcpy(tail_.data() + tail_begin_, data, n);
+        tail_begin_ = (tail_begin_ + n) % tail_.size();
+      }
+      data += n;
+      size -= n;
+    }
+  }
+
+  int to_;
+  long limit_;
+  long keep_;
+  bool use_splice_{true};
+  long total_{0};
+  std::string tail_;
+  std::size_t tail_begin_{0};
+};
+
+// Like OutputStream::forward(), but compare the output with the answer
+// instead.
+Forward check_output(int from, Checker& checker) {
+  char buf[FORWARD_BUFFER];
+  while (true) {
+    auto n{read(from, buf, sizeof(buf))};
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN ? Forward::OPEN : Forward::FAILED;
+    }
+    if (n == 0) return Forward::END;
+    if (!checker.feed(buf, n)) return Forward::MISMATCH;
+  }
+}
+
+// Input waiting to be written to the child's stdin, when it cannot be
+// spliced (e.g. our stdin is a terminal).
+struct InputBuffer {
+  char data[FORWARD_BUFFER];
+  std::size_t begin;
+  std::size_t end;
+};
+
+// Seal a memfd against any further change of its content.
+void seal(int fd) {
+  fcntl(fd, F_ADD_SEALS,
+        F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+}
+
+// Stdin of a memfd-io run: our stdin itself if it already is a file (e.g. a
+// memfd from the caller), or else all of it copied into a sealed memfd.
+int input_memfd() {
+  struct stat st;
+  if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+    return fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+  }
+  int fd{memfd_create("stdin", MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+  if (fd == -1) return -1;
+  bool use_splice{true};
+  while (true) {
+    ssize_t n;
+    if (use_splice) {
+      n = splice(STDIN_FILENO, nullptr, fd, nullptr, PIPE_SIZE, SPLICE_F_MOVE);
+      if (n == -1 && errno == EINVAL) {
+        use_splice = false;
+        continue;
+      }
+    } else {
+      char buf[FORWARD_BUFFER];
+      n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n > 0 && !write_all(fd, buf, n)) n = -1;
+    }
+    if (n == 0) break;
+    record_forwarded(STDIN_FILENO, n);
+    if (n == -1 && errno != EINTR && errno != EAGAIN) {
+      close(fd);
+      return -1;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      pollfd p{STDIN_FILENO, POLLIN, 0};
+      poll(&p, 1, -1);
+    }
+  }
+  seal(fd);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+// Copy bytes `offset` to `end` of a memfd to `to`.
+void send_memfd(int fd, int to, off_t offset, off_t end) {
+  auto begin{offset};
+  while (offset < end) {
+    if (sendfile(to, fd, &offset, end - offset) <= 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {
+        pollfd p{to, POLLOUT, 0};
+        poll(&p, 1, -1);
+        continue;
+      }
+      break;
+    }
+  }
+  // sendfile() does not support every kind of `to`.
+  char buf[FORWARD_BUFFER];
+  while (offset < end) {
+    auto n{pread(fd, buf, std::min<off_t>(sizeof(buf), end - offset), offset)};
+    if (n <= 0 || !write_all(to, buf, n)) break;
+    offset += n;
+  }
+  record_forwarded(to, offset - begin);
+}
+
+// Cut an output memfd to `limit` bytes, seal it and copy it to `to`: all of
+// it, or as OutputStream does, its first and last `keep` bytes.
+void output_memfd(int fd, int to, long limit, long keep) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) return;
+  off_t size{st.st_size};
+  if (limit != UNLIMITED && size > limit) {
+    size = limit;
+    ftruncate(fd, size);
+  }
+  seal(fd);
+  if (keep == UNLIMITED || size <= 2 * keep) {
+    send_memfd(fd, to, 0, size);
+    return;
+  }
+  send_memfd(fd, to, 0, keep);
+  auto note{"\n... " + std::to_string(size - 2 * keep) +
+            " bytes omitted ...\n"};
+  write_all(to, note.data(), note.size());
+  send_memfd(fd, to, size - keep, size);
+}
+
+// The time of `clock` in microseconds.
+long now_us(clockid_t clock) {
+  timespec ts{};
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Make a one-shot timer expire `us` microseconds from now.
+bool arm(int timerfd, long us) {
+  itimerspec spec{};
+  spec.it_value.tv_sec = us / 1000000;
+  // An all-zero value would disarm it.
+  spec.it_value.tv_nsec = std::max(us % 1000000 * 1000, 1L);
+  return timerfd_settime(timerfd, 0, &spec, nullptr) == 0;
+}
+
+// Follows the interest set of an epoll instance, so that it can be updated
+// with a single call.
+class Poller {
+ public:
+  Poller() : epfd_{epoll_create1(EPOLL_CLOEXEC)} {}
+  ~Poller() {
+    close_fd(epfd_);
+  }
+  Poller(const Poller&) = delete;
+  Poller& operator=(const Poller&) = delete;
+
+  bool ok() const {
+    return epfd_ != -1;
+  }
+
+  // Returns false if `fd` cannot be polled (e.g. a regular file).
+  bool watch(int fd, std::uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    auto it{interest_.find(fd)};
+    if (it == interest_.end()) {
+      if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) return false;
+      interest_[fd] = events;
+    } else if (it->second != events) {
+      if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == -1) return false;
+      it->second = events;
+    }
+    return true;
+  }
+
+  void unwatch(int fd) {
+    if (interest_.erase(fd)) {
+      epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+  }
+
+  int wait(epoll_event* events, int size, int timeout) {
+    return epoll_wait(epfd_, events, size, timeout);
+  }
+
+ private:
+  int epfd_;
+  std::map<int, std::uint32_t> interest_;
+};
+
+// Notices when a child stops, which its pidfd does not tell: SIGCHLD is
+// blocked in this thread and read from a signalfd for as long as it lives.
+// Blocked only after the fork, as the mask would be inherited by the program.
+class StopWatch {
+ public:
+  StopWatch() {
+    sigemptyset(&mask_);
+    sigaddset(&mask_, SIGCHLD);
+    if (pthread_sigmask(SIG_BLOCK, &mask_, &old_mask_) != 0) return;
+    blocked_ = true;
+    fd_ = signalfd(-1, &mask_, SFD_NONBLOCK | SFD_CLOEXEC);
+  }
+  ~StopWatch() {
+    // Take what is pending before it is unblocked.
+    drain();
+    close_fd(fd_);
+    if (blocked_) pthread_sigmask(SIG_SETMASK, &old_mask_, nullptr);
+  }
+  StopWatch(const StopWatch&) = delete;
+  StopWatch& operator=(const StopWatch&) = delete;
+
+  int fd() const {
+    return fd_;
+  }
+
+  // The signal that stopped `pid`, or 0 if it has not stopped. A stop that
+  // came before the signalfd still shows here.
+  int stopped(pid_t pid) {
+    drain();
+    siginfo_t info{};
+    if (waitid(P_PID, pid, &info, WSTOPPED | WNOHANG) == -1 ||
+        info.si_pid != pid) {
+      return 0;
+    }
+    return info.si_status;
+  }
+
+ private:
+  void drain() {
+    signalfd_siginfo info;
+    while (fd_ != -1 && read(fd_, &info, sizeof(info)) == sizeof(info)) {
+    }
+  }
+
+  int fd_{-1};
+  bool blocked_{false};
+  sigset_t mask_;
+  sigset_t old_mask_;
+};
+
 }  // namespace
 
-SandboxResult run(const SandboxConfig& config) {
-  namespace logging = boost::log;
-  logging::add_file_log(
-      boost::log::keywords::file_name = config.log_path,
-      boost::log::keywords::target_file_name = config.log_path,
-      boost::log::keywords::format = "[%TimeStamp%][%Severity%] %Message%",
-      boost::log::keywords::auto_flush = true);
-  logging::add_common_attributes();
-  BOOST_LOG_TRIVIAL(info) << "Runner start to run.";
+SandboxResult run(const SandboxConfig& config, const int stdio[3]) {
+  LOG(debug, "Run started", "exe", config.exe_path);
 
   SandboxResult result{};
+  // Ours to close, as soon as the child has them.
+  struct Given {
+    int fds[3];
+    ~Given() {
+      for (auto& fd : fds) close_fd(fd);
+    }
+  } given{{stdio[0], stdio[1], stdio[2]}};
 
   // uid_t uid{getuid()};
   // if (uid != 0L) {
@@ -80,183 +510,588 @@ SandboxResult run(const SandboxConfig& config) {
       (config.max_memory < 1 && config.max_memory != UNLIMITED) ||
       (config.max_process_number < 1 &&
        config.max_process_number != UNLIMITED) ||
-      (config.max_output_size < 1 && config.max_output_size != UNLIMITED)) {
-    error_exit(ErrorType::INVALID_CONFIG);
+      (config.max_output_size < 1 && config.max_output_size != UNLIMITED) ||
+      (config.output_keep < 1 && config.output_keep != UNLIMITED) ||
+      (config.max_instructions < 1 && config.max_instructions != UNLIMITED) ||
+      !has_policy(config.policy) || !Checker::valid_mode(config.check_mode) ||
+      config.check_epsilon < 0 ||
+      // The checker reads what the program writes to its stdout.
+      (!config.answer_path.empty() &&
+       (config.debug_mode || !config.output_path.empty()))) {
+    return error_result(ErrorType::INVALID_CONFIG);
+  }
+
+  Checker checker;
+  if (!config.answer_path.empty() &&
+      !checker.open(config.answer_path, config.check_mode,
+                    config.check_epsilon)) {
+    return error_result(ErrorType::SPJ_ERROR);
+  }
+
+  // A no-op after the first run of a policy in this process. If it fails the
+  // child compiles the filter itself.
+  prepare_seccomp(config);
+
+  // Likewise a no-op after the first run, unless the uid or gid change.
+  if (config.namespaces && !prepare_namespaces(config)) {
+    return error_result(ErrorType::NAMESPACE_FAILED);
   }
 
   // Try to pipe io of child process to
-  int stdin_pipe[2];
-  int stdout_pipe[2];
-  int stderr_pipe[2];
-  if (!config.debug_mode) {
-    if (pipe(stdin_pipe) < 0 || pipe(stdout_pipe) < 0 ||
-        pipe(stderr_pipe) < 0) {
-      error_exit(ErrorType::DUP2_FAILED);
+  int stdin_pipe[2]{-1, -1};
+  int stdout_pipe[2]{-1, -1};
+  int stderr_pipe[2]{-1, -1};
+  // In memfd-io mode the child's stdio are memfds instead.
+  int memfds[3]{-1, -1, -1};
+  // With perf events the child waits for EOF on this pipe before the exec,
+  // until they are attached.
+  int start_pipe[2]{-1, -1};
+  auto close_pipes{[&]() {
+    for (auto p : {stdin_pipe, stdout_pipe, stderr_pipe, start_pipe}) {
+      close_fd(p[0]);
+      close_fd(p[1]);
+    }
+    for (auto& fd : memfds) close_fd(fd);
+  }};
+  bool forward{!config.debug_mode && !config.memfd_io};
+  if (forward) {
+    // O_CLOEXEC: do not leak these into children of other jobs.
+    if ((given.fds[0] == -1 && pipe2(stdin_pipe, O_CLOEXEC) < 0) ||
+        (given.fds[1] == -1 && pipe2(stdout_pipe, O_CLOEXEC) < 0) ||
+        (given.fds[2] == -1 && pipe2(stderr_pipe, O_CLOEXEC) < 0)) {
+      close_pipes();
+      return error_result(ErrorType::DUP2_FAILED);
     }
   }
+  if (config.memfd_io && !config.debug_mode) {
+    if (given.fds[0] == -1) memfds[0] = input_memfd();
+    if (given.fds[1] == -1) {
+      memfds[1] = memfd_create("stdout", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    }
+    if (given.fds[2] == -1) {
+      memfds[2] = memfd_create("stderr", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    }
+    for (int i{0}; i < 3; i++) {
+      if (given.fds[i] == -1 && memfds[i] == -1) {
+        close_pipes();
+        return error_result(ErrorType::DUP2_FAILED);
+      }
+    }
+  }
+  bool attach_perf{config.perf_counters ||
+                   config.max_instructions != UNLIMITED};
+  if (attach_perf && pipe2(start_pipe, O_CLOEXEC) < 0) {
+    close_pipes();
+    return error_result(ErrorType::DUP2_FAILED);
+  }
+  // Files the child gets as stdin, stdout and stderr; -1 keeps ours.
+  int child_stdio[3]{
+      forward ? stdin_pipe[0] : memfds[0],
+      forward ? stdout_pipe[1] : memfds[1],
+      forward ? stderr_pipe[1] : memfds[2],
+  };
+  for (int i{0}; i < 3; i++) {
+    if (given.fds[i] != -1) child_stdio[i] = given.fds[i];
+  }
 
-  timeval start, end;
-  gettimeofday(&start, nullptr);
+  Cgroup* cgroup{config.cgroup_root.empty()
+                     ? nullptr
+                     : process_cgroup(config.cgroup_root)};
+  if (cgroup && !cgroup->prepare(config)) {
+    LOG(warning, "Cannot set cgroup limits, using rlimits");
+    cgroup = nullptr;
+  }
+  // Monotonic, unlike gettimeofday(): a clock step must not judge a run.
+  auto start_us{now_us(CLOCK_MONOTONIC)};
+  long end_us{-1};
 
-  pid_t child_pid{fork()};
+  begin_launch();
+  pid_t child_pid{launch_zygote(config, cgroup, child_stdio,
+                                       start_pipe[0])};
+  if (child_pid == -1) {
+    if (config.namespaces && !select_pid_namespace(true)) {
+      close_pipes();
+      return error_result(ErrorType::NAMESPACE_FAILED);
+    }
+    child_pid = fork();
+    // Nothing else we fork, checkers included, belongs in the template.
+    if (config.namespaces && child_pid != 0) select_pid_namespace(false);
+  }
   if (child_pid < 0) {
-    error_exit(ErrorType::FORK_FAILED);
+    close_pipes();
+    return error_result(ErrorType::FORK_FAILED);
   }
   if (child_pid == 0) {
     // child process
-    if (!config.debug_mode) {
-      close(stdin_pipe[1]);
-      close(stdout_pipe[0]);
-      close(stderr_pipe[0]);
-      if (dup2(stdin_pipe[0], STDIN_FILENO) < 0 ||
-          dup2(stdout_pipe[1], STDOUT_FILENO) < 0 ||
-          dup2(stderr_pipe[1], STDERR_FILENO) < 0) {
+
+    // An earlier run or a session helper may have left these ignored, and
+    // ignored signals stay ignored across execve().
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGXFSZ, SIG_DFL);
+    for (int i{0}; i < 3; i++) {
+      if (child_stdio[i] != -1 && dup2(child_stdio[i], i) < 0) {
         error_exit(ErrorType::DUP2_FAILED);
       }
-      close(stdin_pipe[0]);
-      close(stdout_pipe[1]);
-      close(stderr_pipe[1]);
     }
+    close_fd(start_pipe[1]);
 
-    child(config);
-  } else {
-    // parent process
-
-    // Ignore Ctrl+C signal. Only child process will receive it.
-    struct sigaction sa;
-    sa.sa_handler = SIG_IGN;
-    sigaction(SIGINT, &sa, nullptr);
-
-    // prepare for forwarding child process's io
-    if (!config.debug_mode) {
-      close(stdin_pipe[0]);
-      close(stdout_pipe[1]);
-      close(stderr_pipe[1]);
-      fcntl(STDIN_FILENO, F_SETFL,
-            fcntl(STDIN_FILENO, F_GETFL, 0) | O_NONBLOCK);
-    }
-
-    if (config.max_real_time != UNLIMITED) {
-      std::thread killer([&]() {
-        sleep((config.max_real_time + 1000) / 1000);
-        kill(child_pid, SIGKILL);
-      });
-      killer.detach();
-    }
-
-    int status;
-    int retval;
-    rusage resource_usage;
-
-    std::thread read_stdout, read_stderr;
-    if (!config.debug_mode) {
-      read_stdout = std::thread([&]() {
-        int size;
-        char buf[256];
-        while ((size = read(stdout_pipe[0], buf, sizeof(buf)))) {
-          if (size == -1) {
-            if (errno != EINTR) {
-              kill(child_pid, SIGKILL);
-              error_exit(ErrorType::FORWARD_IO_FAILED);
-            }
-          } else {
-            write(STDOUT_FILENO, buf, size);
-          }
-        }
-        close(stdout_pipe[0]);
-      });
-      read_stderr = std::thread([&]() {
-        char size;
-        char buf[256];
-        while ((size = read(stderr_pipe[0], buf, sizeof(buf)))) {
-          if (size == -1) {
-            if (errno != EINTR) {
-              kill(child_pid, SIGKILL);
-              error_exit(ErrorType::FORWARD_IO_FAILED);
-            }
-          } else {
-            write(STDERR_FILENO, buf, size);
-          }
-        }
-        close(stderr_pipe[0]);
-      });
+    child(config, cgroup, start_pipe[0]);
+  }
+
+  // parent process
+  struct InFlight {
+    InFlight() {
+      add_children_in_flight(1);
+    }
+    ~InFlight() {
+      add_children_in_flight(-1);
     }
+  } in_flight;
 
-    const int WAIT_OPT = config.debug_mode ? WSTOPPED : WNOHANG | WSTOPPED;
+  // Ignore Ctrl+C signal. Only child process will receive it.
+  struct sigaction sa {};
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGINT, &sa, nullptr);
+  // A child that stops reading its stdin must not kill us.
+  sigaction(SIGPIPE, &sa, nullptr);
 
-    while ((retval = wait4(child_pid, &status, WAIT_OPT, &resource_usage)) !=
-           child_pid) {
-      if (retval == -1) {
-        kill(child_pid, SIGKILL);
-        error_exit(ErrorType::WAIT_FAILED);
-      }
+  close_fd(stdin_pipe[0]);
+  close_fd(stdout_pipe[1]);
+  close_fd(stderr_pipe[1]);
+  close_fd(memfds[0]);
+  // E.g. a pipe to another program only reaches EOF once we let go of it.
+  for (auto& fd : given.fds) close_fd(fd);
 
-      // Forward child process io
-      if (!config.debug_mode) {
-        int size;
-        char buf[256];
-        if ((size = read(STDIN_FILENO, buf, sizeof(buf))) == -1) {
-          if (errno != EAGAIN && errno != EINTR) {
-            kill(child_pid, SIGKILL);
-            error_exit(ErrorType::FORWARD_IO_FAILED);
-          }
-        } else if (size == 0) {
-          // EOF
-          close(stdin_pipe[1]);
-        } else {
-          write(stdin_pipe[1], buf, size);
-        }
-      }
+  PerfCounters perf;
+  InstructionLimit instruction_limit;
+  if (attach_perf) {
+    if (config.perf_counters && !perf.attach(child_pid)) {
+      LOG(warning, "No perf counters for the child");
     }
-    if (read_stdout.joinable()) read_stdout.join();
-    if (read_stderr.joinable()) read_stderr.join();
+    // Without the budget the run cannot be judged as asked.
+    if (config.max_instructions != UNLIMITED &&
+        !instruction_limit.attach(child_pid, config.max_instructions)) {
+      kill(child_pid, SIGKILL);
+      waitpid(child_pid, nullptr, 0);
+      close_pipes();
+      return error_result(ErrorType::PERF_FAILED);
+    }
+    close_fd(start_pipe[0]);
+    close_fd(start_pipe[1]);
+  }
+
+  // Everything the parent waits for -- the child's exit, the real time limit
+  // and the io to forward -- is a file descriptor on one epoll instance, so
+  // the parent sleeps until there is something to do.
+  Poller poller;
+  int pidfd{pidfd_open(child_pid)};
+  int timerfd{-1};
+  int cpu_timerfd{-1};
+  auto cleanup{[&]() {
+    close_pipes();
+    close_fd(pidfd);
+    close_fd(timerfd);
+    close_fd(cpu_timerfd);
+  }};
+  if (!poller.ok() || pidfd == -1 || !poller.watch(pidfd, EPOLLIN)) {
+    LOG(error, "Cannot watch child", "error", strerror(errno));
+    kill(child_pid, SIGKILL);
+    waitpid(child_pid, nullptr, 0);
+    cleanup();
+    return error_result(ErrorType::WAIT_FAILED);
+  }
 
-    gettimeofday(&end, nullptr);
+  // A stopped program would hold the run until its real time limit, or for
+  // ever; it is killed and reported with the signal that stopped it.
+  StopWatch stop_watch;
+  int stop_signal{0};
+  auto check_stopped{[&]() {
+    stop_signal = stop_watch.stopped(child_pid);
+    if (stop_signal == 0) return;
+    LOG(info, "Child stopped", "signal", stop_signal);
+    pidfd_kill(pidfd);
+    poller.unwatch(stop_watch.fd());
+  }};
+  if (stop_watch.fd() == -1 || !poller.watch(stop_watch.fd(), EPOLLIN)) {
+    pidfd_kill(pidfd);
+    waitpid(child_pid, nullptr, 0);
+    cleanup();
+    return error_result(ErrorType::WAIT_FAILED);
+  }
+  check_stopped();
 
-    result.real_time = static_cast<int>((end.tv_sec - start.tv_sec) * 1000 +
-                                        (end.tv_usec - start.tv_usec) / 1000);
+  if (config.max_real_time != UNLIMITED) {
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timerfd == -1 || !arm(timerfd, config.max_real_time * 1000L) ||
+        !poller.watch(timerfd, EPOLLIN)) {
+      pidfd_kill(pidfd);
+      waitpid(child_pid, nullptr, 0);
+      cleanup();
+      return error_result(ErrorType::WAIT_FAILED);
+    }
+  }
 
-    if (WIFSIGNALED(status) != 0) {
-      result.signal = WTERMSIG(status);
+  // The CPU time limit is checked on the child's CPU clock whenever it could
+  // have run out; RLIMIT_CPU in the child only has whole seconds.
+  clockid_t cpu_clock;
+  long max_cpu_time_us{config.max_cpu_time * 1000L};
+  if (config.max_cpu_time != UNLIMITED) {
+    if (clock_getcpuclockid(child_pid, &cpu_clock) == 0) {
+      cpu_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    }
+    if (cpu_timerfd == -1 || !arm(cpu_timerfd, max_cpu_time_us) ||
+        !poller.watch(cpu_timerfd, EPOLLIN)) {
+      LOG(warning, "No CPU timer, relying on RLIMIT_CPU");
+      close_fd(cpu_timerfd);
+    }
+  }
+  if (instruction_limit.fd() != -1 &&
+      !poller.watch(instruction_limit.fd(), EPOLLIN)) {
+    pidfd_kill(pidfd);
+    waitpid(child_pid, nullptr, 0);
+    cleanup();
+    return error_result(ErrorType::PERF_FAILED);
+  }
+  bool real_killed{false};
+  bool cpu_killed{false};
+  bool instructions_killed{false};
+  auto check_cpu_time{[&]() {
+    timespec ts{};
+    if (clock_gettime(cpu_clock, &ts) == -1) {
+      poller.unwatch(cpu_timerfd);
+      return;
+    }
+    auto used{ts.tv_sec * 1000000L + ts.tv_nsec / 1000};
+    auto left{max_cpu_time_us - used};
+    if (left <= 0) {
+      cpu_killed = true;
+      pidfd_kill(pidfd);
+      poller.unwatch(cpu_timerfd);
+      return;
     }
+    // Look again when the budget could be gone at the rate the child has
+    // burnt CPU so far, which is above one core if it has threads.
+    auto elapsed{std::max(now_us(CLOCK_MONOTONIC) - start_us, 1L)};
+    auto rate{std::max(static_cast<double>(used) / elapsed, 1.0)};
+    arm(cpu_timerfd, static_cast<long>(left / rate));
+  }};
+
+  // prepare for forwarding child process's io
+  InputBuffer input{};
+  bool splice_input{true};
+  OutputStream stdout_stream{STDOUT_FILENO, config.max_output_size,
+                             config.output_keep};
+  OutputStream stderr_stream{STDERR_FILENO, config.max_output_size,
+                             config.output_keep};
+  // Set when the child's stdin pipe is full.
+  bool input_blocked{false};
+  // Whether our stdin can be polled. Regular files and /dev/null cannot, but
+  // reading them never blocks either.
+  bool stdin_pollable{true};
+  bool stdin_eof{stdin_pipe[1] == -1};
+  for (auto fd : {stdin_pipe[1], stdout_pipe[0], stderr_pipe[0]}) {
+    if (fd == -1) continue;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // May fail above /proc/sys/fs/pipe-max-size; the default size works.
+    fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+  }
+  for (auto fd : {stdout_pipe[0], stderr_pipe[0]}) {
+    if (fd != -1) poller.watch(fd, EPOLLIN);
+  }
+  if (!stdin_eof) stdin_pollable = poller.watch(STDIN_FILENO, EPOLLIN);
 
-    if (result.signal == SIGUSR1) {
-      result.result = ResultType::SYSTEM_ERROR;
+  ErrorType error{ErrorType::SUCCESS};
+  // Set when the program was killed for its output: a wrong one, or too much
+  // of it.
+  bool output_rejected{false};
+  bool output_exceeded{false};
+  bool exited{false};
+  int status{0};
+  rusage resource_usage{};
+
+  auto output{[&](int& fd, OutputStream& stream) {
+    auto state{fd == stdout_pipe[0] && checker.active()
+                   ? check_output(fd, checker)
+                   : stream.forward(fd)};
+    if (state == Forward::OPEN) return;
+    if (state == Forward::FAILED) {
+      error = ErrorType::FORWARD_IO_FAILED;
+      pidfd_kill(pidfd);
+    } else if (state == Forward::MISMATCH) {
+      // Nothing it writes from now on can make it right.
+      output_rejected = true;
+      pidfd_kill(pidfd);
+    } else if (state == Forward::LIMIT) {
+      output_exceeded = true;
+      pidfd_kill(pidfd);
+    }
+    poller.unwatch(fd);
+    close_fd(fd);
+  }};
+  auto end_input{[&]() {
+    stdin_eof = true;
+    input.begin = input.end = 0;
+    poller.unwatch(STDIN_FILENO);
+    poller.unwatch(stdin_pipe[1]);
+    close_fd(stdin_pipe[1]);
+  }};
+  auto read_input{[&]() {
+    if (splice_input) {
+      auto n{splice(STDIN_FILENO, nullptr, stdin_pipe[1], nullptr, PIPE_SIZE,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK)};
+      if (n > 0) {
+        record_forwarded(STDIN_FILENO, n);
+        return;
+      }
+      if (n == 0) {
+        // EOF
+        end_input();
+        return;
+      }
+      if (errno == EINTR) return;
+      if (errno == EAGAIN) {
+        // Most likely the pipe is full; otherwise this costs one extra wakeup.
+        input_blocked = true;
+        return;
+      }
+      if (errno == EPIPE) {
+        end_input();
+        return;
+      }
+      // EINVAL: our stdin cannot be spliced. Fall back to copying.
+      splice_input = false;
+    }
+    auto n{read(STDIN_FILENO, input.data, sizeof(input.data))};
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR) return;
+      error = ErrorType::FORWARD_IO_FAILED;
+      pidfd_kill(pidfd);
+      end_input();
+    } else if (n == 0) {
+      // EOF
+      end_input();
     } else {
-      result.exit_code = WEXITSTATUS(status);
-      result.cpu_time =
-          static_cast<int>(resource_usage.ru_utime.tv_sec * 1000 +
-                           resource_usage.ru_utime.tv_usec / 1000);
-      result.memory = resource_usage.ru_maxrss * 1024;
-      // if (result.exit_code) {
-      //   result.result = ResultType::RUNTIME_ERROR;
-      // }
-      if (result.signal == SIGSEGV) {
-        if (config.max_memory != UNLIMITED &&
-            result.memory > config.max_memory) {
-          result.result = ResultType::MEMORY_LIMIT_EXCEEDED;
-        } else {
-          result.result = ResultType::RUNTIME_ERROR;
-        }
+      input.begin = 0;
+      input.end = n;
+    }
+  }};
+  auto write_input{[&]() {
+    auto n{write(stdin_pipe[1], input.data + input.begin,
+                 input.end - input.begin)};
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR) return;
+      // EPIPE: the child closed its stdin. Drop the rest of the input.
+      end_input();
+    } else {
+      record_forwarded(STDIN_FILENO, n);
+      input.begin += n;
+      if (input.begin == input.end) input.begin = input.end = 0;
+    }
+  }};
+
+  epoll_event events[8];
+  while (!exited) {
+    // Read input only when the last chunk is gone, so that a child which
+    // does not read its stdin holds back the producer.
+    if (!stdin_eof && input.begin == input.end && !input_blocked &&
+        !stdin_pollable) {
+      read_input();
+    }
+    if (!stdin_eof) {
+      if (input.begin != input.end || input_blocked) {
+        poller.unwatch(STDIN_FILENO);
+        poller.watch(stdin_pipe[1], EPOLLOUT);
       } else {
-        if (result.signal != 0) {
-          result.result = ResultType::RUNTIME_ERROR;
-        }
-        if (config.max_memory != UNLIMITED &&
-            result.memory > config.max_memory) {
-          result.result = ResultType::MEMORY_LIMIT_EXCEEDED;
+        if (stdin_pollable) poller.watch(STDIN_FILENO, EPOLLIN);
+        // Still watched for EPOLLERR, i.e. the child closed its stdin. An
+        // unpollable stdin is read again once the pipe has room.
+        poller.watch(stdin_pipe[1], stdin_pollable ? 0u : EPOLLOUT);
+      }
+    }
+
+    int n{poller.wait(events, std::size(events), -1)};
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      error = ErrorType::WAIT_FAILED;
+      pidfd_kill(pidfd);
+      waitpid(child_pid, nullptr, 0);
+      break;
+    }
+    for (int i{0}; i < n; i++) {
+      int fd{events[i].data.fd};
+      if (fd == pidfd) {
+        end_us = now_us(CLOCK_MONOTONIC);
+        // The child is a zombie now, so this does not block.
+        if (wait4(child_pid, &status, 0, &resource_usage) == child_pid) {
+          exited = true;
+        } else if (errno != EINTR) {
+          error = ErrorType::WAIT_FAILED;
+          exited = true;
         }
-        if (config.max_real_time != UNLIMITED &&
-            result.real_time > config.max_real_time) {
-          result.result = ResultType::REAL_TIME_LIMIT_EXCEEDED;
+      } else if (fd == timerfd && !exited) {
+        real_killed = true;
+        pidfd_kill(pidfd);
+        poller.unwatch(timerfd);
+      } else if (fd == cpu_timerfd && !exited) {
+        check_cpu_time();
+      } else if (fd == stop_watch.fd()) {
+        if (exited) {
+          poller.unwatch(fd);
+        } else {
+          check_stopped();
         }
-        if (config.max_cpu_time != UNLIMITED &&
-            result.cpu_time > config.max_cpu_time) {
-          result.result = ResultType::CPU_TIME_LIMIT_EXCEEDED;
+      } else if (fd == instruction_limit.fd() && !exited) {
+        instructions_killed = true;
+        pidfd_kill(pidfd);
+        poller.unwatch(fd);
+      } else if (fd == stdout_pipe[0]) {
+        output(stdout_pipe[0], stdout_stream);
+      } else if (fd == stderr_pipe[0]) {
+        output(stderr_pipe[0], stderr_stream);
+      } else if (fd == STDIN_FILENO) {
+        read_input();
+      } else if (fd == stdin_pipe[1]) {
+        if (events[i].events & EPOLLERR) {
+          end_input();
+        } else if (input.begin != input.end) {
+          write_input();
+        } else {
+          input_blocked = false;
         }
       }
     }
   }
-  BOOST_LOG_TRIVIAL(info) << result;
+
+  // Nobody can write to the pipes any more; collect what is left in them.
+  if (stdout_pipe[0] != -1) {
+    if (checker.active()) {
+      check_output(stdout_pipe[0], checker);
+    } else if (stdout_stream.forward(stdout_pipe[0]) == Forward::LIMIT) {
+      output_exceeded = true;
+    }
+  }
+  if (stderr_pipe[0] != -1 &&
+      stderr_stream.forward(stderr_pipe[0]) == Forward::LIMIT) {
+    output_exceeded = true;
+  }
+  stdout_stream.finish();
+  stderr_stream.finish();
+  if (stdin_pollable) poller.unwatch(STDIN_FILENO);
+  if (memfds[1] != -1 && error == ErrorType::SUCCESS) {
+    if (checker.active()) {
+      checker.feed_file(memfds[1]);
+    } else {
+      output_memfd(memfds[1], STDOUT_FILENO, config.max_output_size,
+                   config.output_keep);
+    }
+  }
+  if (memfds[2] != -1 && error == ErrorType::SUCCESS) {
+    output_memfd(memfds[2], STDERR_FILENO, config.max_output_size,
+                 config.output_keep);
+  }
+  cleanup();
+  record_launch(end_us);
+  CgroupUsage usage{-1, -1, false};
+  if (cgroup) usage = cgroup->finish();
+
+  if (error != ErrorType::SUCCESS) {
+    return error_result(error);
+  }
+
+  result.real_time_us = end_us - start_us;
+  result.real_time = static_cast<int>(result.real_time_us / 1000);
+  if (config.perf_counters) result.perf = perf.read();
+
+  if (WIFSIGNALED(status) != 0) {
+    result.signal = WTERMSIG(status);
+  }
+  // Killed by us, but what ended it is the stop.
+  if (stop_signal != 0) result.signal = stop_signal;
+
+  if (result.signal == SIGUSR1) {
+    result.result = ResultType::SYSTEM_ERROR;
+  } else {
+    result.exit_code = WEXITSTATUS(status);
+    // User and system time, as on the CPU clock the limit is checked on.
+    // The group also counts the program's own children.
+    result.cpu_time_us = usage.cpu_time_us != -1
+                             ? usage.cpu_time_us
+                             : resource_usage.ru_utime.tv_sec * 1000000L +
+                                   resource_usage.ru_utime.tv_usec +
+                                   resource_usage.ru_stime.tv_sec * 1000000L +
+                                   resource_usage.ru_stime.tv_usec;
+    result.cpu_time = static_cast<int>(result.cpu_time_us / 1000);
+    result.memory = usage.memory != -1 ? usage.memory
+                                       : resource_usage.ru_maxrss * 1024;
+    // if (result.exit_code) {
+    //   result.result = ResultType::RUNTIME_ERROR;
+    // }
+    if (result.signal == SIGSEGV) {
+      if (config.max_memory != UNLIMITED &&
+          result.memory > config.max_memory) {
+        result.result = ResultType::MEMORY_LIMIT_EXCEEDED;
+      } else {
+        result.result = ResultType::RUNTIME_ERROR;
+      }
+    } else {
+      if (result.signal != 0) {
+        result.result = ResultType::RUNTIME_ERROR;
+      }
+      if (config.max_memory != UNLIMITED &&
+          result.memory > config.max_memory) {
+        result.result = ResultType::MEMORY_LIMIT_EXCEEDED;
+      }
+      if (config.max_real_time != UNLIMITED &&
+          result.real_time_us > config.max_real_time * 1000L) {
+        result.result = ResultType::REAL_TIME_LIMIT_EXCEEDED;
+      }
+      if (config.max_cpu_time != UNLIMITED &&
+          result.cpu_time_us > max_cpu_time_us) {
+        result.result = ResultType::CPU_TIME_LIMIT_EXCEEDED;
+      }
+    }
+    // Killed by one of our timers, whatever the measured times round to.
+    if (cpu_killed) {
+      result.result = ResultType::CPU_TIME_LIMIT_EXCEEDED;
+    } else if (real_killed) {
+      result.result = ResultType::REAL_TIME_LIMIT_EXCEEDED;
+    }
+    // Unless a timer was first, the instruction count decides.
+    if (config.max_instructions != UNLIMITED && !cpu_killed && !real_killed &&
+        (instructions_killed ||
+         instruction_limit.count() > config.max_instructions)) {
+      result.result = ResultType::INSTRUCTION_LIMIT_EXCEEDED;
+    }
+    // Killed by us for its output, or complete but wrong.
+    if (checker.active() && !cpu_killed && !real_killed &&
+        !instructions_killed &&
+        (output_rejected ||
+         (result.result == ResultType::SUCCESS && !checker.finish()))) {
+      result.result = ResultType::WRONG_ANSWER;
+    }
+    // Killed for writing more than max_output_size: by us for its stdout or
+    // stderr, or by the kernel (SIGXFSZ) for a file, memfds included.
+    if ((output_exceeded || result.signal == SIGXFSZ) && !cpu_killed &&
+        !real_killed && !instructions_killed) {
+      result.result = ResultType::OUTPUT_LIMIT_EXCEEDED;
+    }
+    // Killed by the OOM killer of its group: no guessing needed.
+    if (usage.oom_killed) {
+      result.result = ResultType::MEMORY_LIMIT_EXCEEDED;
+    }
+  }
+  LOG(info, "Run finished", "result", static_cast<int>(result.result),
+      "cpu_time_us", result.cpu_time_us, "real_time_us", result.real_time_us,
+      "memory", result.memory, "signal", result.signal, "exit_code",
+      result.exit_code);
+  return result;
+}
+
+SandboxResult run(const SandboxConfig& config) {
+  const int stdio[3]{-1, -1, -1};
+  auto result{config.checker_path.empty() ? run(config, stdio)
+                                          : judge(config)};
+  record_result(result);
   return result;
 }
@@ -27,8 +27,17 @@ struct SandboxConfig {
   long max_stack;
   int max_process_number;
   long max_output_size;
+  // Pass on only the first and the last output_keep bytes of stdout and of
+  // stderr, leaving out the middle.
+  long output_keep;
+  // Instructions the program may retire in user mode, a CPU time limit that
+  // does not depend on the load of the host. Needs a PMU.
+  long max_instructions;
   // int memory_limit_check_only;
   bool debug_mode;
+  // Give the child memfds as stdio instead of pipes: stdin is read in full
+  // before the run, stdout and stderr are written out after it.
+  bool memfd_io;
   std::string exe_path;
   std::string input_path;
   std::string output_path;
@@ -37,7 +46,38 @@ struct SandboxConfig {
   std::vector<std::string> env;
   std::string log_path;
   std::string result_path;
-  // std::string seccomp_rule_name;
+  // Write the result to this inherited fd instead of result_path, e.g. a
+  // pipe or socket from the caller. -1 if unused.
+  int result_fd;
+  // Name of the seccomp policy profile, see seccomp_filter.h.
+  std::string policy;
+  // Delegated cgroup v2 directory to run programs in a group below; empty to
+  // limit them with rlimits only.
+  std::string cgroup_root;
+  // Directory keeping compiled seccomp programs across processes; empty to
+  // keep them in memory only.
+  std::string seccomp_cache;
+  // Isolate the program in namespaces (see namespaces.h), with a tmpfs of
+  // tmpfs_size bytes on /tmp.
+  bool namespaces;
+  long tmpfs_size;
+  // Count instructions, cycles, context switches and page faults of the
+  // program with perf_event.
+  bool perf_counters;
+  // Compare stdout of the program with this file instead of passing it on;
+  // empty to pass it on. See checker.h for the modes.
+  std::string answer_path;
+  std::string check_mode;
+  double check_epsilon;
+  // A program that judges the output instead, given answer_path; or with
+  // `interactive`, one that talks to the program while it runs. It has
+  // limits and a seccomp policy of its own. See judge.h.
+  std::string checker_path;
+  bool interactive;
+  int checker_max_cpu_time;
+  int checker_max_real_time;
+  long checker_max_memory;
+  std::string checker_policy;
   uid_t uid;
   gid_t gid;
 };
@@ -57,21 +97,30 @@ enum class ErrorType {
   DUP2_FAILED,
   SETUID_FAILED,
   EXECVE_FAILED,
-  SPJ_ERROR
+  SPJ_ERROR,
+  WORKER_FAILED,
+  CGROUP_FAILED,
+  PERF_FAILED,
+  NAMESPACE_FAILED
 };
 
-constexpr const char* error_msg[12]{"success",
+constexpr const char* error_msg[17]{"success",
                                     "invalid config",
                                     "fork failed",
                                     "pthread failed",
                                     "wait failed",
+                                    "forward io failed",
                                     "root required",
                                     "load seccomp failed",
                                     "setrlimit failed",
                                     "dup2 failed",
                                     "setuid failed",
                                     "execve failed",
-                                    "spj error"};
+                                    "spj error",
+                                    "worker failed",
+                                    "cgroup failed",
+                                    "perf event failed",
+                                    "namespace failed"};
 
 enum class ResultType {
   SUCCESS,
@@ -79,19 +128,52 @@ enum class ResultType {
   REAL_TIME_LIMIT_EXCEEDED,
   MEMORY_LIMIT_EXCEEDED,
   RUNTIME_ERROR,
-  SYSTEM_ERROR
+  SYSTEM_ERROR,
+  // The run succeeded but its output differs from the answer (batch mode or
+  // answer_path). A program may be killed for it before it ends.
+  WRONG_ANSWER,
+  // The program retired more than max_instructions instructions.
+  INSTRUCTION_LIMIT_EXCEEDED,
+  // The checker accepts the output but for its format.
+  PRESENTATION_ERROR,
+  // The program wrote more than max_output_size bytes to its stdout, its
+  // stderr or a file.
+  OUTPUT_LIMIT_EXCEEDED
+};
+
+// perf_event counts of a run, -1 where the kernel cannot count (e.g. hardware
+// events without a PMU). `enabled` is false unless the run asked for them.
+struct PerfCounts {
+  bool enabled;
+  long instructions;
+  long cycles;
+  long context_switches;
+  long page_faults;
+  long major_faults;
 };
 
 struct SandboxResult {
+  // Milliseconds, and the same in microseconds.
   int cpu_time;
   int real_time;
+  long cpu_time_us;
+  long real_time_us;
   long memory;
   int signal;
   int exit_code;
   ErrorType error;
   ResultType result;
+  PerfCounts perf;
 };
 
 std::ostream& operator<<(std::ostream& os, const SandboxResult& result);
 
+// Run one job. Errors of the sandbox itself are reported through
+// `SandboxResult::error` instead of terminating the process, so that a
+// long-lived caller can keep serving.
 SandboxResult run(const SandboxConfig& config);
+
+// Run one program, ignoring its checker. Where `stdio[i]` is not -1 the
+// child gets it as fd i, instead of a pipe from or to ours or a memfd. These
+// are closed in any case, once the child has them.
+SandboxResult run(const SandboxConfig& config, const int stdio[3]);
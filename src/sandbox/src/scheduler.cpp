@@ -0,0 +1,291 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "scheduler.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "log.h"
+#include "zygote.h"
+
+namespace {
+
+// Upper bound of a job or a reply in one message.
+constexpr const std::size_t MAX_MESSAGE{1 << 16};
+
+std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int i{0}; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &set)) cpus.push_back(i);
+    }
+  }
+  if (cpus.empty()) cpus.push_back(0);
+  return cpus;
+}
+
+std::uint64_t to_ms(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+}
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& os, const SchedulerStats& stats) {
+  os << "{\n  \"workers\": " << stats.workers
+     << ",\n  \"running\": " << stats.running
+     << ",\n  \"queued\": " << stats.queued
+     << ",\n  \"max_queued\": " << stats.max_queued
+     << ",\n  \"completed\": " << stats.completed
+     << ",\n  \"crashed\": " << stats.crashed
+     << ",\n  \"uptime_ms\": " << stats.uptime_ms << ",\n  \"busy_ms\": [";
+  for (std::size_t i{0}; i < stats.busy_ms.size(); i++) {
+    os << (i ? ", " : "") << stats.busy_ms[i];
+  }
+  os << "],\n  \"utilisation\": " << stats.utilisation << "\n}";
+  return os;
+}
+
+Scheduler::Scheduler(Handler handler, unsigned workers, std::size_t queue_size,
+                     bool pin)
+    : handler_{std::move(handler)},
+      pin_{pin},
+      queue_size_{queue_size},
+      start_{Clock::now()} {
+  auto cpus{allowed_cpus()};
+  if (workers == 0) workers = cpus.size();
+  workers_.resize(workers);
+  for (unsigned i{0}; i < workers; i++) {
+    workers_[i].cpu = cpus[i % cpus.size()];
+    spawn(workers_[i]);
+  }
+  LOG(info, "Scheduler started", "workers", workers, "pinned", pin);
+}
+
+Scheduler::~Scheduler() {
+  for (auto& w : workers_) {
+    if (w.fd != -1) close(w.fd);
+    if (w.pid > 0) {
+      kill(w.pid, SIGKILL);
+      waitpid(w.pid, nullptr, 0);
+    }
+  }
+}
+
+void Scheduler::spawn(Worker& worker) {
+  int sv[2];
+  worker.pid = -1;
+  worker.busy = false;
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+    LOG(error, "socketpair failed", "error", strerror(errno));
+    return;
+  }
+  pid_t pid{fork()};
+  if (pid == -1) {
+    LOG(error, "fork worker failed", "error", strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return;
+  }
+  if (pid == 0) {
+    close(sv[0]);
+    for (auto& w : workers_) {
+      if (w.fd != -1) close(w.fd);
+    }
+    // Do not outlive the daemon.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (pin_) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(worker.cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        LOG(warning, "Failed to pin worker", "cpu", worker.cpu, "error",
+            strerror(errno));
+      }
+    }
+    work(sv[1]);
+  }
+  close(sv[1]);
+  worker.pid = pid;
+  worker.fd = sv[0];
+}
+
+void Scheduler::restart(Worker& worker) {
+  close(worker.fd);
+  worker.fd = -1;
+  // A worker that refused a job may still be alive.
+  kill(worker.pid, SIGKILL);
+  waitpid(worker.pid, nullptr, 0);
+  spawn(worker);
+}
+
+void Scheduler::work(int fd) {
+  std::vector<char> buf(MAX_MESSAGE);
+  while (true) {
+    auto n{recv(fd, buf.data(), buf.size(), MSG_DONTWAIT)};
+    if (n == -1 && errno == EAGAIN) {
+      // Idle: park children for the next jobs, then wait for one. A job that
+      // is already waiting is run first, forking its child if need be.
+      refill_zygotes();
+      n = recv(fd, buf.data(), buf.size(), 0);
+    }
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) std::_Exit(0);
+    auto reply{handler_(std::string(buf.data(), n))};
+    reply.resize(std::min(reply.size(), MAX_MESSAGE));
+    if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) == -1) {
+      std::_Exit(1);
+    }
+  }
+}
+
+bool Scheduler::full() const {
+  return queued_ >= queue_size_;
+}
+
+bool Scheduler::idle() const {
+  return queued_ == 0 &&
+         std::none_of(workers_.begin(), workers_.end(),
+                      [](const Worker& w) { return w.busy; });
+}
+
+void Scheduler::submit(std::uint64_t client, std::uint64_t seq,
+                       std::string job) {
+  auto& queue{queues_[client]};
+  if (queue.empty()) round_robin_.push_back(client);
+  queue.push_back({client, seq, std::move(job)});
+  queued_++;
+  max_queued_ = std::max(max_queued_, queued_);
+}
+
+void Scheduler::cancel(std::uint64_t client) {
+  auto it{queues_.find(client)};
+  if (it == queues_.end()) return;
+  queued_ -= it->second.size();
+  queues_.erase(it);
+  round_robin_.remove(client);
+}
+
+std::vector<Scheduler::Completion> Scheduler::dispatch() {
+  std::vector<Completion> failed;
+  for (auto& w : workers_) {
+    while (!round_robin_.empty() && !w.busy && w.fd != -1) {
+      auto client{round_robin_.front()};
+      round_robin_.pop_front();
+      auto& queue{queues_[client]};
+      auto job{std::move(queue.front())};
+      queue.pop_front();
+      queued_--;
+      if (queue.empty()) {
+        queues_.erase(client);
+      } else {
+        round_robin_.push_back(client);
+      }
+      if (job.payload.size() > MAX_MESSAGE) {
+        LOG(error, "Job too large", "size", job.payload.size());
+        failed.push_back({job.client, job.seq, {}, false, true});
+        continue;
+      }
+      if (send(w.fd, job.payload.data(), job.payload.size(), MSG_NOSIGNAL) ==
+          -1) {
+        LOG(error, "Failed to hand job to worker", "pid", w.pid, "error",
+            strerror(errno));
+        failed.push_back({job.client, job.seq, {}, true, false});
+        crashed_++;
+        restart(w);
+        continue;
+      }
+      w.job = std::move(job);
+      w.busy = true;
+      w.since = Clock::now();
+    }
+  }
+  return failed;
+}
+
+void Scheduler::poll_fds(std::vector<pollfd>& fds) const {
+  for (auto& w : workers_) {
+    fds.push_back({w.fd, POLLIN, 0});
+  }
+}
+
+std::optional<Scheduler::Completion> Scheduler::collect(const pollfd& fd) {
+  auto w{std::find_if(workers_.begin(), workers_.end(),
+                      [&](const Worker& w) { return w.fd == fd.fd; })};
+  if (w == workers_.end() || !fd.revents) return std::nullopt;
+
+  std::vector<char> buf(MAX_MESSAGE);
+  auto n{recv(w->fd, buf.data(), buf.size(), MSG_DONTWAIT)};
+  if (n == -1 && (errno == EINTR || errno == EAGAIN)) return std::nullopt;
+
+  std::optional<Completion> completion;
+  if (w->busy) {
+    w->busy_time += Clock::now() - w->since;
+    w->busy = false;
+    completion = Completion{w->job.client, w->job.seq, {}, false, false};
+  }
+  if (n > 0) {
+    if (completion) {
+      completion->reply.assign(buf.data(), n);
+      completed_++;
+    }
+    return completion;
+  }
+
+  // The worker died, most likely while running a job.
+  LOG(error, "Worker died", "pid", w->pid);
+  crashed_++;
+  restart(*w);
+  if (completion) completion->crashed = true;
+  return completion;
+}
+
+SchedulerStats Scheduler::stats() const {
+  auto now{Clock::now()};
+  SchedulerStats stats{};
+  stats.workers = workers_.size();
+  stats.queued = queued_;
+  stats.max_queued = max_queued_;
+  stats.completed = completed_;
+  stats.crashed = crashed_;
+  stats.uptime_ms = to_ms(now - start_);
+  Clock::duration total{Clock::duration::zero()};
+  for (auto& w : workers_) {
+    auto busy{w.busy_time};
+    if (w.busy) {
+      stats.running++;
+      busy += now - w.since;
+    }
+    total += busy;
+    stats.busy_ms.push_back(to_ms(busy));
+  }
+  auto lifetime{(now - start_) * workers_.size()};
+  stats.utilisation =
+      lifetime.count() ? static_cast<double>(total.count()) / lifetime.count()
+                       : 0.0;
+  return stats;
+}
@@ -0,0 +1,133 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <poll.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct SchedulerStats {
+  unsigned workers;
+  unsigned running;
+  std::size_t queued;
+  std::size_t max_queued;
+  std::uint64_t completed;
+  std::uint64_t crashed;
+  std::uint64_t uptime_ms;
+  std::vector<std::uint64_t> busy_ms;
+  // Busy time of all workers over their total lifetime, in [0, 1].
+  double utilisation;
+};
+
+std::ostream& operator<<(std::ostream& os, const SchedulerStats& stats);
+
+// Runs jobs on a pool of worker processes, one per CPU by default. Workers
+// are processes rather than threads: run() forks, and forking while another
+// thread holds a logging lock would hang the child. A pinned worker also pins
+// every child it runs, so CPU time is measured on an otherwise idle core.
+//
+// Jobs are queued per client and admitted round-robin, and a worker runs one
+// job at a time, so a client flooding the queue cannot starve the others or
+// oversubscribe the cores.
+class Scheduler {
+ public:
+  // Turns a job into its reply. Called inside worker processes.
+  using Handler = std::function<std::string(const std::string&)>;
+
+  struct Completion {
+    std::uint64_t client;
+    std::uint64_t seq;
+    std::string reply;
+    // The worker died before replying, or could not be handed the job;
+    // `reply` is empty.
+    bool crashed;
+    // The job is larger than a worker accepts and was never run; `reply` is
+    // empty.
+    bool too_large;
+  };
+
+  // workers == 0 means one worker per CPU this process may run on.
+  Scheduler(Handler handler, unsigned workers, std::size_t queue_size,
+            bool pin);
+  ~Scheduler();
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  bool full() const;
+  // No job is queued or running.
+  bool idle() const;
+  void submit(std::uint64_t client, std::uint64_t seq, std::string job);
+  // Drop the queued jobs of a client. Jobs already running still complete.
+  void cancel(std::uint64_t client);
+  // Hand queued jobs to idle workers. Returns the jobs that failed to reach
+  // a worker, which are complete from then on.
+  std::vector<Completion> dispatch();
+
+  // Append the worker fds to a poll set, and handle one of them once ready.
+  void poll_fds(std::vector<pollfd>& fds) const;
+  std::optional<Completion> collect(const pollfd& fd);
+
+  SchedulerStats stats() const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Job {
+    std::uint64_t client;
+    std::uint64_t seq;
+    std::string payload;
+  };
+
+  struct Worker {
+    pid_t pid{-1};
+    int fd{-1};
+    int cpu{0};
+    bool busy{false};
+    Job job{};
+    Clock::time_point since{};
+    Clock::duration busy_time{Clock::duration::zero()};
+  };
+
+  void spawn(Worker& worker);
+  // Replace a worker that died or stopped answering.
+  void restart(Worker& worker);
+  [[noreturn]] void work(int fd);
+
+  Handler handler_;
+  bool pin_;
+  std::size_t queue_size_;
+  std::vector<Worker> workers_;
+  std::map<std::uint64_t, std::deque<Job>> queues_;
+  // Clients with queued jobs, in admission order.
+  std::list<std::uint64_t> round_robin_;
+  std::size_t queued_{0};
+  std::size_t max_queued_{0};
+  std::uint64_t completed_{0};
+  std::uint64_t crashed_{0};
+  Clock::time_point start_;
+};
@@ -0,0 +1,488 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "seccomp_filter.h"
+
+#include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <seccomp.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "log.h"
+
+namespace {
+
+struct Rule {
+  std::uint32_t action;
+  int syscall;
+  std::vector<scmp_arg_cmp> args;
+};
+
+struct Profile {
+  std::vector<Rule> rules;
+  // Added in debug mode only.
+  std::vector<Rule> debug_rules;
+};
+
+// The default profile, and the one of checkers. execve and tgkill are per-run rules added by the
+// sandbox itself.
+constexpr const char* BUILTIN_POLICIES{R"(
+[c_cpp]
+allow read fstat mmap mprotect munmap uname arch_prctl brk access exit_group
+allow close readlink sysinfo write writev lseek clock_gettime getpid gettid
+allow_debug set_tid_address set_robust_list prlimit64 getrandom newfstatat
+# allow std::abort
+allow rt_sigprocmask
+# no write file: O_WRONLY | O_RDWR
+allow open a1 & 3 == 0
+allow openat a2 & 3 == 0
+# isatty() of stdio on a terminal: TCGETS
+allow ioctl a1 == 0x5401
+
+[checker]
+include c_cpp
+# testlib opens the output of an interactor for writing
+allow open a1 & 3 == 1
+allow openat a2 & 3 == 1
+)"};
+
+std::map<std::string, Profile> profiles;
+
+bool parse_number(const std::string& token, scmp_datum_t& value) {
+  try {
+    std::size_t pos;
+    value = std::stoull(token, &pos, 0);
+    return pos == token.size();
+  } catch (const std::exception&) {
+    return false;
+  }
+}
+
+bool is_argument(const std::string& token) {
+  return token.size() == 2 && token[0] == 'a' && token[1] >= '0' &&
+         token[1] <= '5';
+}
+
+// Parse `a<N> <op> <value>` or `a<N> & <mask> == <value>` at `tokens[i]`.
+bool parse_condition(const std::vector<std::string>& tokens, std::size_t& i,
+                     scmp_arg_cmp& cmp) {
+  static const std::map<std::string, scmp_compare> ops{
+      {"==", SCMP_CMP_EQ}, {"!=", SCMP_CMP_NE}, {"<", SCMP_CMP_LT},
+      {"<=", SCMP_CMP_LE}, {">", SCMP_CMP_GT},  {">=", SCMP_CMP_GE}};
+  if (i + 3 > tokens.size() || !is_argument(tokens[i])) return false;
+  cmp = {static_cast<unsigned>(tokens[i][1] - '0'), SCMP_CMP_EQ, 0, 0};
+  auto& op{tokens[i + 1]};
+  if (op == "&") {
+    cmp.op = SCMP_CMP_MASKED_EQ;
+    if (i + 5 > tokens.size() || tokens[i + 3] != "==") return false;
+    i += 5;
+    return parse_number(tokens[i - 3], cmp.datum_a) &&
+           parse_number(tokens[i - 1], cmp.datum_b);
+  }
+  auto it{ops.find(op)};
+  if (it == ops.end()) return false;
+  cmp.op = it->second;
+  i += 3;
+  return parse_number(tokens[i - 1], cmp.datum_a);
+}
+
+// Parse profiles into `profiles`. A profile given again replaces the old one.
+bool parse_policies(std::istream& is, std::string& error) {
+  std::string line;
+  Profile* profile{nullptr};
+  for (int lineno{1}; std::getline(is, line); lineno++) {
+    auto fail{[&](const std::string& what) {
+      error = "line " + std::to_string(lineno) + ": " + what;
+      return false;
+    }};
+    if (auto hash{line.find('#')}; hash != std::string::npos) {
+      line.erase(hash);
+    }
+    std::istringstream iss(line);
+    std::string keyword;
+    if (!(iss >> keyword)) continue;
+
+    if (keyword.front() == '[') {
+      auto name{keyword.substr(1, keyword.size() - 2)};
+      if (keyword.back() != ']' || name.empty() ||
+          name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") !=
+              std::string::npos) {
+        return fail("bad profile name " + keyword);
+      }
+      profile = &(profiles[name] = Profile{});
+      continue;
+    }
+    if (!profile) return fail("rule outside of a profile");
+
+    if (keyword == "include") {
+      std::string name;
+      iss >> name;
+      auto it{profiles.find(name)};
+      if (it == profiles.end() || &it->second == profile) {
+        return fail("unknown profile " + name);
+      }
+      auto& other{it->second};
+      profile->rules.insert(profile->rules.end(), other.rules.begin(),
+                            other.rules.end());
+      profile->debug_rules.insert(profile->debug_rules.end(),
+                                  other.debug_rules.begin(),
+                                  other.debug_rules.end());
+      continue;
+    }
+
+    Rule rule{SCMP_ACT_ALLOW, 0, {}};
+    auto* rules{&profile->rules};
+    if (keyword == "allow_debug") {
+      rules = &profile->debug_rules;
+    } else if (keyword == "errno") {
+      std::string value;
+      scmp_datum_t err;
+      if (!(iss >> value) || !parse_number(value, err) || err > 0xffff) {
+        return fail("bad errno");
+      }
+      rule.action = SCMP_ACT_ERRNO(err);
+    } else if (keyword != "allow") {
+      return fail("unknown keyword " + keyword);
+    }
+
+    // Either a list of syscalls, or one syscall and its conditions.
+    std::vector<std::string> tokens;
+    for (std::string token; iss >> token;) {
+      if (token.back() == ',') token.pop_back();
+      if (!token.empty()) tokens.push_back(token);
+    }
+    std::size_t i{0};
+    std::vector<std::string> names;
+    for (; i < tokens.size() && !is_argument(tokens[i]); i++) {
+      names.push_back(tokens[i]);
+    }
+    while (i < tokens.size()) {
+      scmp_arg_cmp cmp;
+      if (!parse_condition(tokens, i, cmp)) return fail("bad condition");
+      rule.args.push_back(cmp);
+    }
+    if (names.empty()) return fail("no syscall");
+    if (!rule.args.empty() && names.size() != 1) {
+      return fail("conditions apply to one syscall only");
+    }
+    for (auto& name : names) {
+      rule.syscall = seccomp_syscall_resolve_name(name.c_str());
+      if (rule.syscall == __NR_SCMP_ERROR) {
+        return fail("unknown syscall " + name);
+      }
+      rules->push_back(rule);
+    }
+  }
+  return true;
+}
+
+void load_builtin() {
+  static bool loaded{false};
+  if (loaded) return;
+  loaded = true;
+  std::istringstream iss(BUILTIN_POLICIES);
+  std::string error;
+  parse_policies(iss, error);
+}
+
+const Profile* find_profile(const std::string& name) {
+  load_builtin();
+  auto it{profiles.find(name)};
+  return it == profiles.end() ? nullptr : &it->second;
+}
+
+// Rules that are the same for every run of a policy.
+std::vector<Rule> static_rules(const Profile& profile, bool debug_mode) {
+  auto rules{profile.rules};
+  if (debug_mode) {
+    rules.insert(rules.end(), profile.debug_rules.begin(),
+                 profile.debug_rules.end());
+  }
+  return rules;
+}
+
+std::string policy_name(const SandboxConfig& config) {
+  return config.debug_mode ? config.policy + "-debug" : config.policy;
+}
+
+using Context = std::unique_ptr<void, decltype(&seccomp_release)>;
+
+Context build(const std::vector<Rule>& rules) {
+  Context ctx{seccomp_init(SCMP_ACT_KILL), seccomp_release};
+  if (!ctx) return ctx;
+  for (auto& rule : rules) {
+    if (seccomp_rule_add_array(ctx.get(), rule.action, rule.syscall,
+                               rule.args.size(), rule.args.data()) != 0) {
+      ctx.reset();
+      break;
+    }
+  }
+  return ctx;
+}
+
+// Compile and load everything in the child, as before caching existed.
+ErrorType compile_and_load(const SandboxConfig& config) {
+  auto profile{find_profile(config.policy)};
+  if (!profile) {
+    return ErrorType::LOAD_SECCOMP_FAILED;
+  }
+  auto ctx{build(static_rules(*profile, config.debug_mode))};
+  if (!ctx) {
+    return ErrorType::LOAD_SECCOMP_FAILED;
+  }
+  // add extra rule for execve
+  if (seccomp_rule_add(
+          ctx.get(), SCMP_ACT_ALLOW, SCMP_SYS(execve), 1,
+          SCMP_A0(SCMP_CMP_EQ, (scmp_datum_t)(config.exe_path.c_str()))) !=
+      0) {
+    return ErrorType::LOAD_SECCOMP_FAILED;
+  }
+  if (seccomp_rule_add(ctx.get(), SCMP_ACT_ALLOW, SCMP_SYS(tgkill), 2,
+                       SCMP_A0(SCMP_CMP_EQ, (scmp_datum_t)(getpid())),
+                       SCMP_A1(SCMP_CMP_EQ, (scmp_datum_t)(gettid()))) != 0) {
+    return ErrorType::LOAD_SECCOMP_FAILED;
+  }
+  if (seccomp_load(ctx.get()) != 0) {
+    return ErrorType::LOAD_SECCOMP_FAILED;
+  }
+  return ErrorType::SUCCESS;
+}
+
+// FNV-1a over the rules, naming the cache file: a changed policy never
+// picks up a stale program.
+std::uint64_t fingerprint(const std::vector<Rule>& rules) {
+  std::uint64_t hash{0xcbf29ce484222325};
+  auto mix{[&](std::uint64_t value) {
+    for (int i{0}; i < 8; i++) {
+      hash ^= (value >> (i * 8)) & 0xff;
+      hash *= 0x100000001b3;
+    }
+  }};
+  for (auto& rule : rules) {
+    mix(rule.action);
+    mix(rule.syscall);
+    mix(rule.args.size());
+    for (auto& arg : rule.args) {
+      mix(arg.arg);
+      mix(arg.op);
+      mix(arg.datum_a);
+      mix(arg.datum_b);
+    }
+  }
+  return hash;
+}
+
+bool export_program(const std::vector<Rule>& rules,
+                    std::vector<sock_filter>& program) {
+  auto ctx{build(rules)};
+  if (!ctx) return false;
+  int fd{memfd_create("seccomp", MFD_CLOEXEC)};
+  if (fd == -1) return false;
+  struct stat st;
+  bool ok{seccomp_export_bpf(ctx.get(), fd) == 0 && fstat(fd, &st) == 0 &&
+          st.st_size % sizeof(sock_filter) == 0};
+  if (ok) {
+    program.resize(st.st_size / sizeof(sock_filter));
+    ok = pread(fd, program.data(), st.st_size, 0) == st.st_size;
+  }
+  close(fd);
+  return ok && !program.empty();
+}
+
+bool read_program(const std::string& path, std::vector<sock_filter>& program) {
+  std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+  if (!ifs) return false;
+  auto size{static_cast<std::size_t>(ifs.tellg())};
+  if (size == 0 || size % sizeof(sock_filter) != 0) return false;
+  program.resize(size / sizeof(sock_filter));
+  ifs.seekg(0);
+  return static_cast<bool>(
+      ifs.read(reinterpret_cast<char*>(program.data()), size));
+}
+
+// Write through a temporary file, so concurrent sandboxes never read half a
+// program.
+void write_program(const std::string& path,
+                   const std::vector<sock_filter>& program) {
+  auto tmp{path + "." + std::to_string(getpid())};
+  {
+    std::ofstream ofs(tmp, std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(program.data()),
+              program.size() * sizeof(sock_filter));
+    if (!ofs) {
+      unlink(tmp.c_str());
+      return;
+    }
+  }
+  if (rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+}
+
+// Prefix checking the per-run rules; every other syscall falls through to
+// the cached program. The constants at EXE_LOW, EXE_HIGH, PID and TID are
+// filled in by each child.
+constexpr const std::size_t EXE_LOW{5};
+constexpr const std::size_t EXE_HIGH{7};
+constexpr const std::size_t TGKILL{8};
+constexpr const std::size_t PID{10};
+constexpr const std::size_t TID{14};
+constexpr const std::size_t ALLOW{17};
+constexpr const std::size_t KILL{18};
+constexpr const std::size_t PREFIX_SIZE{19};
+
+// Jump offset from instruction `from` to instruction `to`.
+constexpr unsigned char skip(std::size_t from, std::size_t to) {
+  return to - from - 1;
+}
+
+constexpr std::uint32_t arg_low(int i) {
+  return offsetof(seccomp_data, args) + i * sizeof(std::uint64_t);
+}
+
+constexpr std::uint32_t arg_high(int i) {
+  return arg_low(i) + sizeof(std::uint32_t);
+}
+
+#define LOAD(offset) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset)
+#define JUMP_EQ(value, jt, jf) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, jt, jf)
+
+const sock_filter prefix[PREFIX_SIZE]{
+    /* 0 */ LOAD(offsetof(seccomp_data, arch)),
+    /* 1 */ JUMP_EQ(AUDIT_ARCH_X86_64, 0, skip(1, KILL)),
+    /* 2 */ LOAD(offsetof(seccomp_data, nr)),
+    /* 3 */ JUMP_EQ(__NR_execve, 0, skip(3, TGKILL)),
+    /* 4 */ LOAD(arg_low(0)),
+    /* 5 */ JUMP_EQ(0, 0, skip(EXE_LOW, KILL)),
+    /* 6 */ LOAD(arg_high(0)),
+    /* 7 */ JUMP_EQ(0, skip(EXE_HIGH, ALLOW), skip(EXE_HIGH, KILL)),
+    /* 8 */ JUMP_EQ(__NR_tgkill, 0, skip(TGKILL, PREFIX_SIZE)),
+    /* 9 */ LOAD(arg_low(0)),
+    /* 10 */ JUMP_EQ(0, 0, skip(PID, KILL)),
+    /* 11 */ LOAD(arg_high(0)),
+    /* 12 */ JUMP_EQ(0, 0, skip(12, KILL)),
+    /* 13 */ LOAD(arg_low(1)),
+    /* 14 */ JUMP_EQ(0, 0, skip(TID, KILL)),
+    /* 15 */ LOAD(arg_high(1)),
+    /* 16 */ JUMP_EQ(0, skip(16, ALLOW), skip(16, KILL)),
+    /* 17 */ BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    /* 18 */ BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_THREAD),
+};
+
+#undef LOAD
+#undef JUMP_EQ
+
+// Prefix followed by the cached program, by policy name.
+std::map<std::string, std::vector<sock_filter>> programs;
+
+}  // namespace
+
+bool load_policies(const std::string& path, std::string& error) {
+  load_builtin();
+  std::ifstream ifs(path);
+  if (!ifs) {
+    error = "cannot open " + path;
+    return false;
+  }
+  if (!parse_policies(ifs, error)) {
+    error = path + ": " + error;
+    return false;
+  }
+  return true;
+}
+
+bool has_policy(const std::string& name) {
+  return find_profile(name) != nullptr;
+}
+
+std::vector<std::string> policy_names() {
+  load_builtin();
+  std::vector<std::string> names;
+  for (auto& [name, profile] : profiles) names.push_back(name);
+  return names;
+}
+
+ErrorType prepare_seccomp(const SandboxConfig& config) {
+  auto name{policy_name(config)};
+  if (programs.count(name)) {
+    return ErrorType::SUCCESS;
+  }
+  auto profile{find_profile(config.policy)};
+  if (!profile) {
+    LOG(error, "Unknown seccomp policy", "policy", config.policy);
+    return ErrorType::INVALID_CONFIG;
+  }
+  auto rules{static_rules(*profile, config.debug_mode)};
+  std::string path;
+  if (!config.seccomp_cache.empty()) {
+    std::ostringstream oss;
+    oss << config.seccomp_cache << '/' << name << '-' << std::hex
+        << std::setw(16) << std::setfill('0') << fingerprint(rules) << ".bpf";
+    path = oss.str();
+  }
+
+  std::vector<sock_filter> program;
+  if (path.empty() || !read_program(path, program)) {
+    if (!export_program(rules, program)) {
+      LOG(error, "Failed to compile seccomp policy", "policy", name);
+      return ErrorType::LOAD_SECCOMP_FAILED;
+    }
+    if (!path.empty()) write_program(path, program);
+  } else {
+    LOG(info, "Seccomp policy read", "policy", name, "path", path);
+  }
+  if (PREFIX_SIZE + program.size() > BPF_MAXINSNS) {
+    return ErrorType::LOAD_SECCOMP_FAILED;
+  }
+  program.insert(program.begin(), std::begin(prefix), std::end(prefix));
+  programs[name] = std::move(program);
+  return ErrorType::SUCCESS;
+}
+
+ErrorType load_seccomp(const SandboxConfig& config) {
+  auto it{programs.find(policy_name(config))};
+  if (it == programs.end()) {
+    return compile_and_load(config);
+  }
+  // We are a forked child, so patching our copy of the program is private.
+  auto& program{it->second};
+  auto exe{reinterpret_cast<std::uintptr_t>(config.exe_path.c_str())};
+  program[EXE_LOW].k = static_cast<std::uint32_t>(exe);
+  program[EXE_HIGH].k = static_cast<std::uint32_t>(exe >> 32);
+  program[PID].k = getpid();
+  program[TID].k = gettid();
+  sock_fprog prog{static_cast<unsigned short>(program.size()), program.data()};
+  if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ||
+      prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) != 0) {
+    return ErrorType::LOAD_SECCOMP_FAILED;
+  }
+  return ErrorType::SUCCESS;
+}
@@ -0,0 +1,61 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "runner.h"
+
+// Seccomp policies are named profiles of rules. The built-in profile `c_cpp`
+// is the default; more can be loaded from a file with load_policies(), in
+// this format:
+//
+//   [name]                       starts a profile
+//   include <profile>            copies the rules of an earlier profile
+//   allow <syscall>...           allows syscalls
+//   allow <syscall> <cond>, ...  allows a syscall if all conditions hold
+//   allow_debug ...              as allow, in debug mode only
+//   errno <n> <syscall>...       fails syscalls with errno n
+//
+// where a condition is `a<N> <op> <value>` with op one of == != < <= > >=,
+// or `a<N> & <mask> == <value>`, and `#` starts a comment. A profile defined
+// again, the built-in one included, replaces the earlier definition. Returns
+// false and describes the problem in `error` if the file is invalid.
+bool load_policies(const std::string& path, std::string& error);
+bool has_policy(const std::string& name);
+std::vector<std::string> policy_names();
+
+// Compiling a policy with libseccomp costs far more than the fork it guards,
+// so the parent compiles it once per policy and children
+// only patch in their own execve pointer and pid and install it.
+//
+// The cached program is everything but the per-run rules (execve of the
+// executable, tgkill of the child itself), exported with seccomp_export_bpf.
+// Those two rules are checked by a short hand-written prefix whose constants
+// each child fills in, so the whole filter goes in with one prctl().
+
+// Compile the policy of `config` unless this process has done so already.
+// With `config.seccomp_cache` the program is also read from or stored in that
+// directory. Call in the parent before forking; if this fails, children fall
+// back to compiling the filter themselves.
+ErrorType prepare_seccomp(const SandboxConfig& config);
+
+// Install the policy of `config` in the calling process, which must be
+// single-threaded and about to execve `config.exe_path`.
+ErrorType load_seccomp(const SandboxConfig& config);
@@ -0,0 +1,583 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "session.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "log.h"
+#include "options.h"
+#include "result_codec.h"
+#include "runner.h"
+#include "seccomp_filter.h"
+#include "zygote.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+// Largest frame a client may send.
+constexpr const std::size_t MAX_PAYLOAD{1 << 20};
+constexpr const std::size_t OUTPUT_LIMIT{64 * 1024};
+constexpr const std::size_t INPUT_LIMIT{64 * 1024};
+constexpr const std::size_t CLIENT_LIMIT{1 << 20};
+// A frame this large means the program writes faster than we flush.
+constexpr const std::size_t LARGE_FRAME{16 * 1024};
+constexpr const Clock::duration MIN_INTERVAL{1ms};
+constexpr const Clock::duration MAX_INTERVAL{32ms};
+
+struct Session {
+  // The pty master. Kept open until the session is over: closing it hangs up
+  // the pty, and SIGHUP would kill the helper.
+  int master;
+  // Set once every copy of the slave is closed and the output read.
+  bool eof;
+  // Runs the program; -1 once reaped.
+  pid_t helper;
+  // The helper writes the SandboxResult here; -1 once read.
+  int result_fd;
+  std::string result;
+  std::string output;
+  // Bytes the program may still write, or UNLIMITED.
+  long output_left;
+  std::string input;
+  // When `output` is due, if not empty.
+  Clock::time_point flush_at;
+  Clock::duration interval;
+};
+
+struct Client {
+  int fd;
+  std::string in;
+  std::string out;
+  std::map<std::uint32_t, Session> sessions;
+};
+
+void put32(std::string& s, std::uint32_t value) {
+  for (int i{0}; i < 4; i++) s.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+std::uint32_t get32(const char* p) {
+  std::uint32_t value{0};
+  for (int i{0}; i < 4; i++) {
+    value |= static_cast<std::uint32_t>(static_cast<unsigned char>(p[i]))
+             << (8 * i);
+  }
+  return value;
+}
+
+void append_frame(std::string& out, SessionFrame type, std::uint32_t id,
+                  const std::string& payload) {
+  out.push_back(static_cast<char>(type));
+  put32(out, id);
+  put32(out, payload.size());
+  out += payload;
+}
+
+void append_result(std::string& out, std::uint32_t id,
+                   const SandboxResult& result) {
+  append_frame(out, SessionFrame::RESULT, id, encode_result(result));
+}
+
+SandboxResult error_result(ErrorType e) {
+  SandboxResult result{};
+  result.error = e;
+  result.result = ResultType::SYSTEM_ERROR;
+  return result;
+}
+
+class Server {
+ public:
+  explicit Server(int listen_fd)
+      : listen_fd_{listen_fd}, desc_{job_options(job_)} {}
+  // `desc_` points into `job_`.
+  Server(const Server&) = delete;
+  Server& operator=(const Server&) = delete;
+
+  [[noreturn]] void serve();
+
+ private:
+  enum class Target { CLIENT, MASTER, RESULT };
+
+  bool parse(const std::string& block, SandboxConfig& config);
+  void open(Client& client, std::uint32_t id, const std::string& options);
+  [[noreturn]] void helper(int slave, int result_fd,
+                           const SandboxConfig& config);
+  void end(Session& session);
+  void read_master(Session& session);
+  void write_master(Session& session);
+  void read_result(Session& session);
+  bool read_client(Client& client);
+  bool handle(Client& client, SessionFrame type, std::uint32_t id,
+              const std::string& payload);
+  void flush(Client& client, Clock::time_point now);
+  bool send_out(Client& client);
+  void drop(Client& client);
+
+  int listen_fd_;
+  SandboxConfig job_;
+  boost::program_options::options_description desc_;
+  std::map<std::uint64_t, Client> clients_;
+  std::uint64_t next_id_{0};
+};
+
+bool Server::parse(const std::string& block, SandboxConfig& config) {
+  namespace po = boost::program_options;
+  job_ = SandboxConfig{};
+  try {
+    po::variables_map vm;
+    std::istringstream iss(block);
+    po::store(po::parse_config_file(iss, desc_), vm);
+    po::notify(vm);
+    if (job_.exe_path.empty()) {
+      throw po::error("exe_path is not specified");
+    }
+  } catch (const po::error& e) {
+    LOG(error, "Bad session", "error", e.what());
+    return false;
+  }
+  config = job_;
+  return true;
+}
+
+void Server::open(Client& client, std::uint32_t id,
+                  const std::string& options) {
+  SandboxConfig config;
+  if (!parse(options, config)) {
+    append_result(client.out, id, error_result(ErrorType::INVALID_CONFIG));
+    return;
+  }
+
+  int master{posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)};
+  char name[64];
+  int slave{-1};
+  if (master != -1 && grantpt(master) == 0 && unlockpt(master) == 0 &&
+      ptsname_r(master, name, sizeof(name)) == 0) {
+    slave = ::open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  }
+  int result_pipe[2]{-1, -1};
+  if (slave == -1 || pipe2(result_pipe, O_CLOEXEC) == -1) {
+    LOG(error, "Cannot open a pty", "error", strerror(errno));
+    for (int fd : {master, slave}) {
+      if (fd != -1) close(fd);
+    }
+    append_result(client.out, id, error_result(ErrorType::DUP2_FAILED));
+    return;
+  }
+  winsize size{24, 80, 0, 0};
+  ioctl(master, TIOCSWINSZ, &size);
+
+  pid_t pid{fork()};
+  if (pid == 0) {
+    close(master);
+    close(result_pipe[0]);
+    helper(slave, result_pipe[1], config);
+  }
+  close(slave);
+  close(result_pipe[1]);
+  if (pid == -1) {
+    close(master);
+    close(result_pipe[0]);
+    append_result(client.out, id, error_result(ErrorType::FORK_FAILED));
+    return;
+  }
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  client.sessions[id] = Session{master,
+                                false,
+                                pid,
+                                result_pipe[0],
+                                {},
+                                {},
+                                config.max_output_size,
+                                {},
+                                {},
+                                MIN_INTERVAL};
+  LOG(info, "Session opened", "id", id, "exe", config.exe_path, "pid", pid);
+}
+
+// Run the program on the slave and report its result. A process of its own,
+// since run() only returns once the program has ended.
+void Server::helper(int slave, int result_fd, const SandboxConfig& config) {
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  // Other sessions' ptys must hang up when their programs end, not when
+  // this one does.
+  close(listen_fd_);
+  for (auto& [_, client] : clients_) {
+    close(client.fd);
+    for (auto& [_, session] : client.sessions) {
+      close(session.master);
+      if (session.result_fd != -1) close(session.result_fd);
+    }
+  }
+  // The pty becomes the program's terminal, so that Ctrl+C interrupts it,
+  // and a new session its process group, so that end() can kill both.
+  setsid();
+  ioctl(slave, TIOCSCTTY, 0);
+  signal(SIGINT, SIG_IGN);
+  // Meant for the program, see read_master().
+  signal(SIGXFSZ, SIG_IGN);
+  set_zygotes(0);
+  // run() closes each of them.
+  const int stdio[3]{slave, dup(slave), dup(slave)};
+  auto result{run(config, stdio)};
+  _exit(write(result_fd, &result, sizeof(result)) == sizeof(result)
+            ? EXIT_SUCCESS
+            : EXIT_FAILURE);
+}
+
+void Server::end(Session& session) {
+  if (session.helper != -1) {
+    kill(-session.helper, SIGKILL);
+    kill(session.helper, SIGKILL);
+    waitpid(session.helper, nullptr, 0);
+    session.helper = -1;
+  }
+  for (int* fd : {&session.master, &session.result_fd}) {
+    if (*fd != -1) close(*fd);
+    *fd = -1;
+  }
+}
+
+void Server::read_master(Session& session) {
+  char buf[16384];
+  while (session.output.size() < OUTPUT_LIMIT) {
+    auto n{read(session.master, buf,
+                std::min(sizeof(buf), OUTPUT_LIMIT - session.output.size()))};
+    if (n > 0 && session.output_left != UNLIMITED) {
+      if (n > session.output_left) {
+        // As if the pty were a file past RLIMIT_FSIZE, so that the result
+        // says output limit exceeded. The rest of the output is dropped.
+        n = session.output_left;
+        if (session.helper != -1) kill(-session.helper, SIGXFSZ);
+      }
+      session.output_left -= n;
+      if (n == 0) continue;
+    }
+    if (n > 0) {
+      if (session.output.empty()) {
+        session.flush_at = Clock::now() + session.interval;
+      }
+      session.output.append(buf, n);
+      continue;
+    }
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    // EIO: every copy of the slave is closed, so the program has ended.
+    session.eof = true;
+    session.input.clear();
+    return;
+  }
+}
+
+void Server::write_master(Session& session) {
+  while (!session.input.empty()) {
+    auto n{write(session.master, session.input.data(), session.input.size())};
+    if (n > 0) {
+      session.input.erase(0, n);
+    } else if (n == -1 && errno == EINTR) {
+      continue;
+    } else {
+      if (n == -1 && errno != EAGAIN) session.input.clear();
+      return;
+    }
+  }
+}
+
+void Server::read_result(Session& session) {
+  char buf[sizeof(SandboxResult)];
+  auto n{read(session.result_fd, buf, sizeof(buf))};
+  if (n == -1 && errno == EINTR) return;
+  if (n > 0) {
+    session.result.append(buf, n);
+    return;
+  }
+  close(session.result_fd);
+  session.result_fd = -1;
+  waitpid(session.helper, nullptr, 0);
+  session.helper = -1;
+}
+
+// Read what the client sent and act on every complete frame. Returns false
+// if the connection should be dropped.
+bool Server::read_client(Client& client) {
+  char buf[65536];
+  auto n{read(client.fd, buf, sizeof(buf))};
+  if (n == -1 && (errno == EINTR || errno == EAGAIN)) return true;
+  if (n <= 0) return false;
+  client.in.append(buf, n);
+
+  std::size_t pos{0};
+  while (client.in.size() - pos >= SESSION_HEADER_SIZE) {
+    auto header{client.in.data() + pos};
+    auto type{static_cast<SessionFrame>(header[0])};
+    auto id{get32(header + 1)};
+    auto size{get32(header + 5)};
+    if (size > MAX_PAYLOAD) return false;
+    if (client.in.size() - pos < SESSION_HEADER_SIZE + size) break;
+    auto payload{client.in.substr(pos + SESSION_HEADER_SIZE, size)};
+    pos += SESSION_HEADER_SIZE + size;
+    if (!handle(client, type, id, payload)) return false;
+  }
+  client.in.erase(0, pos);
+  return true;
+}
+
+bool Server::handle(Client& client, SessionFrame type, std::uint32_t id,
+                    const std::string& payload) {
+  if (type == SessionFrame::OPEN) {
+    if (client.sessions.count(id)) return false;
+    open(client, id, payload);
+    return true;
+  }
+  auto it{client.sessions.find(id)};
+  switch (type) {
+    case SessionFrame::CLOSE:
+      if (it != client.sessions.end()) {
+        end(it->second);
+        client.sessions.erase(it);
+        LOG(info, "Session closed", "id", id);
+      }
+      return true;
+    case SessionFrame::INPUT:
+    case SessionFrame::END_OF_INPUT: {
+      // The program may just have ended.
+      if (it == client.sessions.end() || it->second.eof) return true;
+      auto& session{it->second};
+      auto input{payload};
+      if (type == SessionFrame::END_OF_INPUT) {
+        termios attr;
+        input = tcgetattr(session.master, &attr) == 0
+                    ? static_cast<char>(attr.c_cc[VEOF])
+                    : '\x04';
+      }
+      auto room{INPUT_LIMIT - session.input.size()};
+      if (input.size() > room) {
+        LOG(warning, "Session input dropped", "id", id, "bytes",
+            input.size() - room);
+        input.resize(room);
+      }
+      session.input += input;
+      write_master(session);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Frame the output of every session that is due, and send the results of
+// those that are over.
+void Server::flush(Client& client, Clock::time_point now) {
+  for (auto it{client.sessions.begin()}; it != client.sessions.end();) {
+    auto& [id, session]{*it};
+    if (!session.output.empty() && client.out.size() < CLIENT_LIMIT &&
+        (now >= session.flush_at || session.output.size() >= OUTPUT_LIMIT ||
+         session.eof)) {
+      append_frame(client.out, SessionFrame::OUTPUT, id, session.output);
+      session.interval = session.output.size() >= LARGE_FRAME
+                             ? std::min(session.interval * 2, MAX_INTERVAL)
+                             : std::max(session.interval / 2, MIN_INTERVAL);
+      session.output.clear();
+    }
+    if (!session.eof || session.result_fd != -1 || !session.output.empty()) {
+      ++it;
+      continue;
+    }
+    SandboxResult result{error_result(ErrorType::WORKER_FAILED)};
+    if (session.result.size() == sizeof(result)) {
+      std::memcpy(&result, session.result.data(), sizeof(result));
+    }
+    append_result(client.out, id, result);
+    close(session.master);
+    LOG(info, "Session ended", "id", id);
+    it = client.sessions.erase(it);
+  }
+}
+
+bool Server::send_out(Client& client) {
+  while (!client.out.empty()) {
+    auto n{send(client.fd, client.out.data(), client.out.size(),
+                MSG_NOSIGNAL)};
+    if (n > 0) {
+      client.out.erase(0, n);
+    } else if (n == -1 && errno == EINTR) {
+      continue;
+    } else {
+      return n == -1 && errno == EAGAIN;
+    }
+  }
+  return true;
+}
+
+void Server::drop(Client& client) {
+  for (auto& [_, session] : client.sessions) end(session);
+  client.sessions.clear();
+  close(client.fd);
+  client.fd = -1;
+}
+
+void Server::serve() {
+  std::vector<pollfd> fds;
+  struct Watched {
+    Target target;
+    Client* client;
+    Session* session;
+  };
+  std::vector<Watched> watched;
+  while (true) {
+    fds.clear();
+    watched.clear();
+    fds.push_back({listen_fd_, POLLIN, 0});
+    watched.push_back({Target::CLIENT, nullptr, nullptr});
+    auto now{Clock::now()};
+    auto wake{Clock::time_point::max()};
+    for (auto& [_, client] : clients_) {
+      short events(POLLIN | (client.out.empty() ? 0 : POLLOUT));
+      fds.push_back({client.fd, events, 0});
+      watched.push_back({Target::CLIENT, &client, nullptr});
+      for (auto& [_, session] : client.sessions) {
+        // A full session is not polled at all: its hangup would wake us up
+        // again and again until there is room to read.
+        bool room{session.output.size() < OUTPUT_LIMIT};
+        if (!session.eof && (room || !session.input.empty())) {
+          fds.push_back(
+              {session.master,
+               static_cast<short>((room ? POLLIN : 0) |
+                                  (session.input.empty() ? 0 : POLLOUT)),
+               0});
+          watched.push_back({Target::MASTER, &client, &session});
+        }
+        if (session.result_fd != -1) {
+          fds.push_back({session.result_fd, POLLIN, 0});
+          watched.push_back({Target::RESULT, &client, &session});
+        }
+        // A backlogged client wakes us up once it can take more.
+        if (!session.output.empty() && client.out.size() < CLIENT_LIMIT) {
+          wake = std::min(wake, session.flush_at);
+        }
+      }
+    }
+    int timeout{-1};
+    if (wake != Clock::time_point::max()) {
+      timeout = wake <= now
+                    ? 0
+                    : std::chrono::ceil<std::chrono::milliseconds>(wake - now)
+                          .count();
+    }
+
+    if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR) {
+      LOG(fatal, "poll failed", "error", strerror(errno));
+      std::exit(EXIT_FAILURE);
+    }
+
+    // Sessions first: frames read from clients may end them.
+    for (std::size_t i{1}; i < fds.size(); i++) {
+      if (!fds[i].revents) continue;
+      auto& w{watched[i]};
+      if (w.target == Target::MASTER) {
+        if (fds[i].revents & POLLOUT) write_master(*w.session);
+        if (fds[i].revents & ~POLLOUT) read_master(*w.session);
+      } else if (w.target == Target::RESULT) {
+        read_result(*w.session);
+      }
+    }
+    for (std::size_t i{1}; i < fds.size(); i++) {
+      auto& w{watched[i]};
+      if (w.target != Target::CLIENT || w.client->fd == -1) continue;
+      if ((fds[i].revents & ~POLLOUT) && !read_client(*w.client)) {
+        drop(*w.client);
+      }
+    }
+
+    now = Clock::now();
+    for (auto it{clients_.begin()}; it != clients_.end();) {
+      auto& client{it->second};
+      if (client.fd != -1) {
+        flush(client, now);
+        if (!send_out(client)) drop(client);
+      }
+      it = client.fd == -1 ? clients_.erase(it) : std::next(it);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd{accept4(listen_fd_, nullptr, nullptr,
+                     SOCK_CLOEXEC | SOCK_NONBLOCK)};
+      if (fd != -1) clients_[next_id_++] = Client{fd, {}, {}, {}};
+    }
+  }
+}
+
+}  // namespace
+
+int serve_sessions(const std::string& socket_path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << socket_path << std::endl;
+    return 1;
+  }
+  std::strcpy(addr.sun_path, socket_path.c_str());
+
+  int listen_fd{socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+  unlink(socket_path.c_str());
+  if (listen_fd == -1 ||
+      bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+          -1 ||
+      listen(listen_fd, SOMAXCONN) == -1) {
+    std::cerr << "Failed to listen on " << socket_path << ": "
+              << strerror(errno) << std::endl;
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  // Compile every seccomp policy before the helpers are forked, so that
+  // choosing one costs a session nothing.
+  for (auto& name : policy_names()) {
+    for (bool debug_mode : {false, true}) {
+      SandboxConfig policy{};
+      policy.policy = name;
+      policy.debug_mode = debug_mode;
+      prepare_seccomp(policy);
+    }
+  }
+
+  LOG(info, "Session server listening", "socket", socket_path);
+  Server server{listen_fd};
+  server.serve();
+}
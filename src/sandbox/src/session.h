@@ -0,0 +1,61 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Interactive sessions over one Unix stream socket, each a program whose
+// stdin, stdout and stderr are the slave of a pty of its own. A connection
+// carries any number of sessions as frames, both ways:
+//
+//   u8 type, u32 session id, u32 payload size, payload  (little-endian)
+//
+// The client sends OPEN with the options of the run as in daemon mode
+// (`option=value` lines), INPUT with keystrokes, END_OF_INPUT to type the EOF
+// character, and CLOSE to kill the program, after which nothing more comes
+// for the session. The server sends OUTPUT with what the program wrote
+// (echoed input included, as on a terminal), then, once the program has ended
+// and all of its output is sent, RESULT with the binary result frame (see
+// result_codec.h). Session ids are the client's choice, and free again after
+// the result or CLOSE.
+//
+// Output of a session is coalesced into frames: flushed after an interval
+// that starts at 1 ms and doubles, up to 32 ms, while frames come out large,
+// and halves again once the program writes little. A session buffers at most
+// 64 KiB of output, beyond which its pty is not read, so the program blocks
+// on its writes; and no session is flushed to a client that has 1 MiB not yet
+// sent. Input beyond 64 KiB that the program has not read is dropped, as a
+// terminal drops what does not fit its line.
+
+enum class SessionFrame : std::uint8_t {
+  OPEN = 'O',
+  INPUT = 'I',
+  END_OF_INPUT = 'E',
+  CLOSE = 'C',
+  OUTPUT = 'o',
+  RESULT = 'r',
+};
+
+constexpr const std::size_t SESSION_HEADER_SIZE{9};
+
+// Listen on `socket_path` and serve sessions until killed. Returns the
+// process exit code.
+int serve_sessions(const std::string& socket_path);
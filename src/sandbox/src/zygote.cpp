@@ -0,0 +1,334 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "zygote.h"
+
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "child.h"
+#include "log.h"
+#include "namespaces.h"
+
+namespace {
+
+// A job bigger than this, mostly argv and envp, gets a freshly forked child.
+constexpr const std::size_t MAX_JOB_SIZE{1 << 16};
+
+struct Parked {
+  pid_t pid;
+  // Our end of the socket the child waits on.
+  int fd;
+};
+
+struct Pool {
+  unsigned size{0};
+  // The process the children were forked from. A worker forked from us
+  // starts with an empty pool of its own.
+  pid_t owner{-1};
+  // Each child has its own copy of the cgroup map, as of its fork; it can
+  // only join a group that existed by then.
+  const Cgroup* cgroup{nullptr};
+  // Whether a run was launched since, and the group of the latest one and
+  // whether it was namespaced, which the next runs most likely share.
+  bool launched{false};
+  const Cgroup* last_cgroup{nullptr};
+  bool last_namespaces{false};
+  // Whether they start in the pid namespace of the namespace template, and
+  // know the template. Only namespaced runs may take them, and only them.
+  bool isolated{false};
+  std::deque<Parked> parked;
+} pool;
+
+// A job travels as the SandboxConfig fields the child uses, in native byte
+// order: both ends are the same binary.
+class Writer {
+ public:
+  template <typename T>
+  void field(const T& value) {
+    data_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void field(const std::string& s) {
+    field(s.size());
+    data_.append(s);
+  }
+  void field(const std::vector<std::string>& v) {
+    field(v.size());
+    for (auto& s : v) field(s);
+  }
+
+  const std::string& data() const {
+    return data_;
+  }
+
+ private:
+  std::string data_;
+};
+
+class Reader {
+ public:
+  Reader(const char* data, std::size_t size)
+      : p_{data}, end_{data + size} {}
+
+  template <typename T>
+  void field(T& value) {
+    if (!take(sizeof(value))) return;
+    std::memcpy(&value, p_ - sizeof(value), sizeof(value));
+  }
+  void field(std::string& s) {
+    std::size_t size{0};
+    field(size);
+    if (take(size)) s.assign(p_ - size, size);
+  }
+  void field(std::vector<std::string>& v) {
+    std::size_t size{0};
+    field(size);
+    v.clear();
+    for (std::size_t i{0}; i < size && ok_; i++) field(v.emplace_back());
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+ private:
+  bool take(std::size_t size) {
+    if (!ok_ || static_cast<std::size_t>(end_ - p_) < size) {
+      ok_ = false;
+      return false;
+    }
+    p_ += size;
+    return true;
+  }
+
+  const char* p_;
+  const char* end_;
+  bool ok_{true};
+};
+
+template <typename Archive, typename Config>
+void fields(Archive& archive, Config& config) {
+  archive.field(config.max_cpu_time);
+  archive.field(config.max_real_time);
+  archive.field(config.max_memory);
+  archive.field(config.max_stack);
+  archive.field(config.max_process_number);
+  archive.field(config.max_output_size);
+  archive.field(config.debug_mode);
+  archive.field(config.memfd_io);
+  archive.field(config.exe_path);
+  archive.field(config.input_path);
+  archive.field(config.output_path);
+  archive.field(config.error_path);
+  archive.field(config.args);
+  archive.field(config.env);
+  archive.field(config.policy);
+  archive.field(config.cgroup_root);
+  archive.field(config.seccomp_cache);
+  archive.field(config.namespaces);
+  archive.field(config.tmpfs_size);
+  archive.field(config.uid);
+  archive.field(config.gid);
+}
+
+// Wait on `fd` for a job, then become its child. Whatever can be done
+// without the job is done before.
+[[noreturn]] void park(int fd, pid_t parent) {
+  // Do not outlive the process, even if it is killed.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  // In the pid namespace of the namespace template the parent is outside,
+  // pid 0 to us.
+  auto ppid{getppid()};
+  if (ppid != parent && ppid != 0) _exit(EXIT_FAILURE);
+  // An earlier run or a session helper may have left these ignored, and
+  // ignored signals stay ignored across execve().
+  signal(SIGINT, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  signal(SIGXFSZ, SIG_DFL);
+  std::string job(MAX_JOB_SIZE, '\0');
+
+  // stdin, stdout, stderr and maybe the start fd for child().
+  int fds[4]{-1, -1, -1, -1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+  iovec iov{job.data(), job.size()};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  do {
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  auto cmsg{CMSG_FIRSTHDR(&msg)};
+  // The pool let go of us.
+  if (n <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len < CMSG_LEN(sizeof(int) * 3)) {
+    _exit(EXIT_SUCCESS);
+  }
+  // Close-on-exec, unlike their copies as stdio.
+  std::memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+
+  Reader reader{job.data(), static_cast<std::size_t>(n)};
+  bool use_cgroup{false};
+  SandboxConfig config{};
+  reader.field(use_cgroup);
+  fields(reader, config);
+  if (!reader.ok()) _exit(EXIT_FAILURE);
+  for (int i{0}; i < 3; i++) {
+    if (dup2(fds[i], i) < 0) {
+      LOG(fatal, "Fatal error", "error",
+          error_msg[static_cast<int>(ErrorType::DUP2_FAILED)]);
+      flush_log();
+      std::abort();
+    }
+  }
+
+  child(config, use_cgroup ? pool.cgroup : nullptr, fds[3]);
+}
+
+// Let go of the parked children. Without their socket they exit.
+void drain(std::size_t keep = 0) {
+  while (pool.parked.size() > keep) {
+    auto parked{pool.parked.back()};
+    pool.parked.pop_back();
+    close(parked.fd);
+    waitpid(parked.pid, nullptr, 0);
+  }
+}
+
+// Take over the pool in a process forked from its owner. The children are
+// not ours to wait for.
+void own_pool() {
+  if (pool.owner == getpid()) return;
+  for (auto& parked : pool.parked) close(parked.fd);
+  pool.parked.clear();
+  pool.owner = getpid();
+  pool.cgroup = nullptr;
+  pool.launched = false;
+  pool.last_cgroup = nullptr;
+  pool.last_namespaces = false;
+  pool.isolated = false;
+}
+
+bool send_job(int fd, const std::string& job, const int* fds,
+              std::size_t count) {
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)]{};
+  iovec iov{const_cast<char*>(job.data()), job.size()};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+  auto cmsg{CMSG_FIRSTHDR(&msg)};
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  ssize_t n;
+  do {
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (n == -1 && errno == EINTR);
+  return n == static_cast<ssize_t>(job.size());
+}
+
+}  // namespace
+
+void set_zygotes(unsigned count) {
+  pool.size = count;
+}
+
+pid_t launch_zygote(const SandboxConfig& config, const Cgroup* cgroup,
+                    const int stdio[3], int start_fd) {
+  own_pool();
+  pool.launched = true;
+  pool.last_cgroup = cgroup;
+  pool.last_namespaces = config.namespaces;
+  if (pool.parked.empty() || cgroup != pool.cgroup ||
+      config.namespaces != pool.isolated) {
+    return -1;
+  }
+
+  Writer writer;
+  writer.field(cgroup != nullptr);
+  fields(writer, config);
+  if (writer.data().size() > MAX_JOB_SIZE) return -1;
+  int fds[4]{stdio[0], stdio[1], stdio[2], start_fd};
+  for (int i{0}; i < 3; i++) {
+    if (fds[i] == -1) fds[i] = i;
+  }
+  std::size_t count{start_fd != -1 ? 4u : 3u};
+
+  while (!pool.parked.empty()) {
+    auto parked{pool.parked.front()};
+    pool.parked.pop_front();
+    bool sent{send_job(parked.fd, writer.data(), fds, count)};
+    close(parked.fd);
+    if (sent) return parked.pid;
+    LOG(warning, "Parked child is gone", "pid", parked.pid);
+    kill(parked.pid, SIGKILL);
+    waitpid(parked.pid, nullptr, 0);
+  }
+  return -1;
+}
+
+void refill_zygotes() {
+  own_pool();
+  // Not before the first run: what children need, such as the cgroup or the
+  // output memfd of a batch worker, is set up by then.
+  if (!pool.launched) return;
+  bool isolated{pool.last_namespaces && namespaces_ready()};
+  if (pool.last_cgroup != pool.cgroup || pool.isolated != isolated) {
+    drain();
+    pool.cgroup = pool.last_cgroup;
+    pool.isolated = isolated;
+  }
+  drain(pool.size);
+  auto parent{getpid()};
+  while (pool.parked.size() < pool.size) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+      LOG(warning, "Cannot park a child", "error", strerror(errno));
+      return;
+    }
+    pid_t pid{-1};
+    if (!isolated || select_pid_namespace(true)) pid = fork();
+    if (pid == 0) {
+      close(sv[0]);
+      for (auto& parked : pool.parked) close(parked.fd);
+      park(sv[1], parent);
+    }
+    if (isolated) select_pid_namespace(false);
+    close(sv[1]);
+    if (pid == -1) {
+      LOG(warning, "Cannot park a child", "error", strerror(errno));
+      close(sv[0]);
+      return;
+    }
+    pool.parked.push_back({pid, sv[0]});
+  }
+}
@@ -0,0 +1,49 @@
+// Copyright (C) 2021 Clavicode Team
+//
+// This file is part of clavicode-backend.
+//
+// clavicode-backend is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// clavicode-backend is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with clavicode-backend.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "cgroup.h"
+#include "runner.h"
+
+// A pool of children forked ahead of time, each parked on a socket until a
+// run hands it a job. The fork -- copying the page tables of the whole
+// sandbox process -- then happens between runs rather than after a job is
+// submitted, and the child only applies the job's limits, fds and seccomp
+// policy before the exec.
+//
+// Parked children are forks of the process at the time they were made: they
+// share the compiled seccomp programs, the cgroup and the namespace template
+// of that time, and die with the process.
+
+// Keep `count` children parked in each process that runs jobs; 0 (the
+// default) forks every child on demand. Takes effect at the next run.
+void set_zygotes(unsigned count);
+
+// Hand a job to a parked child, which then does what a child forked by run()
+// does, with `stdio` (-1 for ours) as its stdin, stdout and stderr and
+// `start_fd` (or -1) passed to child(). Returns the child's pid, or -1 if
+// there is no suitable child; the caller then forks.
+pid_t launch_zygote(const SandboxConfig& config, const Cgroup* cgroup,
+                    const int stdio[3], int start_fd);
+
+// Fork children until the pool is full, for the cgroup of the latest run.
+// Called between runs while no job is waiting, so that no job waits for it.
+void refill_zygotes();
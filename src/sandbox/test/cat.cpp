@@ -0,0 +1,10 @@
+#include <cstdio>
+
+// Copy stdin to stdout as it is.
+int main() {
+  char buf[4096];
+  std::size_t n;
+  while ((n = std::fread(buf, 1, sizeof(buf), stdin)) > 0) {
+    std::fwrite(buf, 1, n, stdout);
+  }
+}
@@ -0,0 +1,26 @@
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+// A checker: `check <input> <output> <answer>`. Accepts the same bytes,
+// calls the same words otherwise a presentation error.
+std::string read(const char* path) {
+  std::ifstream ifs(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(ifs), {}};
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) return 3;
+  auto output{read(argv[2])};
+  auto answer{read(argv[3])};
+  if (output == answer) return 0;
+  std::istringstream out(output), ans(answer);
+  std::string a, b;
+  while (true) {
+    bool more_out{static_cast<bool>(out >> a)};
+    bool more_ans{static_cast<bool>(ans >> b)};
+    if (more_out != more_ans || (more_out && a != b)) return 1;
+    if (!more_out) return 2;
+  }
+}
@@ -0,0 +1,13 @@
+#include <cstdio>
+#include <cstdlib>
+
+char buf[1 << 16];
+
+// Write argv[1] MiB, 256 MiB by default.
+int main(int argc, char** argv) {
+  int chunks{(argc > 1 ? std::atoi(argv[1]) : 256) * 16};
+  for (auto& c : buf) c = 'x';
+  for (int i{0}; i < chunks; ++i) {
+    std::fwrite(buf, 1, sizeof(buf), stdout);
+  }
+}
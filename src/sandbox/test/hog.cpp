@@ -0,0 +1,12 @@
+#include <cstring>
+#include <vector>
+
+// Allocate and touch memory 1 MiB at a time until killed.
+int main() {
+  std::vector<char*> blocks;
+  while (true) {
+    auto p{new char[1 << 20]};
+    std::memset(p, 1, 1 << 20);
+    blocks.push_back(p);
+  }
+}
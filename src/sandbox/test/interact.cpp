@@ -0,0 +1,19 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// An interactor for _chat: `interact <input> <output> <answer>`. Sends it
+// the lines of <input> one by one and checks every reply before the next.
+int main(int argc, char* argv[]) {
+  if (argc != 4) return 3;
+  std::ifstream input(argv[1]);
+  std::string line, reply;
+  while (std::getline(input, line)) {
+    std::cout << line << std::endl;
+    if (!std::getline(std::cin, reply)) return 1;
+    if (reply != "You've input " + std::to_string(line.length()) +
+                     " characters!") {
+      return 1;
+    }
+  }
+}
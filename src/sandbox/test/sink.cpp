@@ -0,0 +1,12 @@
+#include <cstdio>
+
+char buf[1 << 16];
+
+int main() {
+  unsigned long total{0};
+  unsigned long n;
+  while ((n = std::fread(buf, 1, sizeof(buf), stdin)) > 0) {
+    total += n;
+  }
+  std::printf("%lu\n", total);
+}
@@ -0,0 +1,9 @@
+#include <cstdio>
+#include <ctime>
+
+// Print when main() starts, in nanoseconds on the monotonic clock.
+int main() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  std::printf("%ld\n", ts.tv_sec * 1000000000L + ts.tv_nsec);
+}